@@ -27,6 +27,11 @@ public:
 		return _data.ptr();
 	}
 
+	// Makes the data unique first, so the pointer can then be written to from several threads
+	inline T *raw_write() {
+		return _data.size() ? &_data[0] : NULL;
+	}
+
 	inline T operator[](int i) const {
 		return _data[i];
 	}
@@ -1,7 +1,9 @@
 #include <scene/3d/camera.h>
 #include <engine.h>
+#include <core_string_names.h>
 
 #include "height_map.h"
+#include "thread_pool.h"
 #include "utility.h"
 #include "resources.gen.cpp"
 
@@ -13,6 +15,17 @@ const char *HeightMap::SHADER_PARAM_MASK_TEXTURE = "mask_texture";
 const char *HeightMap::SHADER_PARAM_RESOLUTION = "heightmap_resolution";
 const char *HeightMap::SHADER_PARAM_INVERSE_TRANSFORM = "heightmap_inverse_transform";
 
+// Chunks are cut where the proxy starts, custom shaders need to do the same
+#define SHADER_PARAM_VIEWER_POSITION "heightmap_viewer_position"
+#define SHADER_PARAM_MAX_DISTANCE "heightmap_max_distance"
+// The proxy is cut where chunks end. Shaders declaring it can be used for the proxy too.
+#define SHADER_PARAM_MIN_DISTANCE "heightmap_min_distance"
+
+// Below this amount of rays, splitting work across threads costs more than it saves
+#define RAYCAST_BATCH_MIN_SIZE 64
+#define SAMPLE_BATCH_MIN_SIZE 1024
+#define OVERLAP_BATCH_MIN_SIZE 16
+
 namespace {
 
 	struct EnterWorldAction {
@@ -47,7 +60,31 @@ namespace {
 			visible = v;
 		}
 		void operator()(HeightMapChunk &chunk) {
-			chunk.set_visible(visible);
+			chunk.set_visible(visible && chunk.is_active());
+		}
+	};
+
+	struct GatherOccludeesAction {
+		Vector<HeightMapOcclusionCuller::Occludee> &occludees;
+		Vector<HeightMapChunk *> &chunks;
+		GatherOccludeesAction(Vector<HeightMapOcclusionCuller::Occludee> &o, Vector<HeightMapChunk *> &c) :
+				occludees(o), chunks(c) {}
+		void operator()(HeightMapChunk &chunk) {
+			if (!chunk.is_active())
+				return;
+			AABB aabb = chunk.get_aabb();
+			HeightMapOcclusionCuller::Occludee o;
+			o.origin = chunk.cell_origin;
+			o.size = Point2i(aabb.size.x, aabb.size.z);
+			o.max_height = aabb.position.y + aabb.size.y;
+			occludees.push_back(o);
+			chunks.push_back(&chunk);
+		}
+	};
+
+	struct ClearOcclusionAction {
+		void operator()(HeightMapChunk &chunk) {
+			chunk.set_occluded(false);
 		}
 	};
 
@@ -65,30 +102,257 @@ namespace {
 		}
 	};
 
+	// Raycasts against the heights of a terrain, in world space
+	struct WorldRaycaster {
+		const HeightMapSnapshot &heights;
+		Transform transform;
+		Transform to_local;
+		// Normals need the inverse transpose in case of non-uniform scale
+		Basis normal_basis;
+
+		WorldRaycaster(const HeightMapSnapshot &h, const Transform &t) :
+				heights(h), transform(t) {
+			to_local = transform.affine_inverse();
+			normal_basis = to_local.basis.transposed();
+		}
+
+		bool raycast(Vector3 origin_world, Vector3 dir_world, real_t max_distance, HeightMapRaycastHit &out_hit) const {
+
+			// Direction is normalized in world space, so distances along the local ray are world distances
+			Vector3 origin = to_local.xform(origin_world);
+			Vector3 dir = to_local.basis.xform(dir_world.normalized());
+
+			HeightMapRaycastHit hit;
+			if (!raycast_heightmap(heights, origin, dir, max_distance, hit))
+				return false;
+
+			out_hit.position = transform.xform(hit.position);
+			out_hit.normal = normal_basis.xform(hit.normal).normalized();
+			out_hit.distance = hit.distance;
+			return true;
+		}
+
+		bool is_visible(Vector3 from_world, Vector3 to_world) const {
+			return is_visible_heightmap(heights, to_local.xform(from_world), to_local.xform(to_world));
+		}
+	};
+
+	struct LineOfSightBatchAction {
+		const WorldRaycaster &raycaster;
+		const Vector3 *from;
+		const Vector3 *to;
+		uint8_t *out_visible;
+
+		LineOfSightBatchAction(const WorldRaycaster &r) :
+				raycaster(r), from(NULL), to(NULL), out_visible(NULL) {}
+
+		void operator()(int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				out_visible[i] = raycaster.is_visible(from[i], to[i]) ? 1 : 0;
+			}
+		}
+	};
+
+	// Each row of the image is a batch, and each pixel is a ray from the observer to the cell under it.
+	// All of it happens in terrain space.
+	struct ViewshedAction {
+		const HeightMapSnapshot &heights;
+		Vector3 observer;
+		Point2i origin;
+		int size;
+		real_t radius;
+		real_t target_height;
+		uint8_t *out_pixels;
+
+		ViewshedAction(const HeightMapSnapshot &h) :
+				heights(h), size(0), radius(0), target_height(0), out_pixels(NULL) {}
+
+		void operator()(int begin, int end) {
+
+			const real_t radius_squared = radius * radius;
+			const int res = heights.get_resolution();
+
+			for (int py = begin; py < end; ++py) {
+
+				uint8_t *row = out_pixels + py * size;
+				int y = origin.y + py;
+
+				for (int px = 0; px < size; ++px) {
+
+					int x = origin.x + px;
+					row[px] = 0;
+
+					if (x < 0 || y < 0 || x >= res || y >= res)
+						continue;
+
+					real_t dx = x - observer.x;
+					real_t dy = y - observer.z;
+					if (dx * dx + dy * dy > radius_squared)
+						continue;
+
+					Vector3 target(x, heights.get_height(x, y) + target_height, y);
+
+					if (is_visible_heightmap(heights, observer, target))
+						row[px] = 255;
+				}
+			}
+		}
+	};
+
+	struct RaycastBatchAction {
+		const WorldRaycaster &raycaster;
+		real_t max_distance;
+		const Vector3 *origins;
+		const Vector3 *dirs;
+		Vector3 *out_positions;
+		Vector3 *out_normals;
+		real_t *out_distances;
+
+		RaycastBatchAction(const WorldRaycaster &r) :
+				raycaster(r), max_distance(0), origins(NULL), dirs(NULL),
+				out_positions(NULL), out_normals(NULL), out_distances(NULL) {}
+
+		void operator()(int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				HeightMapRaycastHit hit;
+				if (raycaster.raycast(origins[i], dirs[i], max_distance, hit)) {
+					out_positions[i] = hit.position;
+					out_normals[i] = hit.normal;
+					out_distances[i] = hit.distance;
+				} else {
+					out_positions[i] = Vector3();
+					out_normals[i] = Vector3();
+					out_distances[i] = -1;
+				}
+			}
+		}
+	};
+
+	struct SampleBatchAction {
+		const HeightMapSnapshot &heights;
+		Transform transform;
+		Transform to_local;
+		Basis normal_basis;
+		const Vector3 *positions;
+		real_t *out_heights;
+		Vector3 *out_normals;
+
+		SampleBatchAction(const HeightMapSnapshot &h, const Transform &t) :
+				heights(h), transform(t), positions(NULL), out_heights(NULL), out_normals(NULL) {
+			to_local = transform.affine_inverse();
+			normal_basis = to_local.basis.transposed();
+		}
+
+		void operator()(int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+
+				Vector3 pos = to_local.xform(positions[i]);
+
+				Vector2 gradient;
+				pos.y = heights.get_interpolated_height(pos.x, pos.z, &gradient);
+
+				out_heights[i] = transform.xform(pos).y;
+				out_normals[i] = normal_basis.xform(Vector3(-gradient.x, 1, -gradient.y)).normalized();
+			}
+		}
+	};
+
+	// Overlap queries against a terrain, in world space.
+	// Spheres and capsules are assumed to keep their shape in terrain space, which is only exact with uniform scale.
+	struct WorldOverlapper {
+		const HeightMapSnapshot &heights;
+		Transform to_local;
+		real_t scale;
+		real_t vertical_scale;
+
+		WorldOverlapper(const HeightMapSnapshot &h, const Transform &t) :
+				heights(h) {
+			to_local = t.affine_inverse();
+			Vector3 s = t.basis.get_scale();
+			// The smallest scale gives the largest radius in terrain space, so it doesn't miss anything
+			scale = MIN(s.x, MIN(s.y, s.z));
+			vertical_scale = s.y;
+		}
+
+		real_t overlap_capsule(Vector3 a, Vector3 b, real_t radius) const {
+			return scale * overlap_capsule_heightmap(heights, to_local.xform(a), to_local.xform(b), radius / scale);
+		}
+
+		real_t overlap_box(const Transform &box) const {
+			return vertical_scale * overlap_box_heightmap(heights, to_local * box);
+		}
+	};
+
+	// Spheres only use points_a. Boxes are packed as 4 vectors: center, then the three half-extent axes.
+	struct OverlapBatchAction {
+		const WorldOverlapper &overlapper;
+		const Vector3 *points_a;
+		const Vector3 *points_b;
+		const real_t *radii;
+		const Vector3 *boxes;
+		real_t *out_depths;
+
+		OverlapBatchAction(const WorldOverlapper &o) :
+				overlapper(o), points_a(NULL), points_b(NULL), radii(NULL), boxes(NULL), out_depths(NULL) {}
+
+		void operator()(int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				if (boxes) {
+					const Vector3 *packed = boxes + i * 4;
+					Transform box;
+					box.origin = packed[0];
+					box.basis.set_axis(0, packed[1]);
+					box.basis.set_axis(1, packed[2]);
+					box.basis.set_axis(2, packed[3]);
+					out_depths[i] = overlapper.overlap_box(box);
+				} else {
+					Vector3 a = points_a[i];
+					Vector3 b = points_b ? points_b[i] : a;
+					out_depths[i] = overlapper.overlap_capsule(a, b, radii[i]);
+				}
+			}
+		}
+	};
+
 	Ref<Shader> s_default_shader;
+	Ref<Shader> s_proxy_shader;
 }
 
 HeightMap::HeightMap() {
 
 	set_notify_transform(true);
 	_collision_enabled = true;
+	_chunk_size = DEFAULT_CHUNK_SIZE;
+	_occlusion_culling_enabled = false;
+	_custom_shader_params_dirty = true;
+	_data_textures_dirty = true;
+	_proxy_distance = 0;
+	_proxy_chunk = NULL;
 	_lodder.set_callbacks(s_make_chunk_cb, s_recycle_chunk_cb, this);
+	_collider.set_instance_id(get_instance_id());
+	_navigation_enabled = false;
+	_navigation.set_owner(this);
 	_updated_chunks = 0;
 }
 
 HeightMap::~HeightMap() {
 	clear_all_chunks();
+	clear_proxy();
 }
 
 void HeightMap::init_default_resources() {
 	ERR_FAIL_COND(s_default_shader.is_valid());
 	s_default_shader.instance();
 	s_default_shader->set_code(s_default_shader_code);
+
+	s_proxy_shader.instance();
+	s_proxy_shader->set_code(s_proxy_shader_code);
 }
 
 void HeightMap::free_default_resources() {
 	ERR_FAIL_COND(s_default_shader.is_null());
 	s_default_shader.unref();
+	s_proxy_shader.unref();
 }
 
 void HeightMap::clear_all_chunks() {
@@ -117,9 +381,13 @@ void HeightMap::set_data(Ref<HeightMapData> data) {
 	}
 
 	_data = data;
+	_data_textures_dirty = true;
 
 	// Note: the order of these two is important
 	clear_all_chunks();
+	clear_proxy();
+	_collider.clear();
+	_navigation.clear();
 
 	if(_data.is_valid()) {
 
@@ -143,13 +411,17 @@ void HeightMap::_on_data_resolution_changed() {
 
 	clear_all_chunks();
 
-	_lodder.create_from_sizes(CHUNK_SIZE, _data->get_resolution());
+	_lodder.create_from_sizes(_chunk_size, _data->get_resolution());
+	_occlusion_culler.clear();
+	_proxy.clear();
+	_collider.clear();
+	_navigation.clear();
 
 	_pending_chunk_updates.clear();
 
 	_chunks.resize(_lodder.get_lod_count());
 
-	int cres = _data->get_resolution() / CHUNK_SIZE;
+	int cres = _data->get_resolution() / _chunk_size;
 	Point2i csize(cres, cres);
 	for(int lod = 0; lod < _chunks.size(); ++lod) {
 		_chunks[lod].resize(csize, false);
@@ -157,7 +429,8 @@ void HeightMap::_on_data_resolution_changed() {
 		csize /= 2;
 	}
 
-	_mesher.configure(Point2i(CHUNK_SIZE, CHUNK_SIZE), _lodder.get_lod_count());
+	_mesher.configure(Point2i(_chunk_size, _chunk_size), _lodder.get_lod_count());
+	_data_textures_dirty = true;
 	update_material();
 }
 
@@ -165,6 +438,25 @@ void HeightMap::_on_data_resolution_changed() {
 void HeightMap::_on_data_region_changed(int min_x, int min_y, int max_x, int max_y, int channel) {
 	//print_line(String("_on_data_region_changed {0}, {1}, {2}, {3}").format(varray(min_x, min_y, max_x, max_y)));
 	set_area_dirty(Point2i(min_x, min_y), Point2i(max_x - min_x, max_y - min_y));
+
+	if (channel == HeightMapData::CHANNEL_HEIGHT || channel == HeightMapData::CHANNEL_MASK) {
+		_occlusion_culler.set_area_dirty(Point2i(min_x, min_y), Point2i(max_x - min_x, max_y - min_y));
+	}
+
+	if (channel == HeightMapData::CHANNEL_HEIGHT) {
+		_proxy.set_dirty();
+		_collider.set_area_dirty(Point2i(min_x, min_y), Point2i(max_x - min_x, max_y - min_y));
+	}
+
+	if (channel == HeightMapData::CHANNEL_HEIGHT || channel == HeightMapData::CHANNEL_MASK) {
+		_navigation.set_area_dirty(Point2i(min_x, min_y), Point2i(max_x - min_x, max_y - min_y));
+	}
+
+	// The channel didn't have a texture yet
+	if (channel >= 0 && channel < HeightMapData::CHANNEL_COUNT && _data_textures[channel].is_null() && _material.is_valid()) {
+		_data_textures_dirty = true;
+		update_material_params();
+	}
 }
 
 void HeightMap::set_custom_material(Ref<ShaderMaterial> p_material) {
@@ -204,20 +496,22 @@ void HeightMap::update_material() {
 
 	if(_custom_material.is_valid()) {
 
-		if(_custom_material != _material) {
+		if(_custom_material != _material_source) {
 			// Duplicate material but not the shader.
 			// This is to ensure that users don't end up with internal textures assigned in the editor,
 			// which could end up being saved as regular textures (which is not intented).
 			// Also the HeightMap may use multiple instances of the material in the future,
 			// if chunks need different params or use multiple textures (streaming)
 			_material = _custom_material->duplicate(false);
+			_material_source = _custom_material;
 			instance_changed = true;
 		}
 
 	} else {
 
-		if(_material.is_null()) {
+		if(_material.is_null() || _material_source.is_valid()) {
 			_material.instance();
+			_material_source.unref();
 			instance_changed = true;
 		}
 
@@ -226,56 +520,122 @@ void HeightMap::update_material() {
 
 	if(instance_changed) {
 		for_all_chunks(SetMaterialAction(_material));
+		// The new instance got all current values, but they must be diffed again from scratch
+		_custom_shader_params_dirty = true;
 	}
 
 	update_material_params();
 }
 
-void HeightMap::update_material_params() {
+static bool is_internal_shader_param(const String &name) {
+	return name == HeightMap::SHADER_PARAM_HEIGHT_TEXTURE
+		|| name == HeightMap::SHADER_PARAM_NORMAL_TEXTURE
+		|| name == HeightMap::SHADER_PARAM_COLOR_TEXTURE
+		|| name == HeightMap::SHADER_PARAM_SPLAT_TEXTURE
+		|| name == HeightMap::SHADER_PARAM_MASK_TEXTURE
+		|| name == HeightMap::SHADER_PARAM_RESOLUTION
+		|| name == HeightMap::SHADER_PARAM_INVERSE_TRANSFORM
+		|| name == SHADER_PARAM_VIEWER_POSITION
+		|| name == SHADER_PARAM_MAX_DISTANCE
+		|| name == SHADER_PARAM_MIN_DISTANCE;
+}
+
+void HeightMap::update_custom_material_params() {
 
 	ERR_FAIL_COND(_material.is_null());
-	ShaderMaterial &material = **_material;
+	ERR_FAIL_COND(_custom_material.is_null());
 
-	if(_custom_material.is_valid()) {
-		// Copy all parameters from the custom material into the internal one
-		// TODO We could get rid of this every frame if ShaderMaterial had a signal when a parameter changes...
+	Ref<Shader> shader = _custom_material->get_shader();
+
+	if(shader != _custom_shader) {
+		// The shader of the custom material got replaced
+		if(_custom_shader.is_valid()) {
+			_custom_shader->disconnect(CoreStringNames::get_singleton()->changed, this, "_on_custom_shader_changed");
+		}
+		_custom_shader = shader;
+		if(_custom_shader.is_valid()) {
+			_custom_shader->connect(CoreStringNames::get_singleton()->changed, this, "_on_custom_shader_changed");
+		}
+		_material->set_shader(_custom_shader);
+		_custom_shader_params_dirty = true;
+	}
 
-		Ref<Shader> from_shader = _custom_material->get_shader();
-		Ref<Shader> to_shader = _material->get_shader();
+	if(_custom_shader.is_null())
+		return;
 
-		ERR_FAIL_COND(from_shader.is_null());
-		ERR_FAIL_COND(to_shader.is_null());
-		// If that one fails, it means there is a bug in HeightMap code
-		ERR_FAIL_COND(from_shader != to_shader);
+	ShaderMaterial &custom_material = **_custom_material;
 
-		// TODO Getting params could be optimized, by connecting to the Shader.changed signal and caching them
+	if(_custom_shader_params_dirty) {
+		// Getting params is expensive, so it's only done when the shader changes
 
 		List<PropertyInfo> params;
-		VisualServer::get_singleton()->shader_get_param_list(from_shader->get_rid(), &params);
+		VisualServer::get_singleton()->shader_get_param_list(_custom_shader->get_rid(), &params);
 
-		ShaderMaterial &custom_material = **_custom_material;
+		_custom_shader_params.clear();
+		_custom_shader_param_values.clear();
 
 		for (List<PropertyInfo>::Element *E = params.front(); E; E = E->next()) {
 			const PropertyInfo &pi = E->get();
-			material.set_shader_param(pi.name, custom_material.get_shader_param(pi.name));
+			// Internal params are always set by the HeightMap itself
+			if(!is_internal_shader_param(pi.name)) {
+				Variant v = custom_material.get_shader_param(pi.name);
+				set_material_param(pi.name, v);
+				_custom_shader_params.push_back(pi.name);
+				_custom_shader_param_values.push_back(v);
+			}
 		}
+
+		_custom_shader_params_dirty = false;
+		return;
 	}
 
-	Ref<Texture> height_texture;
-	Ref<Texture> normal_texture;
-	Ref<Texture> color_texture;
-	Ref<Texture> splat_texture;
-	Ref<Texture> mask_texture;
-	Vector2 res(-1,-1);
+	// ShaderMaterial has no signal telling when a parameter changes,
+	// so values still have to be compared, but only those which changed get copied
+	for(int i = 0; i < _custom_shader_params.size(); ++i) {
+		const StringName &name = _custom_shader_params[i];
+		Variant v = custom_material.get_shader_param(name);
+		if(v != _custom_shader_param_values[i]) {
+			set_material_param(name, v);
+			_custom_shader_param_values[i] = v;
+		}
+	}
+}
+
+void HeightMap::_on_custom_shader_changed() {
+	_custom_shader_params_dirty = true;
+	// Its params may have changed, so whether the proxy can use it too
+	_proxy_shader_source.unref();
+}
+
+// Params are the same for chunks and the proxy
+void HeightMap::set_material_param(const StringName &name, const Variant &value) {
+	_material->set_shader_param(name, value);
+	if (_proxy_material.is_valid())
+		_proxy_material->set_shader_param(name, value);
+}
+
+void HeightMap::update_material_params() {
+
+	ERR_FAIL_COND(_material.is_null());
 
-	// TODO Only get textures the shader supports
+	if(_custom_material.is_valid()) {
+		update_custom_material_params();
+	}
+
+	// Textures keep being the same objects, so they are only fetched again when the data or its size changes.
+	// This runs every time the terrain moves.
+	if(_data_textures_dirty) {
+		for(int i = 0; i < HeightMapData::CHANNEL_COUNT; ++i) {
+			if(_data.is_valid())
+				_data_textures[i] = _data->get_texture((HeightMapData::Channel)i);
+			else
+				_data_textures[i] = Ref<Texture>();
+		}
+		_data_textures_dirty = false;
+	}
 
+	Vector2 res(-1,-1);
 	if(_data.is_valid()) {
-		height_texture = _data->get_texture(HeightMapData::CHANNEL_HEIGHT);
-		normal_texture = _data->get_texture(HeightMapData::CHANNEL_NORMAL);
-		color_texture = _data->get_texture(HeightMapData::CHANNEL_COLOR);
-		splat_texture = _data->get_texture(HeightMapData::CHANNEL_SPLAT);
-		mask_texture = _data->get_texture(HeightMapData::CHANNEL_MASK);
 		res.x = _data->get_resolution();
 		res.y = res.x;
 	}
@@ -283,20 +643,66 @@ void HeightMap::update_material_params() {
 	if(is_inside_tree()) {
 		Transform gt = get_global_transform();
 		Transform t = gt.affine_inverse();
-		material.set_shader_param(SHADER_PARAM_INVERSE_TRANSFORM, t);
+		set_material_param(SHADER_PARAM_INVERSE_TRANSFORM, t);
 	}
 
-	material.set_shader_param(SHADER_PARAM_HEIGHT_TEXTURE, height_texture);
-	material.set_shader_param(SHADER_PARAM_NORMAL_TEXTURE, normal_texture);
-	material.set_shader_param(SHADER_PARAM_COLOR_TEXTURE, color_texture);
-	material.set_shader_param(SHADER_PARAM_SPLAT_TEXTURE, splat_texture);
-	material.set_shader_param(SHADER_PARAM_MASK_TEXTURE, mask_texture);
-	material.set_shader_param(SHADER_PARAM_RESOLUTION, res);
+	set_material_param(SHADER_PARAM_HEIGHT_TEXTURE, _data_textures[HeightMapData::CHANNEL_HEIGHT]);
+	set_material_param(SHADER_PARAM_NORMAL_TEXTURE, _data_textures[HeightMapData::CHANNEL_NORMAL]);
+	set_material_param(SHADER_PARAM_COLOR_TEXTURE, _data_textures[HeightMapData::CHANNEL_COLOR]);
+	set_material_param(SHADER_PARAM_SPLAT_TEXTURE, _data_textures[HeightMapData::CHANNEL_SPLAT]);
+	set_material_param(SHADER_PARAM_MASK_TEXTURE, _data_textures[HeightMapData::CHANNEL_MASK]);
+	set_material_param(SHADER_PARAM_RESOLUTION, res);
+
+	// Chunks and the proxy are cut on each side of the same distance
+	_material->set_shader_param(SHADER_PARAM_MAX_DISTANCE, _proxy_distance);
+	_material->set_shader_param(SHADER_PARAM_MIN_DISTANCE, 0);
+	if(_proxy_material.is_valid()) {
+		_proxy_material->set_shader_param(SHADER_PARAM_MAX_DISTANCE, 0);
+		_proxy_material->set_shader_param(SHADER_PARAM_MIN_DISTANCE, _proxy_distance);
+	}
 }
 
 void HeightMap::set_collision_enabled(bool enabled) {
 	_collision_enabled = enabled;
-	// TODO Update chunks / enable heightmap collider (or will be done through a different node perhaps)
+	if (!_collision_enabled)
+		_collider.clear();
+	if (is_inside_tree())
+		set_physics_process(_collision_enabled);
+}
+
+void HeightMap::set_navigation_enabled(bool enabled) {
+	_navigation_enabled = enabled;
+	if (!_navigation_enabled)
+		_navigation.clear();
+	if (is_inside_tree())
+		update_navigation_parent();
+}
+
+void HeightMap::set_navigation_max_slope(float degrees) {
+	_navigation.set_max_slope(Math::deg2rad(degrees));
+}
+
+float HeightMap::get_navigation_max_slope() const {
+	return Math::rad2deg(_navigation.get_max_slope());
+}
+
+void HeightMap::update_navigation_parent() {
+
+	Navigation *navigation = NULL;
+
+	if (_navigation_enabled && is_inside_tree()) {
+		// Like NavigationMeshInstance, use the closest one up the tree
+		for (Node *node = get_parent(); node; node = node->get_parent()) {
+			navigation = Object::cast_to<Navigation>(node);
+			if (navigation)
+				break;
+		}
+	}
+
+	if (navigation)
+		_navigation.set_navigation(navigation, get_relative_transform(navigation));
+	else
+		_navigation.set_navigation(NULL, Transform());
 }
 
 void HeightMap::set_lod_scale(float lod_scale) {
@@ -307,33 +713,100 @@ float HeightMap::get_lod_scale() const {
 	return _lodder.get_split_scale();
 }
 
+void HeightMap::set_occlusion_culling_enabled(bool enabled) {
+	_occlusion_culling_enabled = enabled;
+	if (!enabled) {
+		for_all_chunks(ClearOcclusionAction());
+	}
+}
+
+void HeightMap::set_proxy_distance(float distance) {
+
+	if (distance < 0)
+		distance = 0;
+
+	_proxy_distance = distance;
+	_lodder.set_max_distance(_proxy_distance);
+
+	if (_material.is_valid())
+		update_material_params();
+
+	if (_proxy_distance == 0) {
+		clear_proxy();
+	}
+}
+
+void HeightMap::set_chunk_size(int p_chunk_size) {
+
+	if (p_chunk_size == _chunk_size)
+		return;
+
+	ERR_FAIL_COND(p_chunk_size < MIN_CHUNK_SIZE || p_chunk_size > MAX_CHUNK_SIZE);
+	ERR_FAIL_COND(next_power_of_2(p_chunk_size) != p_chunk_size);
+
+	_chunk_size = p_chunk_size;
+
+	// Chunks, LODs and meshes all depend on it, so rebuild them as if the map was resized
+	if (_data.is_valid())
+		_on_data_resolution_changed();
+}
+
 void HeightMap::_notification(int p_what) {
 	switch (p_what) {
 
 		case NOTIFICATION_ENTER_TREE:
 			set_process(true);
+			set_physics_process(_collision_enabled);
+			update_navigation_parent();
+			break;
+
+		case NOTIFICATION_EXIT_TREE:
+			// Parents exit the tree after their children, so the navigation is still there
+			_navigation.set_navigation(NULL, Transform());
 			break;
 
 		case NOTIFICATION_ENTER_WORLD:
+			_collider.set_space(get_world()->get_space());
+			_collider.set_transform(get_global_transform());
 			for_all_chunks(EnterWorldAction(get_world()));
+			if (_proxy_chunk)
+				_proxy_chunk->enter_world(**get_world());
 			break;
 
 		case NOTIFICATION_EXIT_WORLD:
+			_collider.set_space(RID());
 			for_all_chunks(ExitWorldAction());
+			if (_proxy_chunk)
+				_proxy_chunk->exit_world();
 			break;
 
 		case NOTIFICATION_TRANSFORM_CHANGED:
 			for_all_chunks(TransformChangedAction(get_global_transform()));
+			_collider.set_transform(get_global_transform());
+			if (_navigation.get_navigation())
+				_navigation.set_transform(get_relative_transform(_navigation.get_navigation()));
+			if (_proxy_chunk)
+				_proxy_chunk->parent_transform_changed(get_global_transform());
 			update_material();
 			break;
 
 		case NOTIFICATION_VISIBILITY_CHANGED:
 			for_all_chunks(VisibilityChangedAction(is_visible()));
+			if (_proxy_chunk)
+				_proxy_chunk->set_visible(is_visible());
 			break;
 
 		case NOTIFICATION_PROCESS:
 			_process();
 			break;
+
+		case NOTIFICATION_PHYSICS_PROCESS:
+			if (_collision_enabled && _data.is_valid()) {
+				PhysicsDirectSpaceState *space_state = get_world()->get_direct_space_state();
+				ERR_FAIL_COND(space_state == NULL);
+				_collider.update(**_data, *space_state);
+			}
+			break;
 	}
 }
 
@@ -382,8 +855,11 @@ void HeightMap::_process() {
 		}
 	}
 
+	// LOD and culling work in terrain space
+	Vector3 local_viewer_pos = get_global_transform().affine_inverse().xform(viewer_pos);
+
 	if(_data.is_valid())
-		_lodder.update(viewer_pos);
+		_lodder.update(local_viewer_pos);
 
 	_updated_chunks = 0;
 
@@ -436,12 +912,23 @@ void HeightMap::_process() {
 
 	_pending_chunk_updates.clear();
 
+	if (_occlusion_culling_enabled && _data.is_valid()) {
+		update_occlusion(local_viewer_pos);
+	}
+
+	if (_proxy_distance > 0 && _data.is_valid()) {
+		update_proxy(local_viewer_pos);
+	}
+
+	if (_navigation_enabled && _data.is_valid()) {
+		_navigation.update(**_data);
+	}
+
 #ifdef TOOLS_ENABLED
-	if(Engine::get_singleton()->is_editor_hint()) {
-		// TODO I would reaaaally like to get rid of this... it just look inefficient,
-		// and it won't play nice if more materials are used internally.
-		// Initially needed so that custom materials can be tweaked in editor.
-		update_material_params();
+	if(Engine::get_singleton()->is_editor_hint() && _custom_material.is_valid() && _material.is_valid()) {
+		// Needed so that custom materials can be tweaked in editor.
+		// Internal params don't need this, they are set when the data, transform or material changes.
+		update_custom_material_params();
 	}
 #endif
 
@@ -454,9 +941,18 @@ void HeightMap::_process() {
 void HeightMap::update_chunk(HeightMapChunk &chunk, int lod) {
 	ERR_FAIL_COND(_data.is_null())
 
+	int s = _chunk_size << lod;
+
+	if (_data->get_region_mask_state(chunk.cell_origin, Point2i(s, s)) == HeightMapData::MASK_FULL) {
+		// The whole chunk is a hole, don't submit anything
+		chunk.set_mesh(Ref<Mesh>());
+		chunk.set_pending_update(false);
+		return;
+	}
+
 	// Check for my own seams
 	int seams = 0;
-	Point2i cpos = chunk.cell_origin / (CHUNK_SIZE << lod);
+	Point2i cpos = chunk.cell_origin / (_chunk_size << lod);
 	Point2i cpos_lower = cpos / 2;
 
 	// Check for lower-LOD chunks around me
@@ -474,7 +970,6 @@ void HeightMap::update_chunk(HeightMapChunk &chunk, int lod) {
 	chunk.set_mesh(mesh);
 
 	// Because chunks are rendered using vertex shader displacement, the renderer cannot rely on the mesh's AABB.
-	int s = CHUNK_SIZE << lod;
 	AABB aabb = _data->get_region_aabb(chunk.cell_origin, Point2i(s,s));
 	aabb.position.x = 0;
 	aabb.position.z = 0;
@@ -490,6 +985,111 @@ void HeightMap::update_chunk(HeightMapChunk &chunk, int lod) {
 //	}
 }
 
+void HeightMap::update_occlusion(Vector3 local_viewer_pos) {
+
+	_occludees.clear();
+	_occludee_chunks.clear();
+	for_all_chunks(GatherOccludeesAction(_occludees, _occludee_chunks));
+
+	_occlusion_culler.cull(**_data, local_viewer_pos, _occludees);
+
+	for (int i = 0; i < _occludees.size(); ++i) {
+		_occludee_chunks[i]->set_occluded(_occludees[i].occluded);
+	}
+}
+
+Array HeightMap::get_occluded_regions(Vector3 viewer_pos_world) {
+
+	Array regions;
+	ERR_FAIL_COND_V(_data.is_null(), regions);
+
+	Vector3 local_viewer_pos = get_global_transform().affine_inverse().xform(viewer_pos_world);
+
+	int cell_count = _data->get_resolution() - 1;
+	Vector<HeightMapOcclusionCuller::Occludee> occludees;
+
+	for (int y = 0; y < cell_count; y += _chunk_size) {
+		for (int x = 0; x < cell_count; x += _chunk_size) {
+			HeightMapOcclusionCuller::Occludee o;
+			o.origin = Point2i(x, y);
+			o.size = Point2i(MIN(_chunk_size, cell_count - x), MIN(_chunk_size, cell_count - y));
+			AABB aabb = _data->get_region_aabb(o.origin, o.size);
+			o.max_height = aabb.position.y + aabb.size.y;
+			occludees.push_back(o);
+		}
+	}
+
+	_occlusion_culler.cull(**_data, local_viewer_pos, occludees);
+
+	for (int i = 0; i < occludees.size(); ++i) {
+		const HeightMapOcclusionCuller::Occludee &o = occludees[i];
+		if (o.occluded)
+			regions.push_back(Rect2(o.origin.x, o.origin.y, o.size.x, o.size.y));
+	}
+
+	return regions;
+}
+
+static bool shader_has_param(Ref<Shader> shader, const String &name) {
+
+	if (shader.is_null())
+		return false;
+
+	List<PropertyInfo> params;
+	VisualServer::get_singleton()->shader_get_param_list(shader->get_rid(), &params);
+
+	for (List<PropertyInfo>::Element *E = params.front(); E; E = E->next()) {
+		if (E->get().name == name)
+			return true;
+	}
+	return false;
+}
+
+void HeightMap::update_proxy(Vector3 local_viewer_pos) {
+
+	ERR_FAIL_COND(_material.is_null());
+
+	if (_proxy_chunk == NULL) {
+		_proxy_material.instance();
+		_proxy_chunk = memnew(HeightMapChunk(this, Point2i(), _proxy_material));
+		_proxy_chunk->set_visible(is_visible());
+
+		// Gets all params chunks have
+		_custom_shader_params_dirty = true;
+		update_material_params();
+	}
+
+	// The proxy looks the same as chunks if it can use their shader, which needs to know where to cut it.
+	// Otherwise it falls back to a simpler one that only has the color of the terrain.
+	Ref<Shader> shader = _material->get_shader();
+	if (shader != _proxy_shader_source) {
+		_proxy_shader_source = shader;
+		if (shader_has_param(shader, SHADER_PARAM_MIN_DISTANCE)) {
+			_proxy_material->set_shader(shader);
+		} else {
+			_proxy_material->set_shader(s_proxy_shader);
+		}
+	}
+
+	if (_proxy.update(**_data)) {
+		_proxy_chunk->set_mesh(_proxy.get_mesh());
+		_proxy_chunk->set_aabb(_proxy.get_aabb());
+	}
+
+	// Chunks are culled by their closest point, so they go past the distance and get cut there instead
+	set_material_param(SHADER_PARAM_VIEWER_POSITION, local_viewer_pos);
+}
+
+void HeightMap::clear_proxy() {
+	_proxy.clear();
+	if (_proxy_chunk) {
+		memdelete(_proxy_chunk);
+		_proxy_chunk = NULL;
+	}
+	_proxy_material.unref();
+	_proxy_shader_source.unref();
+}
+
 void HeightMap::add_chunk_update(HeightMapChunk &chunk, Point2i pos, int lod) {
 
 	if(chunk.is_pending_update()) {
@@ -510,8 +1110,8 @@ void HeightMap::add_chunk_update(HeightMapChunk &chunk, Point2i pos, int lod) {
 
 void HeightMap::set_area_dirty(Point2i origin_in_cells, Point2i size_in_cells) {
 
-	Point2i cpos0 = origin_in_cells / CHUNK_SIZE;
-	Point2i csize = (size_in_cells - Point2i(1,1)) / CHUNK_SIZE + Point2i(1,1);
+	Point2i cpos0 = origin_in_cells / _chunk_size;
+	Point2i csize = (size_in_cells - Point2i(1,1)) / _chunk_size + Point2i(1,1);
 
 	// For each lod
 	for (int lod = 0; lod < _chunks.size(); ++lod) {
@@ -550,7 +1150,7 @@ HeightMapChunk *HeightMap::_make_chunk_cb(Point2i cpos, int lod) {
 
 		// This is the first time this chunk is required at this lod, generate it
 		int lod_factor = _lodder.get_lod_size(lod);
-		Point2i origin_in_cells = cpos * CHUNK_SIZE * lod_factor;
+		Point2i origin_in_cells = cpos * _chunk_size * lod_factor;
 		chunk = memnew(HeightMapChunk(this, origin_in_cells, _material));
 		_chunks[lod].set(cpos, chunk);
 
@@ -576,50 +1176,323 @@ Point2i HeightMap::local_pos_to_cell(Vector3 local_pos) const {
 			static_cast<int>(local_pos.z));
 }
 
-static float get_height_or_default(const Image &im, Point2i pos) {
-	if(pos.x < 0 || pos.y < 0|| pos.x >= im.get_width() || pos.y >= im.get_height())
-		return 0;
-	return im.get_pixel(pos.x, pos.y).r;
-}
-
-bool HeightMap::cell_raycast(Vector3 origin_world, Vector3 dir_world, Point2i &out_cell_pos) {
+bool HeightMap::raycast(Vector3 origin_world, Vector3 dir_world, real_t max_distance, HeightMapRaycastHit &out_hit) const {
 
 	if(_data.is_null())
 		return false;
 
-	Ref<Image> heights_ref = _data->get_image(HeightMapData::CHANNEL_HEIGHT);
-	if(heights_ref.is_null())
+	Ref<HeightMapSnapshot> snapshot = _data->get_height_snapshot();
+	if(snapshot.is_null())
 		return false;
-	Image &heights = **heights_ref;
 
-	Transform to_local = get_global_transform().affine_inverse();
-	Vector3 origin = to_local.xform(origin_world);
-	Vector3 dir = to_local.basis.xform(dir_world);
+	WorldRaycaster raycaster(**snapshot, get_global_transform());
 
-	LockImage lock(heights_ref);
+	return raycaster.raycast(origin_world, dir_world, max_distance, out_hit);
+}
 
-	if (origin.y < get_height_or_default(heights, local_pos_to_cell(origin))) {
-		// Below
-		return false;
+Dictionary HeightMap::raycast_batch(PoolVector3Array origins, PoolVector3Array dirs, real_t max_distance) const {
+
+	ERR_FAIL_COND_V(origins.size() != dirs.size(), Dictionary());
+
+	const int count = origins.size();
+
+	PoolVector3Array positions;
+	PoolVector3Array normals;
+	PoolRealArray distances;
+	positions.resize(count);
+	normals.resize(count);
+	distances.resize(count);
+
+	Ref<HeightMapSnapshot> snapshot;
+	if(_data.is_valid())
+		snapshot = _data->get_height_snapshot();
+
+	if(snapshot.is_valid() && count > 0) {
+
+		WorldRaycaster raycaster(**snapshot, get_global_transform());
+
+		PoolVector3Array::Read origins_read = origins.read();
+		PoolVector3Array::Read dirs_read = dirs.read();
+		PoolVector3Array::Write positions_write = positions.write();
+		PoolVector3Array::Write normals_write = normals.write();
+		PoolRealArray::Write distances_write = distances.write();
+
+		RaycastBatchAction action(raycaster);
+		action.max_distance = max_distance;
+		action.origins = origins_read.ptr();
+		action.dirs = dirs_read.ptr();
+		action.out_positions = positions_write.ptr();
+		action.out_normals = normals_write.ptr();
+		action.out_distances = distances_write.ptr();
+
+		ThreadPool::get_singleton()->parallel_for(count, action, RAYCAST_BATCH_MIN_SIZE);
+
+	} else {
+		PoolRealArray::Write distances_write = distances.write();
+		for(int i = 0; i < count; ++i) {
+			distances_write[i] = -1;
+		}
 	}
 
-	float unit = 1;
-	float d = 0;
-	const real_t max_distance = 800;
-	Vector3 pos = origin;
+	Dictionary d;
+	d["positions"] = positions;
+	d["normals"] = normals;
+	d["distances"] = distances;
+	return d;
+}
+
+Dictionary HeightMap::sample_batch(PoolVector3Array positions) const {
 
-	// Slow, but enough for edition
-	// TODO Could be optimized with a form of binary search
-	while (d < max_distance) {
-		pos += dir * unit;
-		if (get_height_or_default(heights, local_pos_to_cell(pos)) > pos.y) {
-			out_cell_pos = local_pos_to_cell(pos - dir * unit);
-			return true;
+	const int count = positions.size();
+
+	PoolRealArray heights;
+	PoolVector3Array normals;
+	heights.resize(count);
+	normals.resize(count);
+
+	Ref<HeightMapSnapshot> snapshot;
+	if(_data.is_valid())
+		snapshot = _data->get_height_snapshot();
+
+	if(snapshot.is_valid() && count > 0) {
+
+		SampleBatchAction action(**snapshot, get_global_transform());
+
+		PoolVector3Array::Read positions_read = positions.read();
+		PoolRealArray::Write heights_write = heights.write();
+		PoolVector3Array::Write normals_write = normals.write();
+
+		action.positions = positions_read.ptr();
+		action.out_heights = heights_write.ptr();
+		action.out_normals = normals_write.ptr();
+
+		ThreadPool::get_singleton()->parallel_for(count, action, SAMPLE_BATCH_MIN_SIZE);
+
+	} else {
+		// No terrain, like a flat ground at zero
+		PoolRealArray::Write heights_write = heights.write();
+		PoolVector3Array::Write normals_write = normals.write();
+		for(int i = 0; i < count; ++i) {
+			heights_write[i] = 0;
+			normals_write[i] = Vector3(0, 1, 0);
 		}
-		d += unit;
 	}
 
-	return false;
+	Dictionary d;
+	d["heights"] = heights;
+	d["normals"] = normals;
+	return d;
+}
+
+bool HeightMap::line_of_sight(Vector3 from, Vector3 to) const {
+
+	if(_data.is_null())
+		return true;
+
+	Ref<HeightMapSnapshot> snapshot = _data->get_height_snapshot();
+	if(snapshot.is_null())
+		return true;
+
+	WorldRaycaster raycaster(**snapshot, get_global_transform());
+
+	return raycaster.is_visible(from, to);
+}
+
+PoolByteArray HeightMap::line_of_sight_batch(PoolVector3Array from, PoolVector3Array to) const {
+
+	ERR_FAIL_COND_V(from.size() != to.size(), PoolByteArray());
+
+	const int count = from.size();
+
+	PoolByteArray visible;
+	visible.resize(count);
+
+	Ref<HeightMapSnapshot> snapshot;
+	if(_data.is_valid())
+		snapshot = _data->get_height_snapshot();
+
+	if(snapshot.is_null() || count == 0) {
+		PoolByteArray::Write visible_write = visible.write();
+		for(int i = 0; i < count; ++i) {
+			visible_write[i] = 1;
+		}
+		return visible;
+	}
+
+	WorldRaycaster raycaster(**snapshot, get_global_transform());
+
+	PoolVector3Array::Read from_read = from.read();
+	PoolVector3Array::Read to_read = to.read();
+	PoolByteArray::Write visible_write = visible.write();
+
+	LineOfSightBatchAction action(raycaster);
+	action.from = from_read.ptr();
+	action.to = to_read.ptr();
+	action.out_visible = visible_write.ptr();
+
+	ThreadPool::get_singleton()->parallel_for(count, action, RAYCAST_BATCH_MIN_SIZE);
+
+	return visible;
+}
+
+Ref<Image> HeightMap::compute_viewshed(Vector3 observer_world, real_t radius, real_t target_height) const {
+
+	ERR_FAIL_COND_V(_data.is_null(), Ref<Image>());
+	ERR_FAIL_COND_V(radius <= 0, Ref<Image>());
+
+	Ref<HeightMapSnapshot> snapshot = _data->get_height_snapshot();
+	ERR_FAIL_COND_V(snapshot.is_null(), Ref<Image>());
+
+	Vector3 observer = get_global_transform().affine_inverse().xform(observer_world);
+	int r = Math::ceil(radius);
+
+	ViewshedAction action(**snapshot);
+	action.observer = observer;
+	action.origin = Point2i(Math::floor(observer.x), Math::floor(observer.z)) - Point2i(r, r);
+	action.size = 2 * r + 1;
+	action.radius = radius;
+	action.target_height = target_height;
+
+	PoolByteArray pixels;
+	pixels.resize(action.size * action.size);
+
+	{
+		PoolByteArray::Write pixels_write = pixels.write();
+		action.out_pixels = pixels_write.ptr();
+		// Rows far from the observer take longer, so batches are kept small
+		ThreadPool::get_singleton()->parallel_for(action.size, action, 1);
+	}
+
+	Ref<Image> image;
+	image.instance();
+	image->create(action.size, action.size, false, Image::FORMAT_L8, pixels);
+	return image;
+}
+
+real_t HeightMap::overlap_sphere(Vector3 center, real_t radius) const {
+	return overlap_capsule(center, center, radius);
+}
+
+real_t HeightMap::overlap_capsule(Vector3 a, Vector3 b, real_t radius) const {
+
+	if(_data.is_null())
+		return 0;
+
+	Ref<HeightMapSnapshot> snapshot = _data->get_height_snapshot();
+	if(snapshot.is_null())
+		return 0;
+
+	WorldOverlapper overlapper(**snapshot, get_global_transform());
+
+	return overlapper.overlap_capsule(a, b, radius);
+}
+
+real_t HeightMap::overlap_box(Transform box, Vector3 half_extents) const {
+
+	if(_data.is_null())
+		return 0;
+
+	Ref<HeightMapSnapshot> snapshot = _data->get_height_snapshot();
+	if(snapshot.is_null())
+		return 0;
+
+	WorldOverlapper overlapper(**snapshot, get_global_transform());
+
+	return overlapper.overlap_box(box * Transform(Basis().scaled(half_extents), Vector3()));
+}
+
+PoolRealArray HeightMap::overlap_spheres(PoolVector3Array centers, PoolRealArray radii) const {
+	ERR_FAIL_COND_V(centers.size() != radii.size(), PoolRealArray());
+	return overlap_batch(centers.size(), &centers, NULL, &radii, NULL);
+}
+
+PoolRealArray HeightMap::overlap_capsules(PoolVector3Array points_a, PoolVector3Array points_b, PoolRealArray radii) const {
+	ERR_FAIL_COND_V(points_a.size() != points_b.size(), PoolRealArray());
+	ERR_FAIL_COND_V(points_a.size() != radii.size(), PoolRealArray());
+	return overlap_batch(points_a.size(), &points_a, &points_b, &radii, NULL);
+}
+
+PoolRealArray HeightMap::overlap_boxes(PoolVector3Array boxes) const {
+	ERR_FAIL_COND_V(boxes.size() % 4 != 0, PoolRealArray());
+	return overlap_batch(boxes.size() / 4, NULL, NULL, NULL, &boxes);
+}
+
+PoolRealArray HeightMap::overlap_batch(int count,
+		const PoolVector3Array *points_a, const PoolVector3Array *points_b,
+		const PoolRealArray *radii, const PoolVector3Array *boxes) const {
+
+	PoolRealArray depths;
+	depths.resize(count);
+
+	Ref<HeightMapSnapshot> snapshot;
+	if(_data.is_valid())
+		snapshot = _data->get_height_snapshot();
+
+	if(snapshot.is_null() || count == 0) {
+		PoolRealArray::Write depths_write = depths.write();
+		for(int i = 0; i < count; ++i) {
+			depths_write[i] = 0;
+		}
+		return depths;
+	}
+
+	WorldOverlapper overlapper(**snapshot, get_global_transform());
+
+	PoolVector3Array::Read points_a_read;
+	PoolVector3Array::Read points_b_read;
+	PoolRealArray::Read radii_read;
+	PoolVector3Array::Read boxes_read;
+	PoolRealArray::Write depths_write = depths.write();
+
+	OverlapBatchAction action(overlapper);
+	if(points_a) {
+		points_a_read = points_a->read();
+		action.points_a = points_a_read.ptr();
+	}
+	if(points_b) {
+		points_b_read = points_b->read();
+		action.points_b = points_b_read.ptr();
+	}
+	if(radii) {
+		radii_read = radii->read();
+		action.radii = radii_read.ptr();
+	}
+	if(boxes) {
+		boxes_read = boxes->read();
+		action.boxes = boxes_read.ptr();
+	}
+	action.out_depths = depths_write.ptr();
+
+	ThreadPool::get_singleton()->parallel_for(count, action, OVERLAP_BATCH_MIN_SIZE);
+
+	return depths;
+}
+
+bool HeightMap::cell_raycast(Vector3 origin_world, Vector3 dir_world, Point2i &out_cell_pos) {
+
+	// The ray gets clipped to the map anyways
+	const real_t max_distance = 1e20;
+
+	HeightMapRaycastHit hit;
+	if(!raycast(origin_world, dir_world, max_distance, hit))
+		return false;
+
+	out_cell_pos = local_pos_to_cell(get_global_transform().affine_inverse().xform(hit.position));
+	return true;
+}
+
+Dictionary HeightMap::_raycast(Vector3 origin, Vector3 dir, real_t max_distance) {
+
+	Dictionary d;
+	HeightMapRaycastHit hit;
+
+	if(raycast(origin, dir, max_distance, hit)) {
+		d["position"] = hit.position;
+		d["normal"] = hit.normal;
+		d["distance"] = hit.distance;
+	}
+
+	return d;
 }
 
 void HeightMap::_bind_methods() {
@@ -636,13 +1509,49 @@ void HeightMap::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("set_lod_scale", "scale"), &HeightMap::set_lod_scale);
 	ClassDB::bind_method(D_METHOD("get_lod_scale"), &HeightMap::get_lod_scale);
 
+	ClassDB::bind_method(D_METHOD("is_occlusion_culling_enabled"), &HeightMap::is_occlusion_culling_enabled);
+	ClassDB::bind_method(D_METHOD("get_occluded_regions", "viewer_pos"), &HeightMap::get_occluded_regions);
+	ClassDB::bind_method(D_METHOD("set_occlusion_culling_enabled", "enabled"), &HeightMap::set_occlusion_culling_enabled);
+
+	ClassDB::bind_method(D_METHOD("set_navigation_enabled", "enabled"), &HeightMap::set_navigation_enabled);
+	ClassDB::bind_method(D_METHOD("is_navigation_enabled"), &HeightMap::is_navigation_enabled);
+	ClassDB::bind_method(D_METHOD("set_navigation_max_slope", "degrees"), &HeightMap::set_navigation_max_slope);
+	ClassDB::bind_method(D_METHOD("get_navigation_max_slope"), &HeightMap::get_navigation_max_slope);
+
+	ClassDB::bind_method(D_METHOD("set_proxy_distance", "distance"), &HeightMap::set_proxy_distance);
+	ClassDB::bind_method(D_METHOD("get_proxy_distance"), &HeightMap::get_proxy_distance);
+
+	ClassDB::bind_method(D_METHOD("set_chunk_size", "size"), &HeightMap::set_chunk_size);
+	ClassDB::bind_method(D_METHOD("get_chunk_size"), &HeightMap::get_chunk_size);
+
+	ClassDB::bind_method(D_METHOD("raycast", "origin", "dir", "max_distance"), &HeightMap::_raycast);
+	ClassDB::bind_method(D_METHOD("raycast_batch", "origins", "dirs", "max_distance"), &HeightMap::raycast_batch);
+	ClassDB::bind_method(D_METHOD("sample_batch", "positions"), &HeightMap::sample_batch);
+
+	ClassDB::bind_method(D_METHOD("line_of_sight", "from", "to"), &HeightMap::line_of_sight);
+	ClassDB::bind_method(D_METHOD("line_of_sight_batch", "from", "to"), &HeightMap::line_of_sight_batch);
+	ClassDB::bind_method(D_METHOD("compute_viewshed", "observer", "radius", "target_height"), &HeightMap::compute_viewshed, DEFVAL(0));
+
+	ClassDB::bind_method(D_METHOD("overlap_sphere", "center", "radius"), &HeightMap::overlap_sphere);
+	ClassDB::bind_method(D_METHOD("overlap_capsule", "a", "b", "radius"), &HeightMap::overlap_capsule);
+	ClassDB::bind_method(D_METHOD("overlap_box", "transform", "half_extents"), &HeightMap::overlap_box);
+	ClassDB::bind_method(D_METHOD("overlap_spheres", "centers", "radii"), &HeightMap::overlap_spheres);
+	ClassDB::bind_method(D_METHOD("overlap_capsules", "points_a", "points_b", "radii"), &HeightMap::overlap_capsules);
+	ClassDB::bind_method(D_METHOD("overlap_boxes", "boxes"), &HeightMap::overlap_boxes);
+
 	ClassDB::bind_method(D_METHOD("_on_data_resolution_changed"), &HeightMap::_on_data_resolution_changed);
+	ClassDB::bind_method(D_METHOD("_on_custom_shader_changed"), &HeightMap::_on_custom_shader_changed);
 	ClassDB::bind_method(D_METHOD("_on_data_region_changed", "x", "y", "w", "h", "c"), &HeightMap::_on_data_region_changed);
 
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "data", PROPERTY_HINT_RESOURCE_TYPE, "HeightMapData"), "set_data", "get_data");
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "custom_material", PROPERTY_HINT_RESOURCE_TYPE, "ShaderMaterial"), "set_custom_material", "get_custom_material");
 	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "collision_enabled"), "set_collision_enabled", "is_collision_enabled");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "navigation_enabled"), "set_navigation_enabled", "is_navigation_enabled");
+	ADD_PROPERTY(PropertyInfo(Variant::REAL, "navigation_max_slope", PROPERTY_HINT_RANGE, "0,90,0.1"), "set_navigation_max_slope", "get_navigation_max_slope");
 	ADD_PROPERTY(PropertyInfo(Variant::REAL, "lod_scale"), "set_lod_scale", "get_lod_scale");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "occlusion_culling_enabled"), "set_occlusion_culling_enabled", "is_occlusion_culling_enabled");
+	ADD_PROPERTY(PropertyInfo(Variant::REAL, "proxy_distance"), "set_proxy_distance", "get_proxy_distance");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "chunk_size"), "set_chunk_size", "get_chunk_size");
 }
 
 // Callbacks configured for QuadTreeLod
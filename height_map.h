@@ -2,8 +2,14 @@
 #define HEIGHT_MAP_H
 
 #include "height_map_chunk.h"
+#include "height_map_collider.h"
 #include "height_map_data.h"
 #include "height_map_mesher.h"
+#include "height_map_navigation.h"
+#include "height_map_occlusion_culler.h"
+#include "height_map_overlap.h"
+#include "height_map_proxy.h"
+#include "height_map_raycast.h"
 #include "quad_tree_lod.h"
 #include <scene/3d/spatial.h>
 
@@ -11,10 +17,13 @@
 class HeightMap : public Spatial {
 	GDCLASS(HeightMap, Spatial)
 public:
-	//static const int CHUNK_SIZE = 16;
-	// Workaround because GCC doesn't links the line above properly
-	// This is the minimum chunk size
-	enum { CHUNK_SIZE = 16 };
+	// Chunk sizes must be powers of two within this range.
+	// Using an enum as a workaround because GCC doesn't links static const ints properly
+	enum {
+		MIN_CHUNK_SIZE = 8,
+		DEFAULT_CHUNK_SIZE = 16,
+		MAX_CHUNK_SIZE = 64
+	};
 
 	static const char *SHADER_PARAM_HEIGHT_TEXTURE;
 	static const char *SHADER_PARAM_NORMAL_TEXTURE;
@@ -36,12 +45,73 @@ public:
 	void set_collision_enabled(bool enabled);
 	inline bool is_collision_enabled() const { return _collision_enabled; }
 
+	// Builds navigation meshes from terrain, registered in the closest Navigation parent
+	void set_navigation_enabled(bool enabled);
+	inline bool is_navigation_enabled() const { return _navigation_enabled; }
+
+	// Steepest walkable slope, in degrees
+	void set_navigation_max_slope(float degrees);
+	float get_navigation_max_slope() const;
+
 	void set_lod_scale(float lod_scale);
 	float get_lod_scale() const;
 
+	// Bigger chunks mean less draw calls, smaller chunks mean finer LOD and culling
+	void set_chunk_size(int p_chunk_size);
+	inline int get_chunk_size() const { return _chunk_size; }
+
+	// Hides chunks that are behind terrain from the point of view of the camera
+	void set_occlusion_culling_enabled(bool enabled);
+	inline bool is_occlusion_culling_enabled() const { return _occlusion_culling_enabled; }
+
+	// Runs the occlusion culler from a viewer in world space, over the map split in regions of chunk size.
+	// Returns the regions it hides as Rect2 in cells. It doesn't depend on LOD or the camera, so it's handy to check results.
+	Array get_occluded_regions(Vector3 viewer_pos_world);
+
+	// Beyond this distance, terrain is rendered with a single simplified mesh instead of LOD chunks.
+	// Zero disables it. Chunks get cut at that distance by the default shader,
+	// custom shaders have to discard fragments beyond `heightmap_max_distance` from `heightmap_viewer_position` too.
+	// The proxy uses the same shader as chunks if it also discards those closer than `heightmap_min_distance`,
+	// otherwise it only shows the color of the terrain, so the far field may look different.
+	void set_proxy_distance(float distance);
+	inline float get_proxy_distance() const { return _proxy_distance; }
+
 	void set_area_dirty(Point2i origin_in_cells, Point2i size_in_cells);
+
+	// Finds where a ray hits the terrain. Everything is in world space.
+	// Queries read the latest height snapshot, so they don't see the map change under them while they run.
+	bool raycast(Vector3 origin_world, Vector3 dir_world, real_t max_distance, HeightMapRaycastHit &out_hit) const;
 	bool cell_raycast(Vector3 origin_world, Vector3 dir_world, Point2i &out_cell_pos);
 
+	// Casts many rays at once, split across worker threads.
+	// Returns "positions", "normals" and "distances" arrays, where distance is negative if the ray didn't hit.
+	Dictionary raycast_batch(PoolVector3Array origins, PoolVector3Array dirs, real_t max_distance) const;
+
+	// Samples the ground under many world positions at once.
+	// Returns "heights", the world Y of the surface below each position, and "normals" in world space.
+	Dictionary sample_batch(PoolVector3Array positions) const;
+
+	// Tells if no terrain stands between two points in world space
+	bool line_of_sight(Vector3 from, Vector3 to) const;
+	// Batched version, split across worker threads. Gives 1 for visible and 0 for hidden.
+	PoolByteArray line_of_sight_batch(PoolVector3Array from, PoolVector3Array to) const;
+
+	// Makes an L8 image telling which cells can be seen from the observer, within a radius in cells.
+	// Cells are targeted at target_height above ground. The observer is at the center pixel,
+	// so pixel (0, 0) is cell (floor(observer) - ceil(radius)), in terrain space.
+	Ref<Image> compute_viewshed(Vector3 observer_world, real_t radius, real_t target_height) const;
+
+	// Tell how deep volumes go into terrain, or zero if they don't touch. Everything is in world space.
+	real_t overlap_sphere(Vector3 center, real_t radius) const;
+	real_t overlap_capsule(Vector3 a, Vector3 b, real_t radius) const;
+	real_t overlap_box(Transform box, Vector3 half_extents) const;
+
+	// Batched versions, split across worker threads.
+	// Boxes are packed as 4 vectors each: center, then the three half-extent axes.
+	PoolRealArray overlap_spheres(PoolVector3Array centers, PoolRealArray radii) const;
+	PoolRealArray overlap_capsules(PoolVector3Array points_a, PoolVector3Array points_b, PoolRealArray radii) const;
+	PoolRealArray overlap_boxes(PoolVector3Array boxes) const;
+
 	static void init_default_resources();
 	static void free_default_resources();
 
@@ -55,15 +125,28 @@ private:
 
 	void update_material();
 	void update_material_params();
+	void update_custom_material_params();
+	void _on_custom_shader_changed();
+	void set_material_param(const StringName &name, const Variant &value);
 
 	HeightMapChunk *_make_chunk_cb(Point2i cpos, int lod);
 	void _recycle_chunk_cb(HeightMapChunk *chunk);
 
 	void add_chunk_update(HeightMapChunk &chunk, Point2i pos, int lod);
 	void update_chunk(HeightMapChunk &chunk, int lod);
+	void update_occlusion(Vector3 local_viewer_pos);
+	void update_proxy(Vector3 local_viewer_pos);
+	void update_navigation_parent();
+	void clear_proxy();
 
 	Point2i local_pos_to_cell(Vector3 local_pos) const;
 
+	Dictionary _raycast(Vector3 origin, Vector3 dir, real_t max_distance);
+
+	PoolRealArray overlap_batch(int count,
+			const PoolVector3Array *points_a, const PoolVector3Array *points_b,
+			const PoolRealArray *radii, const PoolVector3Array *boxes) const;
+
 	void _on_data_resolution_changed();
 	void _on_data_region_changed(int min_x, int min_y, int max_x, int max_y, int channel);
 
@@ -91,11 +174,40 @@ private:
 private:
 	Ref<ShaderMaterial> _custom_material;
 	Ref<ShaderMaterial> _material;
+	// Custom material _material was duplicated from
+	Ref<ShaderMaterial> _material_source;
+
+	// Params of the custom shader, cached until the shader changes, with the last values copied
+	Ref<Shader> _custom_shader;
+	Vector<StringName> _custom_shader_params;
+	Vector<Variant> _custom_shader_param_values;
+	bool _custom_shader_params_dirty;
+
+	// Textures of the data, given to materials
+	Ref<Texture> _data_textures[HeightMapData::CHANNEL_COUNT];
+	bool _data_textures_dirty;
+
 	bool _collision_enabled;
+	HeightMapCollider _collider;
+	bool _navigation_enabled;
+	HeightMapNavigation _navigation;
+	int _chunk_size;
 	Ref<HeightMapData> _data;
 	HeightMapMesher _mesher;
 	QuadTreeLod<HeightMapChunk *> _lodder;
 
+	bool _occlusion_culling_enabled;
+	HeightMapOcclusionCuller _occlusion_culler;
+	Vector<HeightMapOcclusionCuller::Occludee> _occludees;
+	Vector<HeightMapChunk *> _occludee_chunks;
+
+	float _proxy_distance;
+	HeightMapProxy _proxy;
+	HeightMapChunk *_proxy_chunk;
+	Ref<ShaderMaterial> _proxy_material;
+	// Shader of chunks the proxy material was set up for
+	Ref<Shader> _proxy_shader_source;
+
 	struct PendingChunkUpdate {
 		Point2i pos;
 		int lod;
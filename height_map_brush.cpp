@@ -1,14 +1,23 @@
 #include "height_map_brush.h"
+#include "thread_pool.h"
 #include "utility.h"
 
+#define DEFAULT_SPACING 0.25
+#define SMOOTH_KERNEL_RADIUS_DIVISOR 4
+#define SMOOTH_SPEED_SCALE 10.0
+#define SHAPE_CACHE_MAX_SIZE 64
+
 HeightMapBrush::HeightMapBrush() {
 	_opacity = 1;
 	_radius = 0;
-	_shape_sum = 0;
 	_mode = MODE_ADD;
 	_flatten_height = 0;
 	_texture_index = 0;
 	_color = Color(1, 1, 1, 1);
+	_shape_dirty = false;
+	_spacing = DEFAULT_SPACING;
+	_stroke_started = false;
+	_distance_to_next_dab = 0;
 }
 
 void HeightMapBrush::set_mode(Mode mode) {
@@ -22,11 +31,84 @@ void HeightMapBrush::set_radius(int p_radius) {
 	if (p_radius != _radius) {
 		ERR_FAIL_COND(p_radius <= 0);
 		_radius = p_radius;
-		generate_procedural(_radius);
-		// TODO Allow to set a texture as shape
+		// The shape is only made when painting, so dragging the size slider costs nothing
+		_shape_dirty = true;
+	}
+}
+
+void HeightMapBrush::set_shape_image(Ref<Image> image) {
+
+	_shape_image = image;
+	_shape_image_values.resize(Point2i(0, 0), false);
+	_shape_cache.clear();
+	_shape_dirty = true;
+
+	if (image.is_null())
+		return;
+
+	ERR_FAIL_COND(image->empty());
+
+	// Read once here, so scaling doesn't have to go through Image
+	Ref<Image> im_ref;
+	im_ref.instance();
+	im_ref->copy_from(image);
+	Image &im = **im_ref;
+	if (im.is_compressed())
+		im.decompress();
+
+	_shape_image_values.resize(Point2i(im.get_width(), im.get_height()), false);
+	float *values = _shape_image_values.raw_write();
+	float max_value = 0;
+
+	im.lock();
+	for (int y = 0; y < im.get_height(); ++y) {
+		for (int x = 0; x < im.get_width(); ++x) {
+			Color c = im.get_pixel(x, y);
+			float v = c.gray() * c.a;
+			values[x + y * im.get_width()] = v;
+			max_value = MAX(max_value, v);
+		}
+	}
+	im.unlock();
+
+	if (max_value > 0) {
+		for (int i = 0; i < _shape_image_values.area(); ++i) {
+			values[i] /= max_value;
+		}
 	}
 }
 
+void HeightMapBrush::update_shape() {
+
+	if (!_shape_dirty)
+		return;
+	_shape_dirty = false;
+
+	ERR_FAIL_COND(_radius <= 0);
+
+	if (_shape_cache.size() >= SHAPE_CACHE_MAX_SIZE && !_shape_cache.has(_radius)) {
+		// Going back and forth between sizes only touches a few of them anyways
+		_shape_cache.clear();
+	}
+
+	Grid2D<float> *shape = _shape_cache.getptr(_radius);
+
+	if (shape == NULL) {
+		Grid2D<float> new_shape;
+		if (_shape_image_values.area() != 0)
+			generate_from_image(_radius, new_shape);
+		else
+			generate_procedural(_radius, new_shape);
+		_shape_cache[_radius] = new_shape;
+		shape = _shape_cache.getptr(_radius);
+	}
+
+	// Grid data is shared, not copied
+	_shape = *shape;
+
+	generate_smooth_kernel(_radius);
+}
+
 void HeightMapBrush::set_opacity(float opacity) {
 	if (opacity < 0)
 		opacity = 0;
@@ -35,6 +117,10 @@ void HeightMapBrush::set_opacity(float opacity) {
 	_opacity = opacity;
 }
 
+void HeightMapBrush::set_spacing(float spacing) {
+	_spacing = CLAMP(spacing, 0.01, 4.0);
+}
+
 void HeightMapBrush::set_flatten_height(float flatten_height) {
 	_flatten_height = flatten_height;
 }
@@ -50,12 +136,10 @@ void HeightMapBrush::set_color(Color c) {
 	_color = c;
 }
 
-void HeightMapBrush::generate_procedural(int radius) {
+void HeightMapBrush::generate_procedural(int radius, Grid2D<float> &shape) const {
 	ERR_FAIL_COND(radius <= 0);
 	int size = 2 * radius;
-	_shape.resize(Point2i(size, size), false);
-
-	_shape_sum = 0;
+	shape.resize(Point2i(size, size), false);
 
 	for (int y = -radius; y < radius; ++y) {
 		for (int x = -radius; x < radius; ++x) {
@@ -65,12 +149,64 @@ void HeightMapBrush::generate_procedural(int radius) {
 				v = 1.f;
 			if (v < 0.f)
 				v = 0.f;
-			_shape.set(x + radius, y + radius, v);
-			_shape_sum += v;
+			shape.set(x + radius, y + radius, v);
 		}
 	}
 }
 
+// Bilinear scaling of the shape image to the size of the brush
+void HeightMapBrush::generate_from_image(int radius, Grid2D<float> &shape) const {
+	ERR_FAIL_COND(radius <= 0);
+	int size = 2 * radius;
+	shape.resize(Point2i(size, size), false);
+
+	const Grid2D<float> &src = _shape_image_values;
+	Vector2 scale(static_cast<float>(src.size().x) / size, static_cast<float>(src.size().y) / size);
+
+	float *dst = shape.raw_write();
+
+	for (int y = 0; y < size; ++y) {
+		for (int x = 0; x < size; ++x) {
+
+			// Sample at the center of cells
+			float sx = (x + 0.5f) * scale.x - 0.5f;
+			float sy = (y + 0.5f) * scale.y - 0.5f;
+			int x0 = Math::floor(sx);
+			int y0 = Math::floor(sy);
+			float fx = sx - x0;
+			float fy = sy - y0;
+
+			float h00 = src.get_clamped(x0, y0);
+			float h10 = src.get_clamped(x0 + 1, y0);
+			float h01 = src.get_clamped(x0, y0 + 1);
+			float h11 = src.get_clamped(x0 + 1, y0 + 1);
+
+			float v = Math::lerp(Math::lerp(h00, h10, fx), Math::lerp(h01, h11, fx), fy);
+			dst[x + y * size] = v;
+		}
+	}
+}
+
+// The smoothing kernel spans a fraction of the brush, so it smooths details instead of flattening the whole area
+void HeightMapBrush::generate_smooth_kernel(int radius) {
+
+	int kr = MAX(radius / SMOOTH_KERNEL_RADIUS_DIVISOR, 1);
+	float sigma = MAX(kr / 2.f, 0.5f);
+
+	_smooth_kernel.resize(2 * kr + 1);
+
+	float sum = 0;
+	for (int i = -kr; i <= kr; ++i) {
+		float v = Math::exp(-(i * i) / (2.f * sigma * sigma));
+		_smooth_kernel[i + kr] = v;
+		sum += v;
+	}
+
+	for (int i = 0; i < _smooth_kernel.size(); ++i) {
+		_smooth_kernel[i] /= sum;
+	}
+}
+
 HeightMapData::Channel HeightMapBrush::get_mode_channel(Mode mode) {
 	switch(mode) {
 	case MODE_ADD:
@@ -91,11 +227,60 @@ HeightMapData::Channel HeightMapBrush::get_mode_channel(Mode mode) {
 	return HeightMapData::CHANNEL_COUNT; // Error
 }
 
+void HeightMapBrush::begin_stroke() {
+	_stroke_started = false;
+	_distance_to_next_dab = 0;
+	_pending_dabs.clear();
+}
+
+void HeightMapBrush::add_stroke_point(Vector2 cell_pos) {
+
+	if (!_stroke_started) {
+		_stroke_started = true;
+		_last_stroke_pos = cell_pos;
+		_distance_to_next_dab = 0;
+	}
+
+	float spacing = MAX(_spacing * _radius, 1.f);
+
+	Vector2 d = cell_pos - _last_stroke_pos;
+	float len = d.length();
+	Vector2 dir = len > 0 ? d / len : Vector2();
+
+	// The remaining distance carries over to the next segment, so dabs stay evenly spaced along the whole path
+	while (_distance_to_next_dab <= len) {
+		Vector2 p = _last_stroke_pos + dir * _distance_to_next_dab;
+		_pending_dabs.push_back(Point2i(Math::floor(p.x + 0.5f), Math::floor(p.y + 0.5f)));
+		_distance_to_next_dab += spacing;
+	}
+
+	_distance_to_next_dab -= len;
+	_last_stroke_pos = cell_pos;
+}
+
+void HeightMapBrush::flush_stroke(HeightMap &height_map, int override_mode) {
+	if (_pending_dabs.size() == 0)
+		return;
+	paint_dabs(height_map, _pending_dabs, override_mode);
+	_pending_dabs.clear();
+}
+
 void HeightMapBrush::paint(HeightMap &height_map, Point2i cell_pos, int override_mode) {
+	Vector<Point2i> cell_positions;
+	cell_positions.push_back(cell_pos);
+	paint_dabs(height_map, cell_positions, override_mode);
+}
+
+void HeightMapBrush::paint_dabs(HeightMap &height_map, const Vector<Point2i> &cell_positions, int override_mode) {
 
 	ERR_FAIL_COND(height_map.get_data().is_null());
 	HeightMapData &data = **height_map.get_data();
 
+	if (cell_positions.size() == 0)
+		return;
+
+	update_shape();
+
 	float delta = _opacity * 1.f / 60.f;
 	Mode mode = _mode;
 
@@ -104,124 +289,277 @@ void HeightMapBrush::paint(HeightMap &height_map, Point2i cell_pos, int override
 		mode = (Mode)override_mode;
 	}
 
-	Point2i origin = cell_pos - _shape.size() / 2;
+	if (height_map.get_chunk_size() != _undo_cache.chunk_size) {
+		// Undo chunks of the current stroke would no longer line up, start a new one
+		_undo_cache.clear();
+		_undo_cache.chunk_size = height_map.get_chunk_size();
+	}
+
+	// Area covered by all dabs
+	Point2i min = cell_positions[0] - _shape.size() / 2;
+	Point2i max = min + _shape.size();
+
+	for (int i = 0; i < cell_positions.size(); ++i) {
 
-	height_map.set_area_dirty(origin, _shape.size());
+		Point2i origin = cell_positions[i] - _shape.size() / 2;
 
-	switch (mode) {
+		min.x = MIN(min.x, origin.x);
+		min.y = MIN(min.y, origin.y);
+		max.x = MAX(max.x, origin.x + _shape.size().x);
+		max.y = MAX(max.y, origin.y + _shape.size().y);
 
-		case MODE_ADD:
-			paint_height(data, origin, 50.0 * delta);
-			break;
+		switch (mode) {
 
-		case MODE_SUBTRACT:
-			paint_height(data, origin, -50.0 * delta);
-			break;
+			case MODE_ADD:
+				paint_height(data, origin, 50.0 * delta);
+				break;
 
-		case MODE_SMOOTH:
-			smooth_height(data, origin, delta);
-			break;
+			case MODE_SUBTRACT:
+				paint_height(data, origin, -50.0 * delta);
+				break;
 
-		case MODE_FLATTEN:
-			flatten_height(data, origin);
-			break;
+			case MODE_SMOOTH:
+				smooth_height(data, origin, delta);
+				break;
 
-		case MODE_SPLAT:
-			paint_splat(data, origin);
-			break;
+			case MODE_FLATTEN:
+				flatten_height(data, origin);
+				break;
 
-		case MODE_COLOR:
-			paint_color(data, origin);
-			break;
+			case MODE_SPLAT:
+				paint_splat(data, origin);
+				break;
 
-		case MODE_MASK:
-			paint_mask(data, origin);
-			break;
+			case MODE_COLOR:
+				paint_color(data, origin);
+				break;
 
-		default:
-			break;
+			case MODE_MASK:
+				paint_mask(data, origin);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	HeightMapData::Channel channel = get_mode_channel(mode);
+
+	if (channel == HeightMapData::CHANNEL_HEIGHT) {
+		// Normals depend on neighbour heights, so those around the area change too
+		data.update_normals(min - Point2i(1, 1), max - min + Point2i(2, 2));
 	}
 
-	data.notify_region_change(origin, _shape.size(), get_mode_channel(mode));
+	height_map.set_area_dirty(min, max - min);
+	data.notify_region_change(min, max, channel);
 }
 
+// Brushes smaller than this many rows are painted on the calling thread only
+#define BRUSH_MIN_ROWS_PER_TASK 32
+
+// Operators work on rows of raw pixels, with `count` pixels starting at column `x`.
+// `shape` points to the matching values of the brush, to be multiplied by `s`.
+// Nothing goes through Color, so the cost is mostly reading and writing memory.
+// Rows are painted in bands on several threads, so operators must only touch the row they are given.
 template <typename Operator_T>
-void foreach_xy(
+struct ForeachRowAction {
+	Operator_T &op;
+	const Grid2D<float> &shape;
+	Point2i origin;
+	Point2i min;
+	int count;
+	float s;
+
+	ForeachRowAction(Operator_T &p_op, const Grid2D<float> &p_shape) :
+			op(p_op), shape(p_shape), count(0), s(0) {}
+
+	void operator()(int begin, int end) {
+		for (int y = min.y + begin; y < min.y + end; ++y) {
+			const float *shape_row = shape.raw() + (y - origin.y) * shape.size().x + (min.x - origin.x);
+			op(y, min.x, count, shape_row, s);
+		}
+	}
+};
+
+template <typename Operator_T>
+void foreach_row(
 		Operator_T &op,
-		HeightMapData &data,
+		int resolution,
 		Point2i origin,
 		float speed,
 		float opacity,
 		const Grid2D<float> &shape) {
 
-	Point2i shape_size = shape.size();
+	Point2i min = origin;
+	Point2i max = min + shape.size();
 
-	float s = opacity * speed;
+	clamp_min_max_excluded(min, max, Point2i(0,0), Point2i(resolution, resolution));
 
-	Point2i min = origin;
-	Point2i max = min + shape_size;
-	Point2i min_noclamp = min;
+	if (max.x <= min.x || max.y <= min.y)
+		return;
 
-	clamp_min_max_excluded(min, max, Point2i(0,0), Point2i(data.get_resolution(), data.get_resolution()));
+	ForeachRowAction<Operator_T> action(op, shape);
+	action.origin = origin;
+	action.min = min;
+	action.count = max.x - min.x;
+	action.s = opacity * speed;
 
-	Point2i pos;
-	for (pos.y = min.y; pos.y < max.y; ++pos.y) {
-		for (pos.x = min.x; pos.x < max.x; ++pos.x) {
+	ThreadPool::get_singleton()->parallel_for(max.y - min.y, action, BRUSH_MIN_ROWS_PER_TASK);
+}
 
-			float shape_value = shape.get(pos - min_noclamp);
-			op(data, pos, s * shape_value);
+struct OperatorAdd {
+	const ImageRawWrite<uint16_t> &_heights;
+	OperatorAdd(const ImageRawWrite<uint16_t> &heights)
+		: _heights(heights) {}
+	void operator()(int y, int x, int count, const float *shape, float s) {
+		uint16_t *row = _heights.row(y) + x;
+		for (int i = 0; i < count; ++i) {
+			row[i] = encode_height(decode_height(row[i]) + s * shape[i]);
 		}
 	}
-}
+};
 
-struct OperatorAdd {
-	Image &_im;
-	OperatorAdd(Image &im)
-		: _im(im) {}
-	void operator()(HeightMapData &data, Point2i pos, float v) {
-		Color c = _im.get_pixel(pos.x, pos.y);
-		c.r += v;
-		_im.set_pixel(pos.x, pos.y, c);
+struct OperatorLerp {
+
+	float target;
+	const ImageRawWrite<uint16_t> &_heights;
+
+	OperatorLerp(float p_target, const ImageRawWrite<uint16_t> &heights)
+		: target(p_target), _heights(heights) {}
+
+	void operator()(int y, int x, int count, const float *shape, float s) {
+		uint16_t *row = _heights.row(y) + x;
+		for (int i = 0; i < count; ++i) {
+			row[i] = encode_height(Math::lerp(decode_height(row[i]), target, s * shape[i]));
+		}
 	}
 };
 
-struct OperatorSum {
-	float sum;
-	const Image &_im;
-	OperatorSum(const Image &im)
-		: sum(0), _im(im) {}
-	void operator()(HeightMapData &data, Point2i pos, float v) {
-		sum += _im.get_pixel(pos.x, pos.y).r * v;
+// Horizontal pass of the smoothing blur.
+// Source rows are padded by the kernel radius on both sides, so output pixel x reads from x to x + kernel_size - 1.
+// Rows are done one tap at a time, which keeps the inner loop a multiply-add over contiguous floats.
+struct SmoothHorizontalAction {
+	const float *src;
+	float *dst;
+	const float *kernel;
+	int kernel_size;
+	int src_width;
+	int width;
+
+	void operator()(int begin, int end) {
+		for (int y = begin; y < end; ++y) {
+			const float *src_row = src + y * src_width;
+			float *dst_row = dst + y * width;
+
+			for (int x = 0; x < width; ++x) {
+				dst_row[x] = 0;
+			}
+			for (int k = 0; k < kernel_size; ++k) {
+				const float *s = src_row + k;
+				float w = kernel[k];
+				for (int x = 0; x < width; ++x) {
+					dst_row[x] += s[x] * w;
+				}
+			}
+		}
 	}
 };
 
-struct OperatorLerp {
+// Vertical pass of the smoothing blur, same as above along columns.
+// Source has kernel_size - 1 more rows than the output.
+struct SmoothVerticalAction {
+	const float *src;
+	float *dst;
+	const float *kernel;
+	int kernel_size;
+	int width;
+
+	void operator()(int begin, int end) {
+		for (int y = begin; y < end; ++y) {
+			float *dst_row = dst + y * width;
+
+			for (int x = 0; x < width; ++x) {
+				dst_row[x] = 0;
+			}
+			for (int k = 0; k < kernel_size; ++k) {
+				const float *s = src + (y + k) * width;
+				float w = kernel[k];
+				for (int x = 0; x < width; ++x) {
+					dst_row[x] += s[x] * w;
+				}
+			}
+		}
+	}
+};
 
-	float target;
-	Image &_im;
+// Cells are pulled toward their blurred value
+struct OperatorSmooth {
+	const ImageRawWrite<uint16_t> &_heights;
+	const float *_blurred;
+	// Area covered by blurred rows, in map coordinates
+	Point2i _blurred_min;
+	int _blurred_width;
+
+	OperatorSmooth(const ImageRawWrite<uint16_t> &heights)
+		: _heights(heights), _blurred(NULL), _blurred_width(0) {}
 
-	OperatorLerp(float p_target, Image &im)
-		: target(p_target), _im(im) {}
+	void operator()(int y, int x, int count, const float *shape, float s) {
+		uint16_t *row = _heights.row(y) + x;
+		const float *blurred_row = _blurred + (y - _blurred_min.y) * _blurred_width + (x - _blurred_min.x);
 
-	void operator()(HeightMapData &data, Point2i pos, float v) {
-		Color c = _im.get_pixel(pos.x, pos.y);
-		c.r = Math::lerp(c.r, target, v);
-		_im.set_pixel(pos.x, pos.y, c);
+		for (int i = 0; i < count; ++i) {
+			row[i] = encode_height(Math::lerp(decode_height(row[i]), blurred_row[i], s * shape[i]));
+		}
 	}
 };
 
+// Works on RGBA8 pixels, rounding like Image::set_pixel does
 struct OperatorLerpColor {
 
-	Color target;
-	Image &_im;
+	float target[4];
+	const ImageRawWrite<uint8_t> &_colors;
+
+	OperatorLerpColor(Color p_target, const ImageRawWrite<uint8_t> &colors)
+		: _colors(colors) {
+		target[0] = p_target.r * 255.f;
+		target[1] = p_target.g * 255.f;
+		target[2] = p_target.b * 255.f;
+		target[3] = p_target.a * 255.f;
+	}
+
+	void operator()(int y, int x, int count, const float *shape, float s) {
+		uint8_t *row = _colors.row(y) + x * 4;
+		for (int i = 0; i < count; ++i) {
+			uint8_t *p = row + i * 4;
+			float v = s * shape[i];
+			for (int c = 0; c < 4; ++c) {
+				float f = p[c] + (target[c] - p[c]) * v;
+				p[c] = CLAMP(f, 0.f, 255.f);
+			}
+		}
+	}
+};
+
+// Sets pixels where the shape is strong enough to a fixed value
+template <int PIXEL_SIZE>
+struct OperatorStamp {
 
-	OperatorLerpColor(Color p_target, Image &im)
-		: target(p_target), _im(im) {}
+	uint8_t value[PIXEL_SIZE];
+	float threshold;
+	const ImageRawWrite<uint8_t> &_pixels;
 
-	void operator()(HeightMapData &data, Point2i pos, float v) {
-		Color c = _im.get_pixel(pos.x, pos.y);
-		c = c.linear_interpolate(target, v);
-		_im.set_pixel(pos.x, pos.y, c);
+	OperatorStamp(const ImageRawWrite<uint8_t> &pixels, float p_threshold)
+		: threshold(p_threshold), _pixels(pixels) {}
+
+	void operator()(int y, int x, int count, const float *shape, float s) {
+		uint8_t *row = _pixels.row(y) + x * PIXEL_SIZE;
+		for (int i = 0; i < count; ++i) {
+			if (s * shape[i] > threshold) {
+				for (int c = 0; c < PIXEL_SIZE; ++c) {
+					row[i * PIXEL_SIZE + c] = value[c];
+				}
+			}
+		}
 	}
 };
 
@@ -248,26 +586,32 @@ static inline bool is_valid_pos(Point2i pos, const Image &im) {
 	return !(pos.x < 0 || pos.y < 0 || pos.x >= im.get_width() || pos.y >= im.get_height());
 }
 
-void HeightMapBrush::backup_for_undo(const Image &im, HeightMapBrush::UndoCache &undo_cache, Point2i rect_origin, Point2i rect_size) {
+// Backup cells before they get changed,
+// using chunks so that we don't save the entire grid everytime.
+// This function won't do anything if all concerned chunks got backupped already.
+// Chunks are copied into buffers recycled by the undo store.
+template <int CHUNK_SIZE>
+static void backup_chunks_for_undo(const Image &im, HashMap<Point2i, PoolByteArray> &chunks, Point2i rect_origin, Point2i rect_size) {
 
-	// Backup cells before they get changed,
-	// using chunks so that we don't save the entire grid everytime.
-	// This function won't do anything if all concerned chunks got backupped already.
+	HeightMapUndoStore &store = *HeightMapUndoStore::get_singleton();
+	ImageRawView<uint8_t> pixels(im);
+	int pixel_size = Image::get_format_pixel_size(im.get_format());
+	int row_bytes = CHUNK_SIZE * pixel_size;
 
-	Point2i cmin = rect_origin / HeightMap::CHUNK_SIZE;
-	Point2i cmax = (rect_origin + rect_size - Point2i(1,1)) / HeightMap::CHUNK_SIZE + Point2i(1,1);
+	Point2i cmin = rect_origin / CHUNK_SIZE;
+	Point2i cmax = (rect_origin + rect_size - Point2i(1,1)) / CHUNK_SIZE + Point2i(1,1);
 
 	Point2i cpos;
 	for(cpos.y = cmin.y; cpos.y < cmax.y; ++cpos.y) {
 		for(cpos.x = cmin.x; cpos.x < cmax.x; ++cpos.x) {
 
-			if(undo_cache.chunks.getptr(cpos) != NULL) {
+			if(chunks.getptr(cpos) != NULL) {
 				// Already backupped
 				continue;
 			}
 
-			Point2i min = cpos * HeightMap::CHUNK_SIZE;
-			Point2i max = min + Point2i(HeightMap::CHUNK_SIZE, HeightMap::CHUNK_SIZE);
+			Point2i min = cpos * CHUNK_SIZE;
+			Point2i max = min + Point2i(CHUNK_SIZE, CHUNK_SIZE);
 
 			bool invalid_min = !is_valid_pos(min, im);
 			bool invalid_max = !is_valid_pos(max - Point2i(1,1), im); // Note: max is excluded
@@ -282,44 +626,138 @@ void HeightMapBrush::backup_for_undo(const Image &im, HeightMapBrush::UndoCache
 				continue;
 			}
 
-			Ref<Image> sub_image = im.get_rect(Rect2(min, max - min));
-			undo_cache.chunks[cpos] = sub_image;
+			PoolByteArray tile = store.acquire_tile(row_bytes * CHUNK_SIZE);
+			{
+				PoolByteArray::Write w = tile.write();
+				for (int y = 0; y < CHUNK_SIZE; ++y) {
+					copymem(w.ptr() + y * row_bytes, pixels.row(min.y + y) + min.x * pixel_size, row_bytes);
+				}
+			}
+			chunks[cpos] = tile;
 		}
 	}
 }
 
+struct BackupForUndoAction {
+	const Image &im;
+	HashMap<Point2i, PoolByteArray> &chunks;
+	Point2i rect_origin;
+	Point2i rect_size;
+
+	BackupForUndoAction(const Image &p_im, HashMap<Point2i, PoolByteArray> &p_chunks, Point2i p_rect_origin, Point2i p_rect_size) :
+			im(p_im), chunks(p_chunks), rect_origin(p_rect_origin), rect_size(p_rect_size) {}
+
+	template <int CHUNK_SIZE>
+	void process() {
+		backup_chunks_for_undo<CHUNK_SIZE>(im, chunks, rect_origin, rect_size);
+	}
+};
+
+void HeightMapBrush::backup_for_undo(const Image &im, Point2i rect_origin, Point2i rect_size) {
+	BackupForUndoAction action(im, _undo_cache.chunks, rect_origin, rect_size);
+	if (!dispatch_chunk_size(_undo_cache.chunk_size, action)) {
+		ERR_PRINT("Unsupported chunk size");
+	}
+}
+
 void HeightMapBrush::paint_height(HeightMapData &data, Point2i origin, float speed) {
 
 	Ref<Image> im_ref = data.get_image(HeightMapData::CHANNEL_HEIGHT);
 	ERR_FAIL_COND(im_ref.is_null());
 
-	LockImage lock(im_ref);
+	backup_for_undo(**im_ref, origin, _shape.size());
 
-	backup_for_undo(**im_ref, _undo_cache, origin, _shape.size());
-
-	OperatorAdd op(**im_ref);
-	foreach_xy(op, data, origin, speed, _opacity, _shape);
-
-	data.update_normals(origin, _shape.size());
+	{
+		ImageRawWrite<uint16_t> heights(**im_ref);
+		OperatorAdd op(heights);
+		foreach_row(op, data.get_resolution(), origin, speed, _opacity, _shape);
+	}
 }
 
 void HeightMapBrush::smooth_height(HeightMapData &data, Point2i origin, float speed) {
 
 	Ref<Image> im_ref = data.get_image(HeightMapData::CHANNEL_HEIGHT);
 	ERR_FAIL_COND(im_ref.is_null());
+	ERR_FAIL_COND(_smooth_kernel.size() == 0);
 
-	LockImage lock(im_ref);
+	backup_for_undo(**im_ref, origin, _shape.size());
 
-	backup_for_undo(**im_ref, _undo_cache, origin, _shape.size());
+	int res = data.get_resolution();
+	int kr = _smooth_kernel.size() / 2;
 
-	OperatorSum sum_op(**im_ref);
-	foreach_xy(sum_op, data, origin, 1, _opacity, _shape);
-	float target_value = sum_op.sum / _shape_sum;
+	Point2i min = origin;
+	Point2i max = origin + _shape.size();
+	clamp_min_max_excluded(min, max, Point2i(0, 0), Point2i(res, res));
+
+	if (max.x <= min.x || max.y <= min.y)
+		return;
+
+	// Blurring needs cells around the brush too.
+	// They are decoded with the kernel radius on each side, repeating the edges of the map where they go past it,
+	// so blur passes never have to clamp.
+	Point2i size = max - min;
+	Point2i src_size = size + Point2i(2 * kr, 2 * kr);
+	Point2i src_min = min - Point2i(kr, kr);
+
+	// Heights are decoded once, blurred along X then Y, and the brush operator only blends.
+	// All of it fits in one scratch buffer kept between dabs.
+	int src_area = src_size.x * src_size.y;
+	int h_area = size.x * src_size.y;
+	int required_size = src_area + h_area + size.x * size.y;
+	if (_smooth_scratch.size() < required_size)
+		_smooth_scratch.resize(required_size);
+
+	float *src = &_smooth_scratch[0];
+	float *h_blurred = src + src_area;
+	float *blurred = h_blurred + h_area;
+
+	// Also used to read, a separate view would make it copy the whole map
+	ImageRawWrite<uint16_t> heights(**im_ref);
+
+	// Columns of src inside the map
+	int x0 = MAX(src_min.x, 0) - src_min.x;
+	int x1 = MIN(src_min.x + src_size.x, res) - src_min.x;
+
+	for (int y = 0; y < src_size.y; ++y) {
+		const uint16_t *row = heights.row(CLAMP(src_min.y + y, 0, res - 1));
+		float *src_row = src + y * src_size.x;
+		for (int x = x0; x < x1; ++x) {
+			src_row[x] = decode_height(row[src_min.x + x]);
+		}
+		for (int x = 0; x < x0; ++x) {
+			src_row[x] = src_row[x0];
+		}
+		for (int x = x1; x < src_size.x; ++x) {
+			src_row[x] = src_row[x1 - 1];
+		}
+	}
 
-	OperatorLerp lerp_op(target_value, **im_ref);
-	foreach_xy(lerp_op, data, origin, speed, _opacity, _shape);
+	SmoothHorizontalAction h_action;
+	h_action.src = src;
+	h_action.dst = h_blurred;
+	h_action.kernel = _smooth_kernel.ptr();
+	h_action.kernel_size = _smooth_kernel.size();
+	h_action.src_width = src_size.x;
+	h_action.width = size.x;
 
-	data.update_normals(origin, _shape.size());
+	ThreadPool::get_singleton()->parallel_for(src_size.y, h_action, BRUSH_MIN_ROWS_PER_TASK);
+
+	SmoothVerticalAction v_action;
+	v_action.src = h_blurred;
+	v_action.dst = blurred;
+	v_action.kernel = _smooth_kernel.ptr();
+	v_action.kernel_size = _smooth_kernel.size();
+	v_action.width = size.x;
+
+	ThreadPool::get_singleton()->parallel_for(size.y, v_action, BRUSH_MIN_ROWS_PER_TASK);
+
+	OperatorSmooth op(heights);
+	op._blurred = blurred;
+	op._blurred_min = min;
+	op._blurred_width = size.x;
+
+	// Speed is scaled up because, unlike the old averaging, each dab only moves cells a little toward their neighbours
+	foreach_row(op, res, origin, MIN(speed * SMOOTH_SPEED_SCALE, 1.f), _opacity, _shape);
 }
 
 void HeightMapBrush::flatten_height(HeightMapData &data, Point2i origin) {
@@ -327,162 +765,88 @@ void HeightMapBrush::flatten_height(HeightMapData &data, Point2i origin) {
 	Ref<Image> im_ref = data.get_image(HeightMapData::CHANNEL_HEIGHT);
 	ERR_FAIL_COND(im_ref.is_null());
 
-	LockImage lock(im_ref);
-
-	backup_for_undo(**im_ref, _undo_cache, origin, _shape.size());
+	backup_for_undo(**im_ref, origin, _shape.size());
 
-	OperatorLerp op(_flatten_height, **im_ref);
-	foreach_xy(op, data, origin, 1, 1, _shape);
-
-	data.update_normals(origin, _shape.size());
+	{
+		ImageRawWrite<uint16_t> heights(**im_ref);
+		OperatorLerp op(_flatten_height, heights);
+		foreach_row(op, data.get_resolution(), origin, 1, 1, _shape);
+	}
 }
 
 void HeightMapBrush::paint_splat(HeightMapData &data, Point2i origin) {
 
 	Ref<Image> im_ref = data.get_image(HeightMapData::CHANNEL_SPLAT);
 	ERR_FAIL_COND(im_ref.is_null());
-	Image &im = **im_ref;
-
-	im.lock();
-	backup_for_undo(im, _undo_cache, origin, _shape.size());
-	im.unlock();
-
-	Point2i shape_size = _shape.size();
-
-	Point2i min = origin;
-	Point2i max = min + shape_size;
-	Point2i min_noclamp = min;
-
-	clamp_min_max_excluded(min, max, Point2i(0,0), Point2i(data.get_resolution(), data.get_resolution()));
-
-	Point2i pos;
-	const float shape_threshold = 0.1;
+	ERR_FAIL_COND(im_ref->get_format() != Image::FORMAT_RG8);
 
-	LockImage lock(im_ref);
+	backup_for_undo(**im_ref, origin, _shape.size());
 
-	for (pos.y = min.y; pos.y < max.y; ++pos.y) {
-		for (pos.x = min.x; pos.x < max.x; ++pos.x) {
+	ImageRawWrite<uint8_t> splats(**im_ref);
 
-			float shape_value = _shape.get(pos - min_noclamp);
+	// TODO Improve weight blending, it looks meh
+	// Same values set_pixel would give from a Color with r = index / 256 and g = opacity
+	OperatorStamp<2> op(splats, 0.1);
+	op.value[0] = CLAMP(static_cast<float>(_texture_index) / 256.0 * 255.0, 0, 255);
+	op.value[1] = CLAMP(_opacity * 255.0, 0, 255);
 
-			if(shape_value > shape_threshold) {
-
-				// TODO Improve weight blending, it looks meh
-
-				Color c;
-				c.r = static_cast<float>(_texture_index) / 256.0;
-				c.g = CLAMP(_opacity, 0.0, 1.0);
-				im.set_pixel(pos.x, pos.y, c);
-			}
-		}
-	}
+	foreach_row(op, data.get_resolution(), origin, 1, 1, _shape);
 }
 
 void HeightMapBrush::paint_color(HeightMapData &data, Point2i origin) {
 
 	Ref<Image> im_ref = data.get_image(HeightMapData::CHANNEL_COLOR);
 	ERR_FAIL_COND(im_ref.is_null());
+	ERR_FAIL_COND(im_ref->get_format() != Image::FORMAT_RGBA8);
 
-	LockImage lock(im_ref);
-
-	backup_for_undo(**im_ref, _undo_cache, origin, _shape.size());
+	backup_for_undo(**im_ref, origin, _shape.size());
 
-	OperatorLerpColor op(_color, **im_ref);
-	foreach_xy(op, data, origin, 1, _opacity, _shape);
+	ImageRawWrite<uint8_t> colors(**im_ref);
+	OperatorLerpColor op(_color, colors);
+	foreach_row(op, data.get_resolution(), origin, 1, _opacity, _shape);
 }
 
 void HeightMapBrush::paint_mask(HeightMapData &data, Point2i origin) {
 
 	Ref<Image> im_ref = data.get_image(HeightMapData::CHANNEL_MASK);
 	ERR_FAIL_COND(im_ref.is_null());
-	Image &im = **im_ref;
-
-	im.lock();
-	backup_for_undo(im, _undo_cache, origin, _shape.size());
-	im.unlock();
-
-	Point2i shape_size = _shape.size();
+	ERR_FAIL_COND(im_ref->get_format() != Image::FORMAT_R8);
 
-	Point2i min = origin;
-	Point2i max = min + shape_size;
-	Point2i min_noclamp = min;
-
-	clamp_min_max_excluded(min, max, Point2i(0,0), Point2i(data.get_resolution(), data.get_resolution()));
-
-	Point2i pos;
-	const float shape_threshold = 0.1;
-	const Color value = _opacity > 0.5 ? Color(1.0, 0.0, 0.0, 0.0) : Color();
-
-	LockImage lock(im_ref);
-
-	for (pos.y = min.y; pos.y < max.y; ++pos.y) {
-		for (pos.x = min.x; pos.x < max.x; ++pos.x) {
-
-			float shape_value = _shape.get(pos - min_noclamp);
+	backup_for_undo(**im_ref, origin, _shape.size());
 
-			if(shape_value > shape_threshold) {
-				im.set_pixel(pos.x, pos.y, value);
-			}
-		}
-	}
-}
+	ImageRawWrite<uint8_t> mask(**im_ref);
+	OperatorStamp<1> op(mask, 0.1);
+	op.value[0] = _opacity > 0.5 ? 255 : 0;
 
-static Array fetch_redo_chunks(const Image &im, const List<Point2i> &keys) {
-	Array output;
-	for (const List<Point2i>::Element *E = keys.front(); E; E = E->next()) {
-		Point2i cpos = E->get();
-		Point2i min = cpos * HeightMap::CHUNK_SIZE;
-		Point2i max = min + Point2i(1,1)*HeightMap::CHUNK_SIZE;
-		Ref<Image> sub_image = im.get_rect(Rect2(min, max - min));
-		output.append(sub_image);
-	}
-	return output;
+	foreach_row(op, data.get_resolution(), origin, 1, 1, _shape);
 }
 
 HeightMapBrush::UndoData HeightMapBrush::pop_undo_redo_data(const HeightMapData &heightmap_data) {
 
-	// TODO If possible, use a custom Reference class to store this data into the UndoRedo API,
-	// but WITHOUT exposing it to scripts (so we won't need the following conversions!)
-
 	UndoData data;
 
-	List<Point2i> chunk_positions_list;
-	_undo_cache.chunks.get_key_list(&chunk_positions_list);
-
 	HeightMapData::Channel channel = get_mode_channel(_mode);
 	ERR_FAIL_COND_V(channel == HeightMapData::CHANNEL_COUNT, data);
 
 	Ref<Image> im_ref = heightmap_data.get_image(channel);
 	ERR_FAIL_COND_V(im_ref.is_null(), data);
-	Array redo_data = fetch_redo_chunks(**im_ref, chunk_positions_list);
-
-	// Convert chunk positions to flat int array
-	Array undo_data;
-	PoolIntArray chunk_positions;
-	chunk_positions.resize(chunk_positions_list.size() * 2);
-	{
-		int i = 0;
-		PoolIntArray::Write r = chunk_positions.write();
-		for (List<Point2i>::Element *E = chunk_positions_list.front(); E; E = E->next()) {
 
-			Point2i cpos = E->get();
-			r[i] = cpos.x;
-			r[i+1] = cpos.y;
-			i += 2;
-
-			// Also gather pre-cached data for undo, in the same order
-			undo_data.append(_undo_cache.chunks[cpos]);
-		}
-	}
-
-	data.undo = undo_data;
-	data.redo = redo_data;
-	data.chunk_positions = chunk_positions;
 	data.channel = channel;
+	data.step = HeightMapUndoStore::get_singleton()->create_step(**im_ref, channel, _undo_cache.chunk_size, _undo_cache.chunks);
 
 	_undo_cache.clear();
 
 	return data;
 }
 
+void HeightMapBrush::UndoCache::clear() {
+
+	HeightMapUndoStore *store = HeightMapUndoStore::get_singleton();
 
+	const Point2i *key = NULL;
+	while ((key = chunks.next(key))) {
+		store->release_tile(chunks[*key]);
+	}
+
+	chunks.clear();
+}
@@ -3,6 +3,7 @@
 
 #include "grid.h"
 #include "height_map.h"
+#include "height_map_undo.h"
 
 class HeightMapBrush {
 public:
@@ -18,10 +19,9 @@ public:
 	};
 
 	struct UndoData {
-		PoolIntArray chunk_positions;
-		Array undo;
-		Array redo;
+		Ref<HeightMapUndoStep> step;
 		int channel;
+		UndoData() : channel(HeightMapData::CHANNEL_COUNT) {}
 	};
 
 	HeightMapBrush();
@@ -32,6 +32,10 @@ public:
 	void set_radius(int p_radius);
 	int get_radius() const { return _radius; }
 
+	// Grayscale image used as the shape of the brush, scaled to its size. Setting null goes back to the default falloff.
+	void set_shape_image(Ref<Image> image);
+	Ref<Image> get_shape_image() const { return _shape_image; }
+
 	void set_opacity(float opacity);
 	float get_opacity() const { return _opacity; }
 
@@ -46,19 +50,38 @@ public:
 	void set_color(Color c);
 	Color get_color() const { return _color; }
 
+	// Distance between dabs along a stroke, relative to the radius
+	void set_spacing(float spacing);
+	float get_spacing() const { return _spacing; }
+
 	void paint(HeightMap &height_map, Point2i cell_pos, int override_mode);
 
+	// Applies several dabs in one pass, with a single update of the area they cover
+	void paint_dabs(HeightMap &height_map, const Vector<Point2i> &cell_positions, int override_mode);
+
+	// Strokes accumulate positions from the mouse, and place dabs at regular spacing along the path between them.
+	// Dabs are only painted on flush, so it can be done once per frame whatever the number of input events.
+	void begin_stroke();
+	void add_stroke_point(Vector2 cell_pos);
+	bool has_pending_dabs() const { return _pending_dabs.size() != 0; }
+	void flush_stroke(HeightMap &height_map, int override_mode);
+
 	UndoData pop_undo_redo_data(const HeightMapData &heightmap_data);
 
 private:
 	struct UndoCache {
-		HashMap< Point2i, Ref<Image> > chunks;
-		void clear() {
-			chunks.clear();
-		}
+		// Pixels of chunks before they got modified
+		HashMap<Point2i, PoolByteArray> chunks;
+		int chunk_size;
+		UndoCache() : chunk_size(HeightMap::DEFAULT_CHUNK_SIZE) {}
+		// Gives buffers back to the undo store
+		void clear();
 	};
 
-	void generate_procedural(int radius);
+	void update_shape();
+	void generate_procedural(int radius, Grid2D<float> &shape) const;
+	void generate_from_image(int radius, Grid2D<float> &shape) const;
+	void generate_smooth_kernel(int radius);
 
 	void paint_height(HeightMapData &data, Point2i cell_pos, float speed);
 	void smooth_height(HeightMapData &data, Point2i cell_pos, float speed);
@@ -67,18 +90,33 @@ private:
 	void paint_splat(HeightMapData &data, Point2i origin);
 	void paint_mask(HeightMapData &data, Point2i origin);
 
-	static void backup_for_undo(const Image &im, UndoCache &undo_cache, Point2i rect_origin, Point2i rect_size);
+	void backup_for_undo(const Image &im, Point2i rect_origin, Point2i rect_size);
 
 private:
 	int _radius;
 	float _opacity;
 	Grid2D<float> _shape;
-	float _shape_sum;
+	bool _shape_dirty;
+	// Source values of the shape image, normalized so the brightest is 1
+	Grid2D<float> _shape_image_values;
+	Ref<Image> _shape_image;
+	// Shapes already scaled to a given radius
+	HashMap<int, Grid2D<float> > _shape_cache;
+	// Normalized 1D gaussian weights
+	Vector<float> _smooth_kernel;
+	// Reused between dabs so smoothing doesn't allocate all the time
+	Vector<float> _smooth_scratch;
 	Mode _mode;
 	float _flatten_height;
 	int _texture_index;
 	Color _color;
 	UndoCache _undo_cache;
+
+	float _spacing;
+	bool _stroke_started;
+	Vector2 _last_stroke_pos;
+	float _distance_to_next_dab;
+	Vector<Point2i> _pending_dabs;
 };
 
 
@@ -24,6 +24,7 @@ HeightMapChunk::HeightMapChunk(Spatial *p_parent, Point2i p_cell_pos, Ref<Materi
 	vs.instance_set_visible(_mesh_instance, true);
 
 	_visible = true;
+	_occluded = false;
 	_active = true;
 	_pending_update = false;
 
@@ -79,13 +80,26 @@ void HeightMapChunk::set_material(Ref<Material> material) {
 }
 
 void HeightMapChunk::set_visible(bool visible) {
+	_visible = visible;
+	update_visibility();
+}
+
+void HeightMapChunk::set_occluded(bool occluded) {
+	if (occluded == _occluded)
+		return;
+	_occluded = occluded;
+	update_visibility();
+}
+
+void HeightMapChunk::update_visibility() {
 	ERR_FAIL_COND(_mesh_instance.is_valid() == false);
 	VisualServer &vs = *VisualServer::get_singleton();
-	vs.instance_set_visible(_mesh_instance, visible);
+	vs.instance_set_visible(_mesh_instance, _visible && !_occluded);
 }
 
 void HeightMapChunk::set_aabb(AABB aabb) {
 	ERR_FAIL_COND(_mesh_instance.is_valid() == false);
+	_aabb = aabb;
 	VisualServer &vs = *VisualServer::get_singleton();
 	vs.instance_set_custom_aabb(_mesh_instance, aabb);
 }
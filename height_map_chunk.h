@@ -22,6 +22,10 @@ public:
 	void set_visible(bool visible);
 	bool is_visible() const { return _visible; }
 
+	// Hidden by occlusion culling, independently from visibility
+	void set_occluded(bool occluded);
+	bool is_occluded() const { return _occluded; }
+
 	void set_active(bool p_active) { _active = p_active; }
 	bool is_active() const { return _active; }
 
@@ -29,12 +33,19 @@ public:
 	void set_pending_update(bool pending_update) { _pending_update = pending_update; }
 
 	void set_aabb(AABB aabb);
+	AABB get_aabb() const { return _aabb; }
+
+private:
+	void update_visibility();
 
 private:
 	bool _visible;
+	bool _occluded;
 	bool _active;
 	bool _pending_update;
 
+	AABB _aabb;
+
 	RID _mesh_instance;
 	// Need to keep a reference so that the mesh RID doesn't get freed
 	// TODO Use RID directly, no need to keep all those meshes in memory
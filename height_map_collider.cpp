@@ -0,0 +1,403 @@
+#include <scene/3d/physics_body.h>
+
+#include "height_map_collider.h"
+#include "utility.h"
+
+#define DEFAULT_COLLIDER_RADIUS 32
+// Moving bodies beyond that count won't get collision
+#define MAX_BODIES 128
+// Tiles without collision closer than that to a body, in cells, are built right away instead of in the background
+#define SYNC_BUILD_MARGIN 2
+
+HeightMapCollider::HeightMapCollider() {
+	_instance_id = 0;
+	_radius = DEFAULT_COLLIDER_RADIUS;
+	_bounds_dirty = true;
+	_max_bodies_warned = false;
+}
+
+HeightMapCollider::~HeightMapCollider() {
+	clear();
+
+	PhysicsServer &ps = *PhysicsServer::get_singleton();
+	if (_body.is_valid()) {
+		ps.free(_body);
+		_body = RID();
+	}
+	if (_query_shape.is_valid()) {
+		ps.free(_query_shape);
+		_query_shape = RID();
+	}
+}
+
+void HeightMapCollider::create_body() {
+
+	if (_body.is_valid())
+		return;
+
+	PhysicsServer &ps = *PhysicsServer::get_singleton();
+
+	_body = ps.body_create(PhysicsServer::BODY_MODE_STATIC);
+	ps.body_attach_object_instance_id(_body, _instance_id);
+	ps.body_set_state(_body, PhysicsServer::BODY_STATE_TRANSFORM, _transform);
+	ps.body_set_space(_body, _space);
+
+	_query_shape = ps.shape_create(PhysicsServer::SHAPE_BOX);
+}
+
+void HeightMapCollider::set_instance_id(ObjectID id) {
+	_instance_id = id;
+	if (_body.is_valid())
+		PhysicsServer::get_singleton()->body_attach_object_instance_id(_body, _instance_id);
+}
+
+void HeightMapCollider::set_space(RID space) {
+	_space = space;
+	if (_body.is_valid())
+		PhysicsServer::get_singleton()->body_set_space(_body, _space);
+}
+
+void HeightMapCollider::set_transform(const Transform &transform) {
+	_transform = transform;
+	if (_body.is_valid())
+		PhysicsServer::get_singleton()->body_set_state(_body, PhysicsServer::BODY_STATE_TRANSFORM, _transform);
+}
+
+void HeightMapCollider::set_radius(float radius) {
+	_radius = MAX(radius, 0);
+}
+
+void HeightMapCollider::set_area_dirty(Point2i origin_in_cells, Point2i size_in_cells) {
+
+	_bounds_dirty = true;
+
+	if (_tiles.area() == 0)
+		return;
+
+	// Tiles share their edges
+	Point2i tmin((origin_in_cells.x - 1) / TILE_SIZE, (origin_in_cells.y - 1) / TILE_SIZE);
+	Point2i tmax((origin_in_cells.x + size_in_cells.x - 1) / TILE_SIZE + 1, (origin_in_cells.y + size_in_cells.y - 1) / TILE_SIZE + 1);
+	clamp_min_max_excluded(tmin, tmax, Point2i(0, 0), _tiles.size());
+
+	for (int ty = tmin.y; ty < tmax.y; ++ty) {
+		for (int tx = tmin.x; tx < tmax.x; ++tx) {
+			Tile *tile = _tiles.get(tx, ty);
+			if (tile)
+				tile->dirty = true;
+		}
+	}
+}
+
+void HeightMapCollider::clear() {
+
+	for (int i = 0; i < _active_tiles.size(); ++i) {
+		free_tile(_active_tiles[i]);
+	}
+	_active_tiles.clear();
+	_tiles.resize(Point2i(0, 0), false);
+	_bounds_dirty = true;
+}
+
+void HeightMapCollider::update(const HeightMapData &data, PhysicsDirectSpaceState &space_state) {
+
+	int res = data.get_resolution();
+	if (res == 0)
+		return;
+
+	Point2i tiles_size((res - 1) / TILE_SIZE, (res - 1) / TILE_SIZE);
+	if (_tiles.size() != tiles_size) {
+		clear();
+		_tiles.resize(tiles_size, false);
+		_tiles.fill(NULL);
+	}
+
+	create_body();
+	find_bodies(data, space_state);
+
+	for (int i = 0; i < _active_tiles.size(); ++i) {
+		Tile *tile = _tiles.get(_active_tiles[i]);
+		tile->used = false;
+		tile->urgent = false;
+	}
+
+	// Create tiles close to bodies, and keep those a bit farther so they don't get recreated all the time
+	for (int i = 0; i < _body_positions.size(); ++i) {
+
+		Vector3 pos = _body_positions[i];
+
+		Point2i cmin(Math::floor((pos.x - _radius) / TILE_SIZE), Math::floor((pos.z - _radius) / TILE_SIZE));
+		Point2i cmax(Math::floor((pos.x + _radius) / TILE_SIZE), Math::floor((pos.z + _radius) / TILE_SIZE));
+		Point2i kmin = cmin - Point2i(1, 1);
+		Point2i kmax = cmax + Point2i(2, 2);
+
+		clamp_min_max_excluded(kmin, kmax, Point2i(0, 0), tiles_size);
+
+		for (int ty = kmin.y; ty < kmax.y; ++ty) {
+			for (int tx = kmin.x; tx < kmax.x; ++tx) {
+
+				Tile *tile = _tiles.get(tx, ty);
+
+				if (tile == NULL) {
+					if (tx < cmin.x || ty < cmin.y || tx > cmax.x || ty > cmax.y)
+						continue;
+					tile = memnew(Tile);
+					_tiles.set(tx, ty, tile);
+					_active_tiles.push_back(Point2i(tx, ty));
+				}
+
+				tile->used = true;
+			}
+		}
+
+		// The body is already there, it would fall through if its tile got built on a later frame
+		Point2i smin(Math::floor((pos.x - SYNC_BUILD_MARGIN) / TILE_SIZE), Math::floor((pos.z - SYNC_BUILD_MARGIN) / TILE_SIZE));
+		Point2i smax(Math::floor((pos.x + SYNC_BUILD_MARGIN) / TILE_SIZE) + 1, Math::floor((pos.z + SYNC_BUILD_MARGIN) / TILE_SIZE) + 1);
+		clamp_min_max_excluded(smin, smax, Point2i(0, 0), tiles_size);
+
+		for (int ty = smin.y; ty < smax.y; ++ty) {
+			for (int tx = smin.x; tx < smax.x; ++tx) {
+				Tile *tile = _tiles.get(tx, ty);
+				if (tile)
+					tile->urgent = true;
+			}
+		}
+	}
+
+	ThreadPool &pool = *ThreadPool::get_singleton();
+
+	for (int i = 0; i < _active_tiles.size();) {
+
+		Point2i tpos = _active_tiles[i];
+		Tile *tile = _tiles.get(tpos);
+
+		if (!tile->used) {
+			free_tile(tpos);
+			_active_tiles.remove(i);
+			continue;
+		}
+
+		if (tile->task && pool.is_done(tile->task)) {
+			finish_task(*tile, tpos);
+		}
+
+		if (tile->urgent && !tile->shape.is_valid()) {
+			build_now(*tile, tpos, data);
+
+		} else if (tile->dirty && tile->task == NULL) {
+			start_task(*tile, tpos, data);
+		}
+
+		++i;
+	}
+}
+
+void HeightMapCollider::find_bodies(const HeightMapData &data, PhysicsDirectSpaceState &space_state) {
+
+	if (_bounds_dirty) {
+		int res = data.get_resolution();
+		_local_bounds = data.get_region_aabb(Point2i(0, 0), Point2i(res, res));
+		_bounds_dirty = false;
+	}
+
+	// Look for bodies over the terrain, with some margin so they get collision before they reach it
+	AABB world_bounds = _transform.xform(_local_bounds.grow(_radius));
+
+	PhysicsServer::get_singleton()->shape_set_data(_query_shape, world_bounds.size * 0.5);
+	Transform query_transform(Basis(), world_bounds.position + world_bounds.size * 0.5);
+
+	// Static props don't need terrain collision, but they would use up results before moving bodies.
+	// So those found before are excluded from the query, as long as they still exist.
+	Set<RID> exclude;
+	exclude.insert(_body);
+
+	for (int i = 0; i < _ignored_bodies.size();) {
+		if (ObjectDB::get_instance(_ignored_bodies[i].instance_id) == NULL) {
+			_ignored_bodies.remove(i);
+			continue;
+		}
+		exclude.insert(_ignored_bodies[i].rid);
+		++i;
+	}
+
+	Transform inverse_transform = _transform.affine_inverse();
+	PhysicsDirectSpaceState::ShapeResult results[MAX_BODIES];
+
+	while (true) {
+
+		int count = space_state.intersect_shape(_query_shape, query_transform, 0, results, MAX_BODIES, exclude);
+		bool found_ignored = false;
+
+		_body_positions.clear();
+
+		for (int i = 0; i < count; ++i) {
+
+			// Only moving bodies need terrain collision
+			Object *obj = results[i].collider;
+			PhysicsBody *body = Object::cast_to<PhysicsBody>(obj);
+
+			if (body == NULL || Object::cast_to<StaticBody>(obj)) {
+				IgnoredBody ignored;
+				ignored.instance_id = results[i].collider_id;
+				ignored.rid = results[i].rid;
+				_ignored_bodies.push_back(ignored);
+				exclude.insert(ignored.rid);
+				found_ignored = true;
+				continue;
+			}
+
+			_body_positions.push_back(inverse_transform.xform(body->get_global_transform().origin));
+		}
+
+		if (count < MAX_BODIES)
+			break;
+
+		// Results were full, query again if some of them can be left out now
+		if (!found_ignored) {
+			if (!_max_bodies_warned) {
+				WARN_PRINT("Too many bodies over the terrain, some of them won't get collision");
+				_max_bodies_warned = true;
+			}
+			break;
+		}
+	}
+}
+
+void HeightMapCollider::start_task(Tile &tile, Point2i tpos, const HeightMapData &data) {
+
+	// The task reads from a snapshot, so the map can keep being edited meanwhile
+	Ref<HeightMapSnapshot> snapshot = data.get_height_snapshot();
+	ERR_FAIL_COND(snapshot.is_null());
+
+	BuildTask *task = memnew(BuildTask);
+	task->snapshot = snapshot;
+	task->origin = tpos * TILE_SIZE;
+
+	tile.task = task;
+	tile.dirty = false;
+
+	ThreadPool::get_singleton()->enqueue(task);
+}
+
+void HeightMapCollider::build_now(Tile &tile, Point2i tpos, const HeightMapData &data) {
+
+	if (tile.task == NULL)
+		start_task(tile, tpos, data);
+	ERR_FAIL_COND(tile.task == NULL);
+
+	// Same task, run here if no thread started it yet
+	ThreadPool &pool = *ThreadPool::get_singleton();
+	if (pool.try_dequeue(tile.task))
+		tile.task->run();
+	else
+		pool.dequeue_or_wait(tile.task);
+
+	finish_task(tile, tpos);
+}
+
+void HeightMapCollider::BuildTask::run() {
+
+	const int sample_count = TILE_SIZE + 1;
+	heights.resize(sample_count * sample_count);
+
+	PoolRealArray::Write w = heights.write();
+	const HeightMapSnapshot &s = **snapshot;
+
+	float m = 0;
+	int i = 0;
+	for (int y = 0; y < sample_count; ++y) {
+		for (int x = 0; x < sample_count; ++x) {
+			float h = s.get_height(origin.x + x, origin.y + y);
+			w[i++] = h;
+			m = MAX(m, Math::abs(h));
+		}
+	}
+
+	max_abs_height = m;
+}
+
+void HeightMapCollider::finish_task(Tile &tile, Point2i tpos) {
+
+	ERR_FAIL_COND(tile.task == NULL);
+	BuildTask *task = tile.task;
+
+	// The shape is centered on its origin, so its height range is made symmetric.
+	// That way it doesn't need a vertical offset, whichever range the physics engine uses.
+	float range = MAX(task->max_abs_height, 1.f);
+
+	Dictionary d;
+	d["width"] = TILE_SIZE + 1;
+	d["depth"] = TILE_SIZE + 1;
+	d["cell_size"] = 1.0;
+	d["heights"] = task->heights;
+	d["min_height"] = -range;
+	d["max_height"] = range;
+
+	PhysicsServer &ps = *PhysicsServer::get_singleton();
+	RID shape = ps.shape_create(PhysicsServer::SHAPE_HEIGHTMAP);
+	ps.shape_set_data(shape, d);
+
+	if (tile.shape_index != -1) {
+		// Only this tile's shape changes, so contacts on the others are left alone
+		ps.body_set_shape(_body, tile.shape_index, shape);
+		ps.free(tile.shape);
+
+	} else {
+		ps.body_add_shape(_body, shape, get_tile_transform(tpos));
+		tile.shape_index = _shape_tiles.size();
+		_shape_tiles.push_back(tpos);
+	}
+
+	tile.shape = shape;
+
+	memdelete(task);
+	tile.task = NULL;
+}
+
+void HeightMapCollider::free_tile(Point2i tpos) {
+
+	Tile *tile = _tiles.get(tpos);
+	ERR_FAIL_COND(tile == NULL);
+
+	if (tile->task) {
+		ThreadPool::get_singleton()->dequeue_or_wait(tile->task);
+		memdelete(tile->task);
+	}
+
+	if (tile->shape_index != -1)
+		remove_body_shape(tile->shape_index);
+
+	if (tile->shape.is_valid())
+		PhysicsServer::get_singleton()->free(tile->shape);
+
+	memdelete(tile);
+	_tiles.set(tpos, NULL);
+}
+
+// Heightfields are centered on their origin
+Transform HeightMapCollider::get_tile_transform(Point2i tpos) {
+	Vector3 center(tpos.x * TILE_SIZE + TILE_SIZE / 2, 0, tpos.y * TILE_SIZE + TILE_SIZE / 2);
+	return Transform(Basis(), center);
+}
+
+// Removing a shape shifts the indices of those after it, so the last one takes its place instead
+void HeightMapCollider::remove_body_shape(int index) {
+
+	ERR_FAIL_INDEX(index, _shape_tiles.size());
+	PhysicsServer &ps = *PhysicsServer::get_singleton();
+
+	int last = _shape_tiles.size() - 1;
+
+	if (index != last) {
+		Point2i last_tpos = _shape_tiles[last];
+		Tile *last_tile = _tiles.get(last_tpos);
+		ERR_FAIL_COND(last_tile == NULL);
+
+		ps.body_set_shape(_body, index, last_tile->shape);
+		ps.body_set_shape_transform(_body, index, get_tile_transform(last_tpos));
+		last_tile->shape_index = index;
+		_shape_tiles[index] = last_tpos;
+	}
+
+	ps.body_remove_shape(_body, last);
+	_shape_tiles.resize(last);
+}
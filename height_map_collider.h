@@ -0,0 +1,104 @@
+#ifndef HEIGHT_MAP_COLLIDER_H
+#define HEIGHT_MAP_COLLIDER_H
+
+#include <core/math/transform.h>
+#include <servers/physics_server.h>
+
+#include "height_map_data.h"
+#include "thread_pool.h"
+
+// Static physics body made of heightfield tiles.
+// Tiles only exist around bodies moving over the terrain,
+// so the cost depends on how many of them there are rather than the size of the map.
+// Note: heightfields can't have holes, so the mask is ignored.
+class HeightMapCollider {
+public:
+	// Size of a tile in cells
+	enum { TILE_SIZE = 64 };
+
+	HeightMapCollider();
+	~HeightMapCollider();
+
+	// Object physics queries will report as the collider
+	void set_instance_id(ObjectID id);
+	void set_space(RID space);
+	void set_transform(const Transform &transform);
+
+	// Tiles are created within this horizontal distance from bodies, in cells
+	void set_radius(float radius);
+	float get_radius() const { return _radius; }
+
+	void set_area_dirty(Point2i origin_in_cells, Point2i size_in_cells);
+
+	// Call this every physics frame.
+	void update(const HeightMapData &data, PhysicsDirectSpaceState &space_state);
+
+	// Removes all tiles, needed when the map is resized
+	void clear();
+
+private:
+	class BuildTask : public ThreadPool::Task {
+	public:
+		// Input
+		Ref<HeightMapSnapshot> snapshot;
+		Point2i origin;
+
+		// Output
+		PoolRealArray heights;
+		float max_abs_height;
+
+		BuildTask() : max_abs_height(0) {}
+		void run();
+	};
+
+	// Found over the terrain but not needing collision, like static props
+	struct IgnoredBody {
+		ObjectID instance_id;
+		RID rid;
+	};
+
+	struct Tile {
+		RID shape;
+		BuildTask *task;
+		bool dirty;
+		bool used;
+		// A body is in it, so it can't wait for its shape
+		bool urgent;
+		// Where the shape is in the body, -1 if it has none yet
+		int shape_index;
+
+		Tile() : task(NULL), dirty(true), used(false), urgent(false), shape_index(-1) {}
+	};
+
+	void create_body();
+	void find_bodies(const HeightMapData &data, PhysicsDirectSpaceState &space_state);
+	void start_task(Tile &tile, Point2i tpos, const HeightMapData &data);
+	void build_now(Tile &tile, Point2i tpos, const HeightMapData &data);
+	void finish_task(Tile &tile, Point2i tpos);
+	void free_tile(Point2i tpos);
+	void remove_body_shape(int index);
+	static Transform get_tile_transform(Point2i tpos);
+
+private:
+	RID _body;
+	RID _query_shape;
+	ObjectID _instance_id;
+	RID _space;
+	Transform _transform;
+	float _radius;
+
+	// Cached bounds of the terrain, used to look for bodies
+	AABB _local_bounds;
+	bool _bounds_dirty;
+
+	Grid2D<Tile *> _tiles;
+	Vector<Point2i> _active_tiles;
+	Vector<Vector3> _body_positions;
+	Vector<IgnoredBody> _ignored_bodies;
+	// So the warning isn't printed every frame
+	bool _max_bodies_warned;
+	// Tile of each shape of the body
+	Vector<Point2i> _shape_tiles;
+};
+
+#endif // HEIGHT_MAP_COLLIDER_H
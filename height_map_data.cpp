@@ -3,6 +3,9 @@
 #include <core/os/file_access.h>
 
 #include "height_map.h"
+#include "height_map_undo.h"
+#include "resampler.h"
+#include "thread_pool.h"
 #include "utility.h"
 
 #define DEFAULT_RESOLUTION 256
@@ -18,6 +21,157 @@ const char *HEIGHTMAP_MAGIC_V1 = "GDHM";
 //const char *HEIGHTMAP_SUB_V1 = "v1__";
 const char *HEIGHTMAP_SUB_V = "v3__";
 
+// Rows processed per task when updating normals, bounds and mips
+#define NORMALS_MIN_BATCH_SIZE 16
+#define VERTICAL_BOUNDS_MIN_BATCH_SIZE 4
+#define MIPS_MIN_BATCH_SIZE 16
+
+namespace {
+
+// Reads the map as if it was the level before LOD 1
+struct HeightMipSourceImage {
+	const ImageRawView<uint16_t> &heights;
+
+	HeightMipSourceImage(const ImageRawView<uint16_t> &h) :
+			heights(h) {}
+
+	inline void get(int x, int y, float &out_average, float &out_min, float &out_max) const {
+		x = CLAMP(x, 0, heights.get_width() - 1);
+		y = CLAMP(y, 0, heights.get_height() - 1);
+		out_average = out_min = out_max = decode_height(heights.row(y)[x]);
+	}
+};
+
+struct HeightMipSourceGrid {
+	const Grid2D<HeightMapData::HeightMipSample> &grid;
+
+	HeightMipSourceGrid(const Grid2D<HeightMapData::HeightMipSample> &g) :
+			grid(g) {}
+
+	inline void get(int x, int y, float &out_average, float &out_min, float &out_max) const {
+		HeightMapData::HeightMipSample s = grid.get_clamped(x, y);
+		out_average = decode_height(s.average);
+		out_min = decode_height(s.min);
+		out_max = decode_height(s.max);
+	}
+};
+
+// A sample is the 3x3 tent filter of the previous level around the same position,
+// and the min and max of those 9 samples, so neighbour samples overlap and bilinear lookups stay within bounds.
+// Rows of samples are independent, so they get split across threads.
+template <typename Source_T>
+struct DownsampleHeightMipAction {
+	const Source_T &src;
+	HeightMapData::HeightMipSample *dst;
+	int dst_width;
+	Point2i min;
+	Point2i max;
+
+	DownsampleHeightMipAction(const Source_T &p_src, Grid2D<HeightMapData::HeightMipSample> &p_dst) :
+			src(p_src), dst(p_dst.raw_write()), dst_width(p_dst.size().x) {}
+
+	void operator()(int begin, int end) {
+
+		static const float weights[3] = { 0.25f, 0.5f, 0.25f };
+
+		for (int y = min.y + begin; y < min.y + end; ++y) {
+			for (int x = min.x; x < max.x; ++x) {
+
+				float average, hmin, hmax;
+				src.get(2 * x, 2 * y, average, hmin, hmax);
+				average = 0;
+
+				for (int j = 0; j < 3; ++j) {
+					for (int i = 0; i < 3; ++i) {
+
+						float a, lo, hi;
+						src.get(2 * x + i - 1, 2 * y + j - 1, a, lo, hi);
+
+						average += a * weights[i] * weights[j];
+						hmin = MIN(hmin, lo);
+						hmax = MAX(hmax, hi);
+					}
+				}
+
+				HeightMapData::HeightMipSample &s = dst[y * dst_width + x];
+				s.average = encode_height(average);
+				s.min = encode_height(hmin);
+				s.max = encode_height(hmax);
+			}
+		}
+	}
+};
+
+template <typename Source_T>
+void downsample_height_mip(const Source_T &src, Grid2D<HeightMapData::HeightMipSample> &dst, Point2i min, Point2i max) {
+
+	if (min.x >= max.x || min.y >= max.y)
+		return;
+
+	DownsampleHeightMipAction<Source_T> action(src, dst);
+	action.min = min;
+	action.max = max;
+
+	ThreadPool::get_singleton()->parallel_for(max.y - min.y, action, MIPS_MIN_BATCH_SIZE);
+}
+
+// Normals and derived layers all come from the same neighbours of each cell, so they are computed in one pass.
+// Rows are independent, so they get split across threads.
+struct UpdateNormalsAction {
+	const ImageRawView<uint16_t> &heights;
+	const ImageRawWrite<uint8_t> &normals;
+	const ImageRawWrite<float> *slopes;
+	const ImageRawWrite<float> *curvatures;
+	Point2i min;
+	Point2i max;
+
+	UpdateNormalsAction(const ImageRawView<uint16_t> &h, const ImageRawWrite<uint8_t> &n) :
+			heights(h), normals(n), slopes(NULL), curvatures(NULL) {}
+
+	void operator()(int begin, int end) {
+
+		const int w = heights.get_width();
+		const int h = heights.get_height();
+
+		for (int y = min.y + begin; y < min.y + end; ++y) {
+
+			// Neighbours are clamped to the edges of the map
+			const uint16_t *row_back = heights.row(MAX(y - 1, 0));
+			const uint16_t *row = heights.row(y);
+			const uint16_t *row_fore = heights.row(MIN(y + 1, h - 1));
+
+			uint8_t *normals_row = normals.row(y);
+			float *slopes_row = slopes ? slopes->row(y) : NULL;
+			float *curvatures_row = curvatures ? curvatures->row(y) : NULL;
+
+			for (int x = min.x; x < max.x; ++x) {
+
+				float center = decode_height(row[x]);
+				float left = decode_height(row[MAX(x - 1, 0)]);
+				float right = decode_height(row[MIN(x + 1, w - 1)]);
+				float fore = decode_height(row_fore[x]);
+				float back = decode_height(row_back[x]);
+
+				Vector3 n = Vector3(left - right, 2.0, back - fore).normalized();
+
+				// Same conversion as Image::set_pixel would do with HeightMapData::encode_normal
+				uint8_t *p = normals_row + x * 3;
+				p[0] = CLAMP(0.5 * (n.x + 1.0) * 255.0, 0, 255);
+				p[1] = CLAMP(0.5 * (n.y + 1.0) * 255.0, 0, 255);
+				p[2] = CLAMP(0.5 * (n.z + 1.0) * 255.0, 0, 255);
+
+				if (slopes_row)
+					slopes_row[x] = Math::acos(CLAMP(n.y, -1.f, 1.f));
+
+				if (curvatures_row)
+					curvatures_row[x] = left + right + fore + back - 4.f * center;
+			}
+		}
+	}
+};
+
+} // namespace
+
 
 // Important note about heightmap resolution:
 //
@@ -44,12 +198,18 @@ const char *HEIGHTMAP_SUB_V = "v3__";
 HeightMapData::HeightMapData() {
 
 	_resolution = 0;
+	_height_snapshot_mutex = Mutex::create();
 
 	//#ifdef TOOLS_ENABLED
 	_disable_apply_undo = false;
 	//#endif
 }
 
+HeightMapData::~HeightMapData() {
+	_height_snapshot.unref();
+	memdelete(_height_snapshot_mutex);
+}
+
 void HeightMapData::load_default() {
 
 	set_resolution(DEFAULT_RESOLUTION);
@@ -60,13 +220,18 @@ int HeightMapData::get_resolution() const {
 	return _resolution;
 }
 
-void HeightMapData::set_resolution(int p_res) {
+void HeightMapData::set_resolution(int p_res, bool keep_heights) {
 
 	if (p_res == get_resolution())
 		return;
 
-	if (p_res < HeightMap::CHUNK_SIZE)
-		p_res = HeightMap::CHUNK_SIZE;
+	// The map must be able to hold at least one chunk, whatever the chunk size is,
+	// so since chunk size became a property, maps can't be smaller than 65x65 (they used to go down to 17x17).
+	// Maps saved smaller still load as they are, this only applies when the resolution is changed.
+	if (p_res < HeightMap::MAX_CHUNK_SIZE) {
+		print_line(String("Heightmap resolution {0} is below the minimum, using {1}").format(varray(p_res, HeightMap::MAX_CHUNK_SIZE + 1)));
+		p_res = HeightMap::MAX_CHUNK_SIZE;
+	}
 
 	// Power of two is important for LOD.
 	// Also, grid data is off by one,
@@ -77,11 +242,13 @@ void HeightMapData::set_resolution(int p_res) {
 	_resolution = p_res;
 
 	// Resize heights
-	if (_images[CHANNEL_HEIGHT].is_null()) {
-		_images[CHANNEL_HEIGHT].instance();
+	if (_images[CHANNEL_HEIGHT].is_null() || !keep_heights) {
+		if (_images[CHANNEL_HEIGHT].is_null())
+			_images[CHANNEL_HEIGHT].instance();
 		_images[CHANNEL_HEIGHT]->create(_resolution, _resolution, false, get_channel_format(CHANNEL_HEIGHT));
 	} else {
-		_images[CHANNEL_HEIGHT]->resize(_resolution, _resolution);
+		// Image::resize would interpolate half floats as pairs of bytes
+		resample_image(**_images[CHANNEL_HEIGHT], Point2i(_resolution, _resolution), RESAMPLE_BICUBIC);
 	}
 
 	// Resize normals
@@ -89,6 +256,7 @@ void HeightMapData::set_resolution(int p_res) {
 		_images[CHANNEL_NORMAL].instance();
 	}
 	_images[CHANNEL_NORMAL]->create(_resolution, _resolution, false, get_channel_format(CHANNEL_NORMAL));
+	resize_derived_layers();
 	update_all_normals();
 
 	// Resize colors
@@ -97,7 +265,7 @@ void HeightMapData::set_resolution(int p_res) {
 		_images[CHANNEL_COLOR]->create(_resolution, _resolution, false, get_channel_format(CHANNEL_COLOR));
 		_images[CHANNEL_COLOR]->fill(Color(1, 1, 1));
 	} else {
-		_images[CHANNEL_COLOR]->resize(_resolution, _resolution);
+		resample_image(**_images[CHANNEL_COLOR], Point2i(_resolution, _resolution), RESAMPLE_BILINEAR);
 	}
 
 	// Resize splats
@@ -120,7 +288,8 @@ void HeightMapData::set_resolution(int p_res) {
 		}
 
 	} else {
-		_images[CHANNEL_SPLAT]->resize(_resolution, _resolution);
+		// Splats hold texture indices, which can't be blended
+		resample_image(**_images[CHANNEL_SPLAT], Point2i(_resolution, _resolution), RESAMPLE_NEAREST);
 	}
 
 	// Resize mask
@@ -129,25 +298,23 @@ void HeightMapData::set_resolution(int p_res) {
 		_images[CHANNEL_MASK].instance();
 		_images[CHANNEL_MASK]->create(_resolution, _resolution, false, get_channel_format(CHANNEL_MASK));
 
-		Image &im = **_images[CHANNEL_MASK];
-		PoolVector<uint8_t> data = im.get_data();
-		PoolVector<uint8_t>::Write w = data.write();
-
-		int len = data.size();
-		ERR_FAIL_COND(len != im.get_width() * im.get_height());
-
-		// Initialize mask so the terrain has no holes by default
-		memset(w.ptr(), 255, len);
+		// Note: the image is created filled with zeroes, which means the terrain has no holes by default
 
 	} else {
-		_images[CHANNEL_SPLAT]->resize(_resolution, _resolution);
+		resample_image(**_images[CHANNEL_MASK], Point2i(_resolution, _resolution), RESAMPLE_NEAREST);
 	}
 
-	Point2i csize = Point2i(p_res, p_res) / HeightMap::CHUNK_SIZE;
+	Point2i csize = Point2i(p_res, p_res) / VERTICAL_BOUNDS_CHUNK_SIZE;
 	// TODO Could set `preserve_data` to true, but would require callback to construct new cells
 	_chunked_vertical_bounds.resize(csize, false);
 	update_vertical_bounds();
 
+	_chunked_mask_states.resize(csize, false);
+	update_mask_states();
+
+	update_height_mips();
+	update_height_snapshot();
+
 	emit_signal(SIGNAL_RESOLUTION_CHANGED);
 }
 
@@ -166,11 +333,21 @@ inline Color get_clamped(const Image &im, int x, int y) {
 	return im.get_pixel(x, y);
 }
 
-real_t HeightMapData::get_height_at(int x, int y) {
+real_t HeightMapData::get_height_at(int x, int y, int lod) {
 	// This function is relatively slow due to locking, so don't use it to fetch large areas
 
 	// Height data must be loaded in RAM
 	ERR_FAIL_COND_V(_images[CHANNEL_HEIGHT].is_null(), 0.0);
+	ERR_FAIL_COND_V(lod < 0, 0.0);
+
+	lod = MIN(lod, _height_mips.size());
+
+	if (lod > 0) {
+		// Nearest sample
+		int half = 1 << (lod - 1);
+		HeightMipSample s = get_height_mip(lod).get_clamped((x + half) >> lod, (y + half) >> lod);
+		return decode_height(s.average);
+	}
 
 	Image &im = **_images[CHANNEL_HEIGHT];
 	im.lock();
@@ -179,31 +356,85 @@ real_t HeightMapData::get_height_at(int x, int y) {
 	return h;
 }
 
-real_t HeightMapData::get_interpolated_height_at(Vector3 pos) {
-	// This function is relatively slow due to locking, so don't use it to fetch large areas
+real_t HeightMapData::get_interpolated_height_at(Vector3 pos, int lod) {
 
 	// Height data must be loaded in RAM
 	ERR_FAIL_COND_V(_images[CHANNEL_HEIGHT].is_null(), 0.0);
+	ERR_FAIL_COND_V(lod < 0, 0.0);
 
-	// The function takes a Vector3 for convenience so it's easier to use in 3D scripting
-	int x0 = pos.x;
-	int y0 = pos.z;
+	lod = MIN(lod, _height_mips.size());
 
-	real_t xf = pos.x - x0;
-	real_t yf = pos.z - y0;
+	if (lod > 0) {
+		const Grid2D<HeightMipSample> &mip = get_height_mip(lod);
 
-	Image &im = **_images[CHANNEL_HEIGHT];
-	im.lock();
-	real_t h00 = get_clamped(im, x0, y0).r;
-	real_t h10 = get_clamped(im, x0 + 1, y0).r;
-	real_t h01 = get_clamped(im, x0, y0 + 1).r;
-	real_t h11 = get_clamped(im, x0 + 1, y0 + 1).r;
-	im.unlock();
+		float x = pos.x / (1 << lod);
+		float y = pos.z / (1 << lod);
 
-	// Bilinear filter
-	real_t h = Math::lerp(Math::lerp(h00, h10, xf), Math::lerp(h01, h11, xf), yf);
+		int x0 = CLAMP(static_cast<int>(Math::floor(x)), 0, mip.size().x - 2);
+		int y0 = CLAMP(static_cast<int>(Math::floor(y)), 0, mip.size().y - 2);
 
-	return h;
+		float xf = CLAMP(x - x0, 0.f, 1.f);
+		float yf = CLAMP(y - y0, 0.f, 1.f);
+
+		float h00 = decode_height(mip.get(x0, y0).average);
+		float h10 = decode_height(mip.get(x0 + 1, y0).average);
+		float h01 = decode_height(mip.get(x0, y0 + 1).average);
+		float h11 = decode_height(mip.get(x0 + 1, y0 + 1).average);
+
+		return Math::lerp(Math::lerp(h00, h10, xf), Math::lerp(h01, h11, xf), yf);
+	}
+
+	// The function takes a Vector3 for convenience so it's easier to use in 3D scripting.
+	// Raw access doesn't lock, but to fetch many positions HeightMap::sample_batch is faster.
+	ImageRawView<uint16_t> heights(**_images[CHANNEL_HEIGHT]);
+	return sample_height_bilinear(heights, pos.x, pos.z);
+}
+
+Vector2 HeightMapData::get_height_range_at(int x, int y, int lod) {
+
+	ERR_FAIL_COND_V(_images[CHANNEL_HEIGHT].is_null(), Vector2());
+	ERR_FAIL_COND_V(lod < 0, Vector2());
+
+	lod = MIN(lod, _height_mips.size());
+
+	if (lod == 0) {
+		real_t h = get_height_at(x, y);
+		return Vector2(h, h);
+	}
+
+	int half = 1 << (lod - 1);
+	HeightMipSample s = get_height_mip(lod).get_clamped((x + half) >> lod, (y + half) >> lod);
+	return Vector2(decode_height(s.min), decode_height(s.max));
+}
+
+Ref<Image> HeightMapData::get_height_mip_image(int lod) const {
+
+	ERR_FAIL_COND_V(_images[CHANNEL_HEIGHT].is_null(), Ref<Image>());
+	ERR_FAIL_COND_V(lod < 0 || lod >= get_height_mip_count(), Ref<Image>());
+
+	if (lod == 0) {
+		Ref<Image> copy;
+		copy.instance();
+		copy->copy_internals_from(_images[CHANNEL_HEIGHT]);
+		return copy;
+	}
+
+	const Grid2D<HeightMipSample> &mip = get_height_mip(lod);
+
+	PoolByteArray data;
+	data.resize(mip.area() * sizeof(uint16_t));
+	{
+		PoolByteArray::Write w = data.write();
+		uint16_t *dst = (uint16_t *)w.ptr();
+		for (int i = 0; i < mip.area(); ++i) {
+			dst[i] = mip[i].average;
+		}
+	}
+
+	Ref<Image> image;
+	image.instance();
+	image->create(mip.size().x, mip.size().y, false, get_channel_format(CHANNEL_HEIGHT), data);
+	return image;
 }
 
 void HeightMapData::update_all_normals() {
@@ -215,33 +446,92 @@ void HeightMapData::update_normals(Point2i min, Point2i size) {
 	ERR_FAIL_COND(_images[CHANNEL_HEIGHT].is_null());
 	ERR_FAIL_COND(_images[CHANNEL_NORMAL].is_null());
 
-	Image &heights = **_images[CHANNEL_HEIGHT];
-	Image &normals = **_images[CHANNEL_NORMAL];
-
 	Point2i max = min + size;
-	Point2i pos;
+	clamp_min_max_excluded(min, max, Point2i(0, 0), Point2i(_resolution, _resolution));
 
-	clamp_min_max_excluded(min, max, Point2i(0, 0), Point2i(heights.get_width(), heights.get_height()));
+	if (min.x >= max.x || min.y >= max.y)
+		return;
+
+	// Raw views don't lock images, so they can be used from worker threads
+	ImageRawView<uint16_t> heights(**_images[CHANNEL_HEIGHT]);
+	ImageRawWrite<uint8_t> normals(**_images[CHANNEL_NORMAL]);
+	ERR_FAIL_COND(normals.get_size() != heights.get_size());
 
-	heights.lock();
-	normals.lock();
+	UpdateNormalsAction action(heights, normals);
+	action.min = min;
+	action.max = max;
 
-	for (pos.y = min.y; pos.y < max.y; ++pos.y) {
-		for (pos.x = min.x; pos.x < max.x; ++pos.x) {
+	ImageRawWrite<float> *derived_views[DERIVED_COUNT] = { NULL };
+	for (int i = 0; i < DERIVED_COUNT; ++i) {
+		if (_derived_images[i].is_valid()) {
+			derived_views[i] = memnew(ImageRawWrite<float>(**_derived_images[i]));
+		}
+	}
 
-			float left = get_clamped(heights, pos.x - 1, pos.y).r;
-			float right = get_clamped(heights, pos.x + 1, pos.y).r;
-			float fore = get_clamped(heights, pos.x, pos.y + 1).r;
-			float back = get_clamped(heights, pos.x, pos.y - 1).r;
+	action.slopes = derived_views[DERIVED_SLOPE];
+	action.curvatures = derived_views[DERIVED_CURVATURE];
 
-			Vector3 n = Vector3(left - right, 2.0, back - fore).normalized();
+	ThreadPool::get_singleton()->parallel_for(max.y - min.y, action, NORMALS_MIN_BATCH_SIZE);
 
-			normals.set_pixel(pos.x, pos.y, encode_normal(n));
-		}
+	for (int i = 0; i < DERIVED_COUNT; ++i) {
+		if (derived_views[i])
+			memdelete(derived_views[i]);
 	}
+}
+
+void HeightMapData::set_derived_layer_enabled(DerivedLayer layer, bool enabled) {
+
+	ERR_FAIL_INDEX(layer, DERIVED_COUNT);
+
+	if (enabled == _derived_images[layer].is_valid())
+		return;
 
-	heights.unlock();
-	normals.unlock();
+	if (!enabled) {
+		_derived_images[layer].unref();
+		return;
+	}
+
+	_derived_images[layer].instance();
+	resize_derived_layers();
+	// Normals come out the same, they are just computed in the same pass
+	update_all_normals();
+}
+
+bool HeightMapData::is_derived_layer_enabled(DerivedLayer layer) const {
+	ERR_FAIL_INDEX_V(layer, DERIVED_COUNT, false);
+	return _derived_images[layer].is_valid();
+}
+
+Ref<Image> HeightMapData::get_derived_image(DerivedLayer layer) const {
+	ERR_FAIL_INDEX_V(layer, DERIVED_COUNT, Ref<Image>());
+	return _derived_images[layer];
+}
+
+real_t HeightMapData::get_derived_value_at(DerivedLayer layer, Vector3 pos) const {
+
+	ERR_FAIL_INDEX_V(layer, DERIVED_COUNT, 0);
+	ERR_FAIL_COND_V(_derived_images[layer].is_null(), 0);
+
+	ImageRawView<float> values(**_derived_images[layer]);
+
+	int x0 = CLAMP(static_cast<int>(Math::floor(pos.x)), 0, values.get_width() - 2);
+	int y0 = CLAMP(static_cast<int>(Math::floor(pos.z)), 0, values.get_height() - 2);
+
+	float xf = CLAMP(pos.x - x0, 0.f, 1.f);
+	float yf = CLAMP(pos.z - y0, 0.f, 1.f);
+
+	const float *row0 = values.row(y0) + x0;
+	const float *row1 = row0 + values.get_pitch();
+
+	return Math::lerp(Math::lerp(row0[0], row0[1], xf), Math::lerp(row1[0], row1[1], xf), yf);
+}
+
+void HeightMapData::resize_derived_layers() {
+	for (int i = 0; i < DERIVED_COUNT; ++i) {
+		if (_derived_images[i].is_valid()) {
+			_derived_images[i]->create(_resolution, _resolution, false, Image::FORMAT_RF);
+		}
+	}
 }
 
 void HeightMapData::notify_region_change(Point2i min, Point2i max, HeightMapData::Channel channel) {
@@ -253,15 +543,21 @@ void HeightMapData::notify_region_change(Point2i min, Point2i max, HeightMapData
 			// for better user experience, we could set chunks AABBs to a very large height just while drawing,
 			// and set correct AABBs as a background task once done
 			update_vertical_bounds(min, max - min);
+			update_height_mips(min, max);
+			update_height_snapshot(min, max);
 
 			upload_region(channel, min, max);
 			upload_region(CHANNEL_NORMAL, min, max);
 			break;
 
+		case CHANNEL_MASK:
+			update_mask_states(min, max - min);
+			upload_region(channel, min, max);
+			break;
+
 		case CHANNEL_NORMAL:
 		case CHANNEL_SPLAT:
 		case CHANNEL_COLOR:
-		case CHANNEL_MASK:
 			upload_region(channel, min, max);
 			break;
 
@@ -282,69 +578,116 @@ void HeightMapData::_apply_undo(Dictionary undo_data) {
 	if (_disable_apply_undo)
 		return;
 
-	Array chunk_positions = undo_data["chunk_positions"];
-	Array chunk_datas = undo_data["data"];
-	int channel = undo_data["channel"];
+	Vector<Point2i> chunk_positions;
+	Vector<Ref<Image> > chunk_datas;
+	int channel;
+	int chunk_size;
 
-	// Validate input
+	if (undo_data.has("step")) {
 
-	ERR_FAIL_COND(channel < 0 || channel >= CHANNEL_COUNT);
-	ERR_FAIL_COND(chunk_positions.size() / 2 != chunk_datas.size());
+		// Chunks are decoded on demand from the undo store
+		Ref<HeightMapUndoStep> step = undo_data["step"];
+		ERR_FAIL_COND(step.is_null());
+		bool redo = undo_data.has("redo") ? (bool)undo_data["redo"] : false;
+
+		if (!step->get_chunk_images(redo, chunk_datas))
+			return;
 
-	ERR_FAIL_COND(chunk_positions.size() % 2 != 0);
-	for (int i = 0; i < chunk_positions.size(); ++i) {
-		Variant p = chunk_positions[i];
-		ERR_FAIL_COND(p.get_type() != Variant::INT);
+		chunk_positions = step->get_chunk_positions();
+		channel = step->get_channel();
+		chunk_size = step->get_chunk_size();
+
+	} else {
+
+		Array positions = undo_data["chunk_positions"];
+		Array datas = undo_data["data"];
+		channel = undo_data["channel"];
+		// Undo chunks follow the chunk size of the terrain that was edited
+		chunk_size = undo_data.has("chunk_size") ? (int)undo_data["chunk_size"] : (int)HeightMap::DEFAULT_CHUNK_SIZE;
+
+		ERR_FAIL_COND(positions.size() / 2 != datas.size());
+		ERR_FAIL_COND(positions.size() % 2 != 0);
+
+		for (int i = 0; i < positions.size(); ++i) {
+			Variant p = positions[i];
+			ERR_FAIL_COND(p.get_type() != Variant::INT);
+		}
+		for (int i = 0; i < datas.size(); ++i) {
+			Variant d = datas[i];
+			ERR_FAIL_COND(d.get_type() != Variant::OBJECT);
+		}
+
+		for (int i = 0; i < datas.size(); ++i) {
+			chunk_positions.push_back(Point2i((int)positions[2 * i], (int)positions[2 * i + 1]));
+			chunk_datas.push_back(Ref<Image>(datas[i]));
+		}
 	}
-	for (int i = 0; i < chunk_datas.size(); ++i) {
-		Variant d = chunk_datas[i];
-		ERR_FAIL_COND(d.get_type() != Variant::OBJECT);
+
+	ERR_FAIL_COND(channel < 0 || channel >= CHANNEL_COUNT);
+	ERR_FAIL_COND(chunk_size <= 0);
+	ERR_FAIL_COND(chunk_positions.size() != chunk_datas.size());
+
+	if (channel == CHANNEL_NORMAL) {
+		print_line("This is a calculated channel!, no undo on this one");
+		return;
 	}
 
-	// Apply
+	ERR_FAIL_COND(_images[channel].is_null());
+
+	if (chunk_datas.size() == 0)
+		return;
+
+	// All chunks are copied first, then the area they cover gets updated only once,
+	// instead of recomputing normals and bounds, uploading textures and emitting a signal for each of them.
 
-	for (int i = 0; i < chunk_datas.size(); ++i) {
-		Point2i cpos;
-		cpos.x = chunk_positions[2 * i];
-		cpos.y = chunk_positions[2 * i + 1];
+	Image &im = **_images[channel];
+	Point2i min(im.get_width(), im.get_height());
+	Point2i max(0, 0);
 
-		Point2i min = cpos * HeightMap::CHUNK_SIZE;
-		Point2i max = min + Point2i(1, 1) * HeightMap::CHUNK_SIZE;
+	{
+		int pixel_size = Image::get_format_pixel_size(im.get_format());
+		Image::Format format = im.get_format();
+		ImageRawWrite<uint8_t> pixels(im);
 
-		Ref<Image> data = chunk_datas[i];
-		ERR_FAIL_COND(data.is_null());
+		for (int i = 0; i < chunk_datas.size(); ++i) {
 
-		Rect2 data_rect(0, 0, data->get_width(), data->get_height());
+			Ref<Image> data = chunk_datas[i];
+			ERR_FAIL_COND(data.is_null());
+			ERR_FAIL_COND(data->get_format() != format);
 
-		switch (channel) {
+			Point2i cmin = chunk_positions[i] * chunk_size;
+			Point2i cmax = cmin + Point2i(data->get_width(), data->get_height());
+			clamp_min_max_excluded(cmin, cmax, Point2i(0, 0), pixels.get_size());
 
-			case CHANNEL_HEIGHT:
-				ERR_FAIL_COND(_images[channel].is_null())
-				_images[channel]->blit_rect(data, data_rect, min);
-				// Padding is needed because normals are calculated using neighboring,
-				// so a change in height X also requires normals in X-1 and X+1 to be updated
-				update_normals(min - Point2i(1, 1), max + Point2i(1, 1));
-				break;
+			if (cmin.x >= cmax.x || cmin.y >= cmax.y)
+				continue;
 
-			case CHANNEL_SPLAT:
-			case CHANNEL_COLOR:
-			case CHANNEL_MASK:
-				ERR_FAIL_COND(_images[channel].is_null())
-				_images[channel]->blit_rect(data, data_rect, min);
-				break;
+			min.x = MIN(min.x, cmin.x);
+			min.y = MIN(min.y, cmin.y);
+			max.x = MAX(max.x, cmax.x);
+			max.y = MAX(max.y, cmax.y);
 
-			case CHANNEL_NORMAL:
-				print_line("This is a calculated channel!, no undo on this one");
-				break;
+			ImageRawView<uint8_t> src(**data);
+			Point2i src_offset = cmin - chunk_positions[i] * chunk_size;
+			int row_bytes = (cmax.x - cmin.x) * pixel_size;
 
-			default:
-				print_line("Wut? Unsupported undo channel");
-				break;
+			for (int y = cmin.y; y < cmax.y; ++y) {
+				const uint8_t *src_row = src.row(y - cmin.y + src_offset.y) + src_offset.x * pixel_size;
+				copymem(pixels.row(y) + cmin.x * pixel_size, src_row, row_bytes);
+			}
 		}
+	}
 
-		// TODO This one might be very slow even with partial texture update, due to rebinding...?
-		notify_region_change(min, max, (Channel)channel);
+	if (max.x <= min.x || max.y <= min.y)
+		return;
+
+	if (channel == CHANNEL_HEIGHT) {
+		// Padding is needed because normals are calculated using neighboring,
+		// so a change in height X also requires normals in X-1 and X+1 to be updated
+		update_normals(min - Point2i(1, 1), max - min + Point2i(2, 2));
 	}
+
+	notify_region_change(min, max, (Channel)channel);
 }
 
 //#endif
@@ -402,16 +745,18 @@ Ref<Texture> HeightMapData::get_texture(Channel channel) {
 	return _textures[channel];
 }
 
-AABB HeightMapData::get_region_aabb(Point2i origin_in_cells, Point2i size_in_cells) {
+AABB HeightMapData::get_region_aabb(Point2i origin_in_cells, Point2i size_in_cells) const {
 
 	// Get info from cached vertical bounds,
 	// which is a lot faster than directly fetching heights from the map.
 	// It's not 100% accurate, but enough for culling use case if chunk size is decently chosen.
 
-	Point2i cmin = origin_in_cells / HeightMap::CHUNK_SIZE;
-	Point2i cmax = (origin_in_cells + size_in_cells - Point2i(1, 1)) / HeightMap::CHUNK_SIZE + Point2i(1, 1);
+	Point2i cmin = origin_in_cells / VERTICAL_BOUNDS_CHUNK_SIZE;
+	Point2i cmax = (origin_in_cells + size_in_cells - Point2i(1, 1)) / VERTICAL_BOUNDS_CHUNK_SIZE + Point2i(1, 1);
 
-	float min_height = _chunked_vertical_bounds[0].min;
+	_chunked_vertical_bounds.clamp_min_max_excluded(cmin, cmax);
+
+	float min_height = _chunked_vertical_bounds.get(cmin.x, cmin.y).min;
 	float max_height = min_height;
 
 	for (int y = cmin.y; y < cmax.y; ++y) {
@@ -434,57 +779,182 @@ AABB HeightMapData::get_region_aabb(Point2i origin_in_cells, Point2i size_in_cel
 	return aabb;
 }
 
+HeightMapData::MaskState HeightMapData::get_region_mask_state(Point2i origin_in_cells, Point2i size_in_cells) const {
+
+	Point2i cmin = origin_in_cells / VERTICAL_BOUNDS_CHUNK_SIZE;
+	Point2i cmax = (origin_in_cells + size_in_cells - Point2i(1, 1)) / VERTICAL_BOUNDS_CHUNK_SIZE + Point2i(1, 1);
+
+	_chunked_mask_states.clamp_min_max_excluded(cmin, cmax);
+
+	MaskState state = (MaskState)_chunked_mask_states.get(cmin.x, cmin.y);
+
+	for (int y = cmin.y; y < cmax.y; ++y) {
+		for (int x = cmin.x; x < cmax.x; ++x) {
+
+			if (_chunked_mask_states.get(x, y) != state)
+				return MASK_PARTIAL;
+		}
+	}
+
+	return state;
+}
+
 //float HeightMapData::get_estimated_height_at(Point2i pos) {
-//	pos /= HeightMap::CHUNK_SIZE;
+//	pos /= VERTICAL_BOUNDS_CHUNK_SIZE;
 //	pos.x = CLAMP(pos.x, 0, _chunked_vertical_bounds.size().x);
 //	pos.y = CLAMP(pos.y, 0, _chunked_vertical_bounds.size().y);
 //	VerticalBounds b = _chunked_vertical_bounds.get(pos);
 //	return (b.min + b.max) / 2.0;
 //}
 
-void HeightMapData::update_vertical_bounds() {
-	update_vertical_bounds(Point2i(0,0), Point2i(_resolution-1, _resolution-1));
+Ref<HeightMapSnapshot> HeightMapData::get_height_snapshot() const {
+	_height_snapshot_mutex->lock();
+	Ref<HeightMapSnapshot> snapshot = _height_snapshot;
+	_height_snapshot_mutex->unlock();
+	return snapshot;
 }
 
-void HeightMapData::update_vertical_bounds(Point2i origin_in_cells, Point2i size_in_cells) {
+void HeightMapData::publish_height_snapshot(Ref<HeightMapSnapshot> snapshot) {
+	// Readers still holding the previous version keep it alive until they release it.
+	// If nobody does, it gets freed here rather than while holding the lock.
+	Ref<HeightMapSnapshot> previous = _height_snapshot;
+	_height_snapshot_mutex->lock();
+	_height_snapshot = snapshot;
+	_height_snapshot_mutex->unlock();
+}
 
-	Point2i cmin = origin_in_cells / HeightMap::CHUNK_SIZE;
-	Point2i cmax = (origin_in_cells + size_in_cells - Point2i(1, 1)) / HeightMap::CHUNK_SIZE + Point2i(1, 1);
+void HeightMapData::update_height_snapshot() {
 
-	_chunked_vertical_bounds.clamp_min_max_excluded(cmin, cmax);
+	Ref<Image> heights_ref = _images[CHANNEL_HEIGHT];
+	ERR_FAIL_COND(heights_ref.is_null());
 
-	// Note: chunks in _chunked_vertical_bounds share their edge cells and have an actual size of CHUNK_SIZE+1.
-	const Point2i chunk_size(HeightMap::CHUNK_SIZE + 1, HeightMap::CHUNK_SIZE + 1);
+	// Only the main thread publishes, so the current version can be read without locking here
+	uint32_t version = _height_snapshot.is_valid() ? _height_snapshot->get_version() + 1 : 0;
+	publish_height_snapshot(HeightMapSnapshot::create(**heights_ref, version));
+}
 
-	for (int y = cmin.y; y < cmax.y; ++y) {
-		for (int x = cmin.x; x < cmax.x; ++x) {
+void HeightMapData::update_height_snapshot(Point2i min, Point2i max) {
 
-			int i = _chunked_vertical_bounds.index(x, y);
-			VerticalBounds &b = _chunked_vertical_bounds[i];
-			Point2i min(x * HeightMap::CHUNK_SIZE, y * HeightMap::CHUNK_SIZE);
-			compute_vertical_bounds_at(min, chunk_size, b.min, b.max);
-		}
+	Ref<Image> heights_ref = _images[CHANNEL_HEIGHT];
+	ERR_FAIL_COND(heights_ref.is_null());
+
+	if (_height_snapshot.is_null()) {
+		update_height_snapshot();
+		return;
 	}
+
+	publish_height_snapshot(_height_snapshot->create_next(**heights_ref, min, max));
 }
 
-void HeightMapData::compute_vertical_bounds_at(Point2i origin, Point2i size, float &out_min, float &out_max) {
+void HeightMapData::update_height_mips() {
+
+	// Down to 2x2 samples
+	int count = 0;
+	while (((_resolution - 1) >> (count + 1)) > 0) {
+		++count;
+	}
+
+	_height_mips.resize(count);
+
+	for (int i = 0; i < count; ++i) {
+		int size = ((_resolution - 1) >> (i + 1)) + 1;
+		_height_mips[i].resize(Point2i(size, size), false);
+	}
+
+	update_height_mips(Point2i(0, 0), Point2i(_resolution, _resolution));
+}
+
+void HeightMapData::update_height_mips(Point2i min, Point2i max) {
+
+	Ref<Image> heights_ref = _images[CHANNEL_HEIGHT];
+	ERR_FAIL_COND(heights_ref.is_null());
+	ImageRawView<uint16_t> heights(**heights_ref);
+
+	clamp_min_max_excluded(min, max, Point2i(0, 0), heights.get_size());
+
+	for (int i = 0; i < _height_mips.size(); ++i) {
+
+		// Sample X depends on samples from 2X-1 to 2X+1 of the previous level
+		min = min / 2;
+		max = max / 2 + Point2i(1, 1);
+
+		Grid2D<HeightMipSample> &mip = _height_mips[i];
+		mip.clamp_min_max_excluded(min, max);
+
+		if (i == 0)
+			downsample_height_mip(HeightMipSourceImage(heights), mip, min, max);
+		else
+			downsample_height_mip(HeightMipSourceGrid(_height_mips[i - 1]), mip, min, max);
+	}
+}
+
+void HeightMapData::update_vertical_bounds() {
+	update_vertical_bounds(Point2i(0,0), Point2i(_resolution-1, _resolution-1));
+}
+
+// Rows of blocks are split across threads
+struct HeightMapData::UpdateVerticalBoundsAction {
+	const ImageRawView<uint16_t> &heights;
+	VerticalBounds *bounds;
+	int bounds_width;
+	Point2i cmin;
+	Point2i cmax;
+
+	UpdateVerticalBoundsAction(const ImageRawView<uint16_t> &h, Grid2D<VerticalBounds> &b) :
+			heights(h), bounds(b.raw_write()), bounds_width(b.size().x) {}
+
+	void operator()(int begin, int end) {
+		for (int y = cmin.y + begin; y < cmin.y + end; ++y) {
+			for (int x = cmin.x; x < cmax.x; ++x) {
+
+				VerticalBounds &b = bounds[y * bounds_width + x];
+				Point2i min(x * VERTICAL_BOUNDS_CHUNK_SIZE, y * VERTICAL_BOUNDS_CHUNK_SIZE);
+				compute_vertical_bounds_at<VERTICAL_BOUNDS_CHUNK_SIZE>(heights, min, b.min, b.max);
+			}
+		}
+	}
+};
+
+void HeightMapData::update_vertical_bounds(Point2i origin_in_cells, Point2i size_in_cells) {
+
+	Point2i cmin = origin_in_cells / VERTICAL_BOUNDS_CHUNK_SIZE;
+	Point2i cmax = (origin_in_cells + size_in_cells - Point2i(1, 1)) / VERTICAL_BOUNDS_CHUNK_SIZE + Point2i(1, 1);
+
+	_chunked_vertical_bounds.clamp_min_max_excluded(cmin, cmax);
+
+	if (cmin.x >= cmax.x || cmin.y >= cmax.y)
+		return;
 
 	Ref<Image> heights_ref = _images[CHANNEL_HEIGHT];
 	ERR_FAIL_COND(heights_ref.is_null());
-	Image &heights = **heights_ref;
+	ImageRawView<uint16_t> heights(**heights_ref);
 
-	Point2i min = origin;
-	Point2i max = origin + size;
+	UpdateVerticalBoundsAction action(heights, _chunked_vertical_bounds);
+	action.cmin = cmin;
+	action.cmax = cmax;
 
-	heights.lock();
+	ThreadPool::get_singleton()->parallel_for(cmax.y - cmin.y, action, VERTICAL_BOUNDS_MIN_BATCH_SIZE);
+}
 
-	float min_height = heights.get_pixel(min.x, min.y).r;
+// Note: chunks in _chunked_vertical_bounds share their edge cells and have an actual size of CHUNK_SIZE+1.
+// Having the size known at compile time lets the compiler unroll the inner loop.
+template <int CHUNK_SIZE>
+void HeightMapData::compute_vertical_bounds_at(const ImageRawView<uint16_t> &heights, Point2i origin, float &out_min, float &out_max) {
+
+	// The last row and column are shared with the next chunk, which doesn't exist on the edges of the map
+	int ymax = MIN(origin.y + CHUNK_SIZE + 1, heights.get_height());
+	int w = MIN(CHUNK_SIZE + 1, heights.get_width() - origin.x);
+
+	float min_height = decode_height(heights.row(origin.y)[origin.x]);
 	float max_height = min_height;
 
-	for (int y = min.y; y < max.y; ++y) {
-		for (int x = min.x; x < max.x; ++x) {
+	for (int y = origin.y; y < ymax; ++y) {
+
+		const uint16_t *row = heights.row(y) + origin.x;
+
+		for (int x = 0; x < w; ++x) {
 
-			float h = heights.get_pixel(x, y).r;
+			float h = decode_height(row[x]);
 
 			if (h < min_height)
 				min_height = h;
@@ -493,12 +963,53 @@ void HeightMapData::compute_vertical_bounds_at(Point2i origin, Point2i size, flo
 		}
 	}
 
-	heights.unlock();
-
 	out_min = min_height;
 	out_max = max_height;
 }
 
+void HeightMapData::update_mask_states() {
+	update_mask_states(Point2i(0, 0), Point2i(_resolution, _resolution));
+}
+
+void HeightMapData::update_mask_states(Point2i origin_in_cells, Point2i size_in_cells) {
+
+	Point2i cmin = origin_in_cells / VERTICAL_BOUNDS_CHUNK_SIZE;
+	Point2i cmax = (origin_in_cells + size_in_cells - Point2i(1, 1)) / VERTICAL_BOUNDS_CHUNK_SIZE + Point2i(1, 1);
+
+	_chunked_mask_states.clamp_min_max_excluded(cmin, cmax);
+
+	Ref<Image> mask_ref = _images[CHANNEL_MASK];
+	ERR_FAIL_COND(mask_ref.is_null());
+	ImageRawView<uint8_t> mask(**mask_ref);
+
+	// Unlike vertical bounds, edge cells are not shared here:
+	// the fragments of a chunk only sample the mask in [origin, origin + CHUNK_SIZE[
+	const int cs = VERTICAL_BOUNDS_CHUNK_SIZE;
+
+	for (int cy = cmin.y; cy < cmax.y; ++cy) {
+		for (int cx = cmin.x; cx < cmax.x; ++cx) {
+
+			int masked_count = 0;
+
+			for (int y = cy * cs; y < (cy + 1) * cs; ++y) {
+				const uint8_t *row = mask.row(y) + cx * cs;
+				for (int x = 0; x < cs; ++x) {
+					// Same threshold as the default shader
+					masked_count += row[x] > 127;
+				}
+			}
+
+			MaskState state = MASK_PARTIAL;
+			if (masked_count == 0)
+				state = MASK_SOLID;
+			else if (masked_count == cs * cs)
+				state = MASK_FULL;
+
+			_chunked_mask_states.set(cx, cy, state);
+		}
+	}
+}
+
 Color HeightMapData::encode_normal(Vector3 n) {
 	return Color(
 			0.5 * (n.x + 1.0),
@@ -515,11 +1026,20 @@ Vector3 HeightMapData::decode_normal(Color c) {
 
 void HeightMapData::_bind_methods() {
 
-	ClassDB::bind_method(D_METHOD("set_resolution", "p_res"), &HeightMapData::set_resolution);
+	ClassDB::bind_method(D_METHOD("set_resolution", "p_res", "keep_heights"), &HeightMapData::set_resolution, DEFVAL(true));
 	ClassDB::bind_method(D_METHOD("get_resolution"), &HeightMapData::get_resolution);
 
-	ClassDB::bind_method(D_METHOD("get_height_at", "x", "y"), &HeightMapData::get_height_at);
-	ClassDB::bind_method(D_METHOD("get_interpolated_height_at", "pos"), &HeightMapData::get_interpolated_height_at);
+	ClassDB::bind_method(D_METHOD("get_height_at", "x", "y", "lod"), &HeightMapData::get_height_at, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("get_interpolated_height_at", "pos", "lod"), &HeightMapData::get_interpolated_height_at, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("get_height_range_at", "x", "y", "lod"), &HeightMapData::get_height_range_at, DEFVAL(0));
+	ClassDB::bind_method(D_METHOD("get_height_mip_count"), &HeightMapData::get_height_mip_count);
+	ClassDB::bind_method(D_METHOD("get_height_mip_image", "lod"), &HeightMapData::get_height_mip_image);
+	ClassDB::bind_method(D_METHOD("get_height_snapshot"), &HeightMapData::get_height_snapshot);
+
+	ClassDB::bind_method(D_METHOD("set_derived_layer_enabled", "layer", "enabled"), &HeightMapData::set_derived_layer_enabled);
+	ClassDB::bind_method(D_METHOD("is_derived_layer_enabled", "layer"), &HeightMapData::is_derived_layer_enabled);
+	ClassDB::bind_method(D_METHOD("get_derived_image", "layer"), &HeightMapData::get_derived_image);
+	ClassDB::bind_method(D_METHOD("get_derived_value_at", "layer", "pos"), &HeightMapData::get_derived_value_at);
 
 	//#ifdef TOOLS_ENABLED
 	ClassDB::bind_method(D_METHOD("_apply_undo", "data"), &HeightMapData::_apply_undo);
@@ -640,9 +1160,24 @@ Error HeightMapData::_load(FileAccess &f) {
 		load_channel(_images[channel], channel, f, size);
 	}
 
-	_chunked_vertical_bounds.resize(size, false);
+	// Derived layers are not saved
+	for (int i = 0; i < DERIVED_COUNT; ++i) {
+		if (_derived_images[i].is_valid()) {
+			resize_derived_layers();
+			update_all_normals();
+			break;
+		}
+	}
+
+	_chunked_vertical_bounds.resize(size / VERTICAL_BOUNDS_CHUNK_SIZE, false);
 	update_vertical_bounds();
 
+	_chunked_mask_states.resize(size / VERTICAL_BOUNDS_CHUNK_SIZE, false);
+	update_mask_states();
+
+	update_height_mips();
+	update_height_snapshot();
+
 	return OK;
 }
 
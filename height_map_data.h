@@ -9,8 +9,11 @@
 #include <core/dictionary.h>
 #include <scene/resources/texture.h>
 #include <core/os/file_access.h>
+#include <core/os/mutex.h>
 
 #include "grid.h"
+#include "height_map_snapshot.h"
+#include "utility.h"
 
 class HeightMapData : public Resource {
 	GDCLASS(HeightMapData, Resource)
@@ -26,30 +29,97 @@ public:
 		CHANNEL_COUNT
 	};
 
+	// Summary of the mask channel over an area.
+	// Masked cells are holes, which the default shader discards.
+	enum MaskState {
+		MASK_SOLID = 0,
+		MASK_PARTIAL,
+		MASK_FULL
+	};
+
 	static const int MAX_RESOLUTION;
 
+	// Vertical bounds are cached for blocks of this many cells.
+	// It must not be greater than the smallest chunk size, so that any chunk's AABB can be aggregated exactly.
+	enum { VERTICAL_BOUNDS_CHUNK_SIZE = 8 };
+
+	struct VerticalBounds {
+		float min;
+		float max;
+		VerticalBounds() : min(0), max(0) {}
+		VerticalBounds(float p_min, float p_max) : min(p_min), max(p_max) {}
+	};
+
+	// Optional layers derived from heights, updated along with normals.
+	// They are not saved, and cost nothing while disabled.
+	enum DerivedLayer {
+		// Angle between the surface and the horizontal, in radians
+		DERIVED_SLOPE = 0,
+		// Laplacian of heights, positive in hollows and negative on ridges
+		DERIVED_CURVATURE,
+		DERIVED_COUNT
+	};
+
+	// One sample of the downsampled heights, stored as half-floats like the map.
+	// Min and max come from half-floats too, so they are exact.
+	struct HeightMipSample {
+		uint16_t average;
+		uint16_t min;
+		uint16_t max;
+		HeightMipSample() : average(0), min(0), max(0) {}
+	};
+
 	static const char *SIGNAL_RESOLUTION_CHANGED;
 	static const char *SIGNAL_REGION_CHANGED;
 
 	HeightMapData();
+	~HeightMapData();
 
 	void load_default();
 
-	void set_resolution(int p_res);
+	// Existing data is resampled to the new size.
+	// Heights can be left out of that if they are about to be overwritten, they are zero instead.
+	void set_resolution(int p_res, bool keep_heights = true);
 	int get_resolution() const;
 
-	real_t get_height_at(int x, int y);
-	real_t get_interpolated_height_at(Vector3 pos);
+	// Positions are always in cells of the full map.
+	// Above LOD 0, heights come from the mip pyramid, so they are smoothed but a lot cheaper to fetch over large areas.
+	real_t get_height_at(int x, int y, int lod = 0);
+	real_t get_interpolated_height_at(Vector3 pos, int lod = 0);
+	// Lowest and highest heights around a position, covering at least the cells closest to the sample at that LOD
+	Vector2 get_height_range_at(int x, int y, int lod = 0);
 
+	// Also updates enabled derived layers
 	void update_all_normals();
 	void update_normals(Point2i min, Point2i size);
 
+	void set_derived_layer_enabled(DerivedLayer layer, bool enabled);
+	bool is_derived_layer_enabled(DerivedLayer layer) const;
+	// Float image of the same size as the map, null if the layer is disabled
+	Ref<Image> get_derived_image(DerivedLayer layer) const;
+	// Bilinear value at a position in cells
+	real_t get_derived_value_at(DerivedLayer layer, Vector3 pos) const;
+
 	void notify_region_change(Point2i min, Point2i max, Channel channel);
 
 	Ref<Texture> get_texture(Channel channel);
 	Ref<Image> get_image(Channel channel) const;
 
-	AABB get_region_aabb(Point2i origin_in_cells, Point2i size_in_cells);
+	AABB get_region_aabb(Point2i origin_in_cells, Point2i size_in_cells) const;
+	MaskState get_region_mask_state(Point2i origin_in_cells, Point2i size_in_cells) const;
+	const Grid2D<VerticalBounds> &get_chunked_vertical_bounds() const { return _chunked_vertical_bounds; }
+
+	// Level N of the pyramid has one sample every 2^N cells, level 0 being the map itself.
+	// Each level is updated from the previous one when heights change.
+	int get_height_mip_count() const { return _height_mips.size() + 1; }
+	// LOD must be at least 1
+	const Grid2D<HeightMipSample> &get_height_mip(int lod) const { return _height_mips[lod - 1]; }
+	// Averages of a level as an image in the same format as heights, for previews
+	Ref<Image> get_height_mip_image(int lod) const;
+
+	// Latest version of the heights, safe to read from any thread until released.
+	// A new one is published after each change, so it has to be taken again to see them.
+	Ref<HeightMapSnapshot> get_height_snapshot() const;
 	//float get_estimated_height_at(Point2i pos);
 
 	static Color encode_normal(Vector3 n);
@@ -72,27 +142,44 @@ private:
 
 	static void _bind_methods();
 
+	void resize_derived_layers();
+
 	void upload_channel(Channel channel);
 	void upload_region(Channel channel, Point2i min, Point2i max);
 
 	void update_vertical_bounds();
 	void update_vertical_bounds(Point2i min, Point2i max);
-	void compute_vertical_bounds_at(Point2i origin, Point2i size, float &out_min, float &out_max);
+	void update_mask_states();
+	void update_mask_states(Point2i min, Point2i size);
+	void update_height_mips();
+	void update_height_mips(Point2i min, Point2i max);
+	void update_height_snapshot();
+	void update_height_snapshot(Point2i min, Point2i max);
+	void publish_height_snapshot(Ref<HeightMapSnapshot> snapshot);
+
+	struct UpdateVerticalBoundsAction;
+
+	template <int CHUNK_SIZE>
+	static void compute_vertical_bounds_at(const ImageRawView<uint16_t> &heights, Point2i origin, float &out_min, float &out_max);
 
 private:
 	int _resolution;
 
 	Ref<ImageTexture> _textures[CHANNEL_COUNT];
 	Ref<Image> _images[CHANNEL_COUNT];
-
-	struct VerticalBounds {
-		float min;
-		float max;
-		VerticalBounds() : min(0), max(0) {}
-		VerticalBounds(float p_min, float p_max) : min(p_min), max(p_max) {}
-	};
+	Ref<Image> _derived_images[DERIVED_COUNT];
 
 	Grid2D<VerticalBounds> _chunked_vertical_bounds;
+
+	// Uses the same chunking as vertical bounds, values are MaskState
+	Grid2D<uint8_t> _chunked_mask_states;
+
+	// Starts at LOD 1
+	Vector<Grid2D<HeightMipSample> > _height_mips;
+
+	// Only the main thread publishes snapshots, the mutex is held just long enough to swap the reference
+	Ref<HeightMapSnapshot> _height_snapshot;
+	Mutex *_height_snapshot_mutex;
 };
 
 
@@ -113,6 +200,7 @@ public:
 };
 
 VARIANT_ENUM_CAST(HeightMapData::Channel)
+VARIANT_ENUM_CAST(HeightMapData::DerivedLayer)
 
 
 #endif // HEIGHT_MAP_DATA_H
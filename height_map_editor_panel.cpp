@@ -59,6 +59,27 @@ HeightMapBrushEditor::HeightMapBrushEditor() {
 		add_child(_opacity_label);
 	}
 	y += spacing;
+	{
+		Label *label = memnew(Label);
+		label->set_text(TTR("Brush spacing"));
+		label->set_position(Vector2(10, y));
+		add_child(label);
+
+		// Relative to brush radius
+		_spacing_slider = memnew(HSlider);
+		_spacing_slider->set_position(Vector2(100, y));
+		_spacing_slider->set_min(0.05);
+		_spacing_slider->set_max(1);
+		_spacing_slider->set_step(0.05);
+		_spacing_slider->set_size(Vector2(120, 10));
+		_spacing_slider->connect("value_changed", this, "_on_param_changed", varray(BRUSH_SPACING));
+		add_child(_spacing_slider);
+
+		_spacing_label = memnew(Label);
+		_spacing_label->set_position(Vector2(224, y));
+		add_child(_spacing_label);
+	}
+	y += spacing;
 	{
 		Label *label = memnew(Label);
 		label->set_text(TTR("Flatten height"));
@@ -85,15 +106,17 @@ HeightMapBrushEditor::HeightMapBrushEditor() {
 HeightMapBrushEditor::~HeightMapBrushEditor() {
 }
 
-void HeightMapBrushEditor::init_params(int size, float opacity, float height, Color color) {
+void HeightMapBrushEditor::init_params(int size, float opacity, float spacing, float height, Color color) {
 
 	_size_slider->set_value(size);
 	_opacity_slider->set_as_ratio(opacity);
+	_spacing_slider->set_value(spacing);
 	_height_edit->set_value(height);
 	_color_picker->set_pick_color(color);
 
 	_size_label->set_text(String::num(size));
 	_opacity_label->set_text(String::num(opacity));
+	_spacing_label->set_text(String::num(spacing));
 }
 
 void HeightMapBrushEditor::on_param_changed(Variant value, int param) {
@@ -107,6 +130,10 @@ void HeightMapBrushEditor::on_param_changed(Variant value, int param) {
 			_opacity_label->set_text(String::num(value));
 			break;
 
+		case BRUSH_SPACING:
+			_spacing_label->set_text(String::num(value));
+			break;
+
 		default:
 			break;
 	}
@@ -132,7 +159,7 @@ HeightMapEditorPanel::HeightMapEditorPanel() {
 
 	int m = 4;
 
-	set_custom_minimum_size(Vector2(300, 112));
+	set_custom_minimum_size(Vector2(300, 136));
 
 	// Using a secondary container, because margins don't work when inside a container...
 	HSplitContainer *main_container = memnew(HSplitContainer);
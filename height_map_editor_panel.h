@@ -20,10 +20,11 @@ public:
 		BRUSH_SIZE = 0,
 		BRUSH_OPACITY,
 		BRUSH_COLOR,
-		BRUSH_HEIGHT
+		BRUSH_HEIGHT,
+		BRUSH_SPACING
 	};
 
-	void init_params(int size, float opacity, float height, Color color);
+	void init_params(int size, float opacity, float spacing, float height, Color color);
 
 protected:
 	static void _bind_methods();
@@ -38,6 +39,9 @@ private:
 	Label *_opacity_label;
 	Slider *_opacity_slider;
 
+	Label *_spacing_label;
+	Slider *_spacing_slider;
+
 	SpinBox *_height_edit;
 	ColorPickerButton *_color_picker;
 };
@@ -1,9 +1,15 @@
 #include <core/os/input.h>
+#include <core/os/os.h>
 #include <scene/3d/camera.h>
 #include <scene/scene_string_names.h>
 #include <scene/gui/color_rect.h>
+#include <scene/gui/grid_container.h>
 
 #include "height_map_editor_plugin.h"
+#include "height_map_importer.h"
+
+#define UNDO_MEMORY_BUDGET_SETTING "editors/height_map/undo_memory_budget_mb"
+#define UNDO_MEMORY_BUDGET_MAX_MB (64 * 1024)
 
 inline Ref<Texture> get_icon(String name) {
 	return EditorNode::get_singleton()->get_gui_base()->get_icon(name, "EditorIcons");
@@ -13,15 +19,24 @@ HeightMapEditorPlugin::HeightMapEditorPlugin(EditorNode *p_editor) {
 	_editor = p_editor;
 	_mouse_pressed = false;
 	_height_map = NULL;
+	_import_file_len = 0;
 
 	_brush.set_radius(5);
 
+	EDITOR_DEF(UNDO_MEMORY_BUDGET_SETTING, 256);
+	EditorSettings::get_singleton()->add_property_hint(PropertyInfo(Variant::INT, UNDO_MEMORY_BUDGET_SETTING, PROPERTY_HINT_RANGE, "0," + itos(UNDO_MEMORY_BUDGET_MAX_MB) + ",16"));
+
+	// Undo steps over budget go there. One file per editor instance, so they don't overwrite each other.
+	String spill_file_name = "height_map_undo_" + itos(OS::get_singleton()->get_process_id()) + ".tmp";
+	HeightMapUndoStore::get_singleton()->set_spill_path(EditorSettings::get_singleton()->get_cache_dir().plus_file(spill_file_name));
+
 	_panel = memnew(HeightMapEditorPanel);
 	_panel->connect(HeightMapEditorPanel::SIGNAL_TEXTURE_INDEX_SELECTED, this, "_on_texture_index_selected");
 	HeightMapBrushEditor &brush_editor = _panel->get_brush_editor();
 	brush_editor.init_params(
 			_brush.get_radius(),
 			_brush.get_opacity(),
+			_brush.get_spacing(),
 			_brush.get_flatten_height(),
 			_brush.get_color());
 	brush_editor.connect(HeightMapBrushEditor::SIGNAL_PARAM_CHANGED, this, "_on_brush_param_changed");
@@ -35,6 +50,9 @@ HeightMapEditorPlugin::HeightMapEditorPlugin(EditorNode *p_editor) {
 	MenuButton *heightmap_menu = memnew(MenuButton);
 	heightmap_menu->set_text(TTR("HeightMap"));
 	heightmap_menu->get_popup()->add_item(TTR("Import RAW..."), MENU_IMPORT_RAW);
+	heightmap_menu->get_popup()->add_separator();
+	heightmap_menu->get_popup()->add_item(TTR("Load brush shape..."), MENU_LOAD_BRUSH_SHAPE);
+	heightmap_menu->get_popup()->add_item(TTR("Reset brush shape"), MENU_RESET_BRUSH_SHAPE);
 	heightmap_menu->get_popup()->connect("id_pressed", this, "_menu_item_selected");
 	_toolbar->add_child(heightmap_menu);
 
@@ -91,10 +109,101 @@ HeightMapEditorPlugin::HeightMapEditorPlugin(EditorNode *p_editor) {
 	_import_dialog->set_access(FileDialog::ACCESS_FILESYSTEM);
 	base_control->add_child(_import_dialog);
 
-	_import_confirmation_dialog = memnew(ConfirmationDialog);
-	base_control->add_child(_import_confirmation_dialog);
-	_import_confirmation_dialog->get_ok()->set_text(TTR("Import anyways"));
-	_import_confirmation_dialog->connect("confirmed", this, "_import_raw_file");
+	_brush_shape_dialog = memnew(FileDialog);
+	_brush_shape_dialog->connect("file_selected", this, "_brush_shape_file_selected");
+	_brush_shape_dialog->set_mode(FileDialog::MODE_OPEN_FILE);
+	_brush_shape_dialog->add_filter("*.png ; PNG images");
+	_brush_shape_dialog->add_filter("*.jpg ; JPEG images");
+	_brush_shape_dialog->add_filter("*.webp ; WebP images");
+	_brush_shape_dialog->set_size(Vector2(400, 300));
+	_brush_shape_dialog->set_resizable(true);
+	_brush_shape_dialog->set_access(FileDialog::ACCESS_FILESYSTEM);
+	base_control->add_child(_brush_shape_dialog);
+
+	_import_options_dialog = memnew(ConfirmationDialog);
+	_import_options_dialog->set_title(TTR("Import RAW heightmap"));
+	_import_options_dialog->get_ok()->set_text(TTR("Import"));
+	_import_options_dialog->connect("confirmed", this, "_import_raw_file");
+	base_control->add_child(_import_options_dialog);
+	{
+		GridContainer *grid = memnew(GridContainer);
+		grid->set_columns(2);
+		_import_options_dialog->add_child(grid);
+
+		Label *label = memnew(Label);
+		label->set_text(TTR("Sample format"));
+		grid->add_child(label);
+
+		_import_format_option = memnew(OptionButton);
+		_import_format_option->add_item(TTR("8-bit unsigned"), HeightMapRawImporter::SAMPLE_UINT8);
+		_import_format_option->add_item(TTR("16-bit unsigned"), HeightMapRawImporter::SAMPLE_UINT16);
+		_import_format_option->add_item(TTR("32-bit unsigned"), HeightMapRawImporter::SAMPLE_UINT32);
+		_import_format_option->add_item(TTR("32-bit float"), HeightMapRawImporter::SAMPLE_FLOAT32);
+		_import_format_option->select(HeightMapRawImporter::SAMPLE_UINT16);
+		_import_format_option->connect("item_selected", this, "_import_format_selected");
+		grid->add_child(_import_format_option);
+
+		label = memnew(Label);
+		label->set_text(TTR("Byte order"));
+		grid->add_child(label);
+
+		_import_endianness_option = memnew(OptionButton);
+		_import_endianness_option->add_item(TTR("Little endian"), 0);
+		_import_endianness_option->add_item(TTR("Big endian"), 1);
+		grid->add_child(_import_endianness_option);
+
+		label = memnew(Label);
+		label->set_text(TTR("Width"));
+		grid->add_child(label);
+
+		_import_width_spinbox = memnew(SpinBox);
+		_import_width_spinbox->set_min(1);
+		_import_width_spinbox->set_max(65536);
+		grid->add_child(_import_width_spinbox);
+
+		label = memnew(Label);
+		label->set_text(TTR("Height"));
+		grid->add_child(label);
+
+		_import_height_spinbox = memnew(SpinBox);
+		_import_height_spinbox->set_min(1);
+		_import_height_spinbox->set_max(65536);
+		grid->add_child(_import_height_spinbox);
+
+		// Float samples are used as they are
+		label = memnew(Label);
+		label->set_text(TTR("Min height"));
+		grid->add_child(label);
+
+		_import_min_height_spinbox = memnew(SpinBox);
+		_import_min_height_spinbox->set_min(-100000);
+		_import_min_height_spinbox->set_max(100000);
+		_import_min_height_spinbox->set_step(0.01);
+		_import_min_height_spinbox->set_value(0);
+		grid->add_child(_import_min_height_spinbox);
+
+		label = memnew(Label);
+		label->set_text(TTR("Max height"));
+		grid->add_child(label);
+
+		_import_max_height_spinbox = memnew(SpinBox);
+		_import_max_height_spinbox->set_min(-100000);
+		_import_max_height_spinbox->set_max(100000);
+		_import_max_height_spinbox->set_step(0.01);
+		_import_max_height_spinbox->set_value(600);
+		grid->add_child(_import_max_height_spinbox);
+
+		// The map is resized to the next power of two + 1, the file gets scaled to fit if it's not already that size
+		label = memnew(Label);
+		label->set_text(TTR("Resampling"));
+		grid->add_child(label);
+
+		_import_filter_option = memnew(OptionButton);
+		_import_filter_option->add_item(TTR("Bilinear"), RESAMPLE_BILINEAR);
+		_import_filter_option->add_item(TTR("Bicubic"), RESAMPLE_BICUBIC);
+		_import_filter_option->select(1);
+		grid->add_child(_import_filter_option);
+	}
 
 	_accept_dialog = memnew(AcceptDialog);
 	base_control->add_child(_accept_dialog);
@@ -106,6 +215,21 @@ HeightMapEditorPlugin::HeightMapEditorPlugin(EditorNode *p_editor) {
 HeightMapEditorPlugin::~HeightMapEditorPlugin() {
 }
 
+void HeightMapEditorPlugin::_notification(int p_what) {
+	switch (p_what) {
+
+		case NOTIFICATION_ENTER_TREE:
+			set_process(true);
+			break;
+
+		case NOTIFICATION_PROCESS:
+			// Mouse events can come much more often than frames, so dabs are painted at most once per frame
+			if (_height_map && _brush.has_pending_dabs())
+				_brush.flush_stroke(*_height_map, -1);
+			break;
+	}
+}
+
 bool HeightMapEditorPlugin::forward_spatial_gui_input(Camera *p_camera, const Ref<InputEvent> &p_event) {
 	if(_height_map == NULL)
 		return false;
@@ -126,8 +250,11 @@ bool HeightMapEditorPlugin::forward_spatial_gui_input(Camera *p_camera, const Re
 
 			// Need to check modifiers before capturing the event because they are used in navigation schemes
 			if (mb.get_control() == false && mb.get_alt() == false && mb.get_button_index() == BUTTON_LEFT) {
-				if (mb.is_pressed())
+				if (mb.is_pressed()) {
 					_mouse_pressed = true;
+					_brush.begin_stroke();
+					paint(*p_camera, mb.get_position());
+				}
 
 				captured_event = true;
 
@@ -137,17 +264,25 @@ bool HeightMapEditorPlugin::forward_spatial_gui_input(Camera *p_camera, const Re
 					ERR_FAIL_COND_V(_height_map->get_data().is_null(), captured_event);
 					HeightMapData *heightmap_data = *_height_map->get_data();
 
+					// Remaining dabs must be in before undo data gets collected
+					_brush.flush_stroke(*_height_map, -1);
+					_brush.begin_stroke();
+
+					// Budget can be changed in editor settings at any time
+					int budget_mb = EditorSettings::get_singleton()->get(UNDO_MEMORY_BUDGET_SETTING);
+					budget_mb = CLAMP(budget_mb, 0, UNDO_MEMORY_BUDGET_MAX_MB);
+					HeightMapUndoStore::get_singleton()->set_memory_budget((uint64_t)budget_mb * 1024 * 1024);
+
 					HeightMapBrush::UndoData ur_data = _brush.pop_undo_redo_data(*heightmap_data);
+					ERR_FAIL_COND_V(ur_data.step.is_null(), captured_event);
 
 					Dictionary undo_data;
-					undo_data["chunk_positions"] = ur_data.chunk_positions;
-					undo_data["data"] = ur_data.undo;
-					undo_data["channel"] = ur_data.channel;
+					undo_data["step"] = ur_data.step;
+					undo_data["redo"] = false;
 
 					Dictionary redo_data;
-					redo_data["chunk_positions"] = ur_data.chunk_positions;
-					redo_data["data"] = ur_data.redo;
-					redo_data["channel"] = ur_data.channel;
+					redo_data["step"] = ur_data.step;
+					redo_data["redo"] = true;
 
 					UndoRedo &ur = *EditorNode::get_singleton()->get_undo_redo();
 
@@ -198,7 +333,7 @@ bool HeightMapEditorPlugin::forward_spatial_gui_input(Camera *p_camera, const Re
 	return captured_event;
 }
 
-void HeightMapEditorPlugin::paint(Camera &camera, Vector2 screen_pos, int override_mode) {
+void HeightMapEditorPlugin::paint(Camera &camera, Vector2 screen_pos) {
 	ERR_FAIL_COND(_height_map == NULL);
 
 	Vector3 origin = camera.project_ray_origin(screen_pos);
@@ -206,9 +341,10 @@ void HeightMapEditorPlugin::paint(Camera &camera, Vector2 screen_pos, int overri
 
 	HeightMap &height_map = *_height_map;
 
+	// Dabs are placed along the path, and painted on the next frame
 	Point2i hit_pos_in_cells;
 	if (height_map.cell_raycast(origin, dir, hit_pos_in_cells)) {
-		_brush.paint(height_map, hit_pos_in_cells, override_mode);
+		_brush.add_stroke_point(Vector2(hit_pos_in_cells.x, hit_pos_in_cells.y));
 	}
 }
 
@@ -221,6 +357,8 @@ void HeightMapEditorPlugin::edit(Object *p_object) {
 		_height_map->disconnect(SceneStringNames::get_singleton()->tree_exited, this, "_height_map_exited_scene");
 	}
 
+	// Pending dabs belong to the previous map
+	_brush.begin_stroke();
 	_height_map = node;
 
 	if(_height_map) {
@@ -258,6 +396,10 @@ void HeightMapEditorPlugin::_brush_param_changed(Variant value, HeightMapBrushEd
 			_brush.set_opacity(value);
 			break;
 
+		case HeightMapBrushEditor::BRUSH_SPACING:
+			_brush.set_spacing(value);
+			break;
+
 		case HeightMapBrushEditor::BRUSH_HEIGHT:
 			_brush.set_flatten_height(value);
 			break;
@@ -277,22 +419,49 @@ void HeightMapEditorPlugin::_on_texture_index_selected(int index) {
 }
 
 void HeightMapEditorPlugin::_menu_item_selected(int id) {
-	if(id == MENU_IMPORT_RAW) {
-		_import_dialog->popup();
+	switch (id) {
+		case MENU_IMPORT_RAW:
+			_import_dialog->popup();
+			break;
+
+		case MENU_LOAD_BRUSH_SHAPE:
+			_brush_shape_dialog->popup();
+			break;
+
+		case MENU_RESET_BRUSH_SHAPE:
+			_brush.set_shape_image(Ref<Image>());
+			break;
+
+		default:
+			break;
 	}
 }
 
-static Point2i get_size_from_raw_length(int len) {
-	size_t side_len = static_cast<int>(Math::round(Math::sqrt(static_cast<float>(len/2))));
-	Point2i size(side_len, side_len);
-	return size;
+void HeightMapEditorPlugin::_brush_shape_file_selected(String path) {
+
+	Ref<Image> image;
+	image.instance();
+
+	Error err = image->load(path);
+	if (err != OK) {
+		_accept_dialog->set_title(TTR("Brush shape error"));
+		_accept_dialog->set_text(TTR("Could not load brush shape image:") + "\n" + path);
+		_accept_dialog->popup_centered_minsize();
+		return;
+	}
+
+	_brush.set_shape_image(image);
+}
+
+// Assumes the raw data is square, so its size is function of file length
+static Point2i get_size_from_raw_length(uint64_t len, int sample_size) {
+	int side_len = static_cast<int>(Math::round(Math::sqrt(static_cast<double>(len / sample_size))));
+	return Point2i(side_len, side_len);
 }
 
 void HeightMapEditorPlugin::_import_raw_file_selected(String path) {
 
 	ERR_FAIL_COND(_height_map == NULL);
-	Ref<HeightMapData> data_ref = _height_map->get_data();
-	ERR_FAIL_COND(data_ref.is_null());
 
 	Error err = OK;
 	FileAccess *f = FileAccess::open(path, FileAccess::READ, &err);
@@ -300,39 +469,24 @@ void HeightMapEditorPlugin::_import_raw_file_selected(String path) {
 		print_line("Error opening file");
 		return;
 	}
-
-	// Assume the raw data is square, so its size is function of file length
-	size_t len = f->get_len();
-	Point2i size = get_size_from_raw_length(len);
+	_import_file_len = f->get_len();
 	f->close();
-
-	print_line(String("Deducted RAW heightmap resolution: {0}*{1}, for a length of {2}")
-			   .format(varray(size.x, size.y, static_cast<int>(len))));
-
-	if(len/2 != size.x * size.y) {
-
-		_accept_dialog->set_title(TTR("Import RAW heightmap error"));
-		_accept_dialog->set_text(TTR("The square resolution deducted from file size is not square.\n"
-									 "Cannot import heightmap."));
-		_accept_dialog->popup_centered_minsize();
-	}
+	memdelete(f);
 
 	_import_file_path = path;
 
-	if(next_power_of_2(size.x)+1 != size.x) {
-
-		_import_confirmation_dialog->set_title(TTR("Import RAW heightmap"));
-		_import_confirmation_dialog->set_text(
-			TTR("The square resolution deducted from file size is not power of two + 1.\n"
-				"The heightmap will be cropped/. Continue?"));
+	// Size is only a guess, it can be changed before importing
+	_import_format_selected(_import_format_option->get_selected());
 
-		_import_confirmation_dialog->popup_centered_minsize();
-
-	} else {
+	_import_options_dialog->popup_centered_minsize();
+}
 
-		// Go!
-		_import_raw_file();
-	}
+void HeightMapEditorPlugin::_import_format_selected(int format) {
+	int sample_size = HeightMapRawImporter::get_sample_size((HeightMapRawImporter::SampleFormat)format);
+	ERR_FAIL_COND(sample_size == 0);
+	Point2i size = get_size_from_raw_length(_import_file_len, sample_size);
+	_import_width_spinbox->set_value(size.x);
+	_import_height_spinbox->set_value(size.y);
 }
 
 void HeightMapEditorPlugin::_import_raw_file() {
@@ -340,53 +494,50 @@ void HeightMapEditorPlugin::_import_raw_file() {
 	ERR_FAIL_COND(_height_map == NULL);
 	Ref<HeightMapData> data_ref = _height_map->get_data();
 	ERR_FAIL_COND(data_ref.is_null());
-	HeightMapData &data = **data_ref;
-
-	Error err = OK;
-	FileAccess *f = FileAccess::open(_import_file_path, FileAccess::READ, &err);
-	ERR_FAIL_COND(!f);
 
-	Point2i src_size = get_size_from_raw_length(f->get_len());
+	HeightMapRawImporter::Settings settings;
+	settings.format = (HeightMapRawImporter::SampleFormat)_import_format_option->get_selected();
+	settings.big_endian = _import_endianness_option->get_selected() == 1;
+	settings.width = _import_width_spinbox->get_value();
+	settings.height = _import_height_spinbox->get_value();
+	settings.min_height = _import_min_height_spinbox->get_value();
+	settings.max_height = _import_max_height_spinbox->get_value();
+	settings.filter = (ResampleFilter)_import_filter_option->get_selected_id();
 
-	// Note: resolution will be brought back to power of two + 1, if not already
-	data.set_resolution(src_size.x);
+	HeightMapRawImporter importer;
+	Error err = importer.begin(_import_file_path, settings, data_ref);
 
-	Point2i dst_size(data.get_resolution(), data.get_resolution());
-
-	Ref<Image> height_image_ref = data.get_image(HeightMapData::CHANNEL_HEIGHT);
-	ERR_FAIL_COND(height_image_ref.is_null());
-	Image &height_image = **height_image_ref;
-
-	// TODO Have these configurable
-	float min_y = 0;
-	float max_y = 600;
-	float hrange = max_y - min_y;
-
-	height_image.lock();
+	if (err != OK) {
+		_accept_dialog->set_title(TTR("Import RAW heightmap error"));
+		_accept_dialog->set_text(TTR("Cannot import heightmap, the file could not be opened or is smaller than the given size."));
+		_accept_dialog->popup_centered_minsize();
+		return;
+	}
 
-	Point2i size(MIN(src_size.x, dst_size.x), MIN(src_size.y, dst_size.y));
+	{
+		EditorProgress progress("import_raw_heightmap", TTR("Importing RAW heightmap"), importer.get_block_count());
 
-	for(int y = 0; y < size.y; ++y) {
-		for(int x = 0; x < size.x; ++x) {
-			uint16_t d = f->get_16();
-			float h = min_y + hrange * static_cast<float>(d) / 65536.f;
-			height_image.set_pixel(x, y, Color(h, 0,0,0));
-		}
-		// Skip next pixels if the file is bigger than the accepted resolution
-		for(int x = size.x; x < src_size.x; ++x) {
-			f->get_16();
+		for (int i = 0; i < importer.get_block_count(); ++i) {
+			progress.step(TTR("Reading..."), i);
+			err = importer.import_block(i);
+			if (err != OK)
+				break;
 		}
 	}
 
-	// TODO Fill gaps by clamped values if sizes don't exactly match a power of two
+	// Even if it failed, the map was resized and must be updated
+	importer.end();
 
-	f->close();
-
-	height_image.unlock();
-
-	data.update_all_normals();
+	if (err != OK) {
+		_accept_dialog->set_title(TTR("Import RAW heightmap error"));
+		_accept_dialog->set_text(TTR("An error occurred while reading the file, the heightmap was only partially imported."));
+		_accept_dialog->popup_centered_minsize();
 
-	data.notify_region_change(Point2i(0, 0), size, HeightMapData::CHANNEL_HEIGHT);
+	} else if (importer.is_downscaled()) {
+		_accept_dialog->set_title(TTR("Import RAW heightmap"));
+		_accept_dialog->set_text(TTR("The file is bigger than the maximum resolution of heightmaps, it was scaled down to ") + itos(HeightMapData::MAX_RESOLUTION) + ".");
+		_accept_dialog->popup_centered_minsize();
+	}
 }
 
 void HeightMapEditorPlugin::_bind_methods() {
@@ -396,7 +547,9 @@ void HeightMapEditorPlugin::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("_height_map_exited_scene"), &HeightMapEditorPlugin::_height_map_exited_scene);
 	ClassDB::bind_method(D_METHOD("_import_raw_file_selected", "path"), &HeightMapEditorPlugin::_import_raw_file_selected);
 	ClassDB::bind_method(D_METHOD("_import_raw_file"), &HeightMapEditorPlugin::_import_raw_file);
+	ClassDB::bind_method(D_METHOD("_import_format_selected", "format"), &HeightMapEditorPlugin::_import_format_selected);
 	ClassDB::bind_method(D_METHOD("_menu_item_selected", "id"), &HeightMapEditorPlugin::_menu_item_selected);
+	ClassDB::bind_method(D_METHOD("_brush_shape_file_selected", "path"), &HeightMapEditorPlugin::_brush_shape_file_selected);
 	ClassDB::bind_method(D_METHOD("_on_texture_index_selected", "index"), &HeightMapEditorPlugin::_on_texture_index_selected);
 }
 
@@ -3,6 +3,7 @@
 
 #include "editor/editor_node.h"
 #include "editor/editor_plugin.h"
+#include "scene/gui/option_button.h"
 #include "height_map.h"
 #include "height_map_brush.h"
 #include "height_map_editor_panel.h"
@@ -21,6 +22,7 @@ public:
 	virtual void make_visible(bool p_visible);
 
 protected:
+	void _notification(int p_what);
 	static void _bind_methods();
 
 private:
@@ -32,13 +34,18 @@ private:
 	void _import_file_selected(String p_path);
 
 	void _import_raw_file_selected(String path);
+	void _import_format_selected(int format);
 	void _import_raw_file();
 
-	void paint(Camera &camera, Vector2 screen_pos, int override_mode = -1);
+	void _brush_shape_file_selected(String path);
+
+	void paint(Camera &camera, Vector2 screen_pos);
 
 private:
 	enum MenuItems {
-		MENU_IMPORT_RAW = 0
+		MENU_IMPORT_RAW = 0,
+		MENU_LOAD_BRUSH_SHAPE,
+		MENU_RESET_BRUSH_SHAPE
 	};
 
 	EditorNode *_editor;
@@ -49,8 +56,17 @@ private:
 
 	FileDialog *_import_dialog;
 	String _import_file_path;
-	ConfirmationDialog *_import_confirmation_dialog;
+	uint64_t _import_file_len;
+	ConfirmationDialog *_import_options_dialog;
+	OptionButton *_import_format_option;
+	OptionButton *_import_endianness_option;
+	SpinBox *_import_width_spinbox;
+	SpinBox *_import_height_spinbox;
+	SpinBox *_import_min_height_spinbox;
+	SpinBox *_import_max_height_spinbox;
+	OptionButton *_import_filter_option;
 	AcceptDialog *_accept_dialog;
+	FileDialog *_brush_shape_dialog;
 
 	bool _mouse_pressed;
 };
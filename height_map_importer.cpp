@@ -0,0 +1,272 @@
+#include "height_map_importer.h"
+#include "thread_pool.h"
+#include "utility.h"
+
+#define IMPORT_MIN_ROWS_PER_TASK 16
+
+HeightMapRawImporter::Settings::Settings() {
+	format = SAMPLE_UINT16;
+	big_endian = false;
+	width = 0;
+	height = 0;
+	min_height = 0;
+	max_height = 600;
+	filter = RESAMPLE_BICUBIC;
+}
+
+namespace {
+
+inline uint16_t read_sample(const uint8_t *p, uint16_t, bool swap) {
+	uint16_t v;
+	copymem(&v, p, sizeof(v));
+	return swap ? BSWAP16(v) : v;
+}
+
+inline uint32_t read_sample(const uint8_t *p, uint32_t, bool swap) {
+	uint32_t v;
+	copymem(&v, p, sizeof(v));
+	return swap ? BSWAP32(v) : v;
+}
+
+inline uint8_t read_sample(const uint8_t *p, uint8_t, bool) {
+	return *p;
+}
+
+inline float read_sample(const uint8_t *p, float, bool swap) {
+	uint32_t v = read_sample(p, uint32_t(), swap);
+	float f;
+	copymem(&f, &v, sizeof(f));
+	return f;
+}
+
+// Integer samples cover the whole range of their type.
+// Done in double, floats can't hold all the bits of 32-bit samples.
+template <typename T>
+inline float sample_to_height(T v, double min_height, double scale) {
+	return static_cast<float>(min_height + static_cast<double>(v) * scale);
+}
+
+template <>
+inline float sample_to_height<float>(float v, double, double) {
+	return v;
+}
+
+template <typename T>
+struct ConvertRowsAction {
+	const uint8_t *src;
+	int src_pitch;
+	float *dst;
+	int width;
+	bool swap;
+	double min_height;
+	double scale;
+
+	void operator()(int begin, int end) {
+		for (int y = begin; y < end; ++y) {
+			const uint8_t *src_row = src + y * src_pitch;
+			float *dst_row = dst + y * width;
+			for (int x = 0; x < width; ++x) {
+				T v = read_sample(src_row + x * sizeof(T), T(), swap);
+				dst_row[x] = sample_to_height(v, min_height, scale);
+			}
+		}
+	}
+};
+
+template <typename T>
+void convert_rows(const uint8_t *src, int src_pitch, float *dst, Point2i size, bool swap, float min_height, float max_height, double max_value) {
+
+	ConvertRowsAction<T> action;
+	action.src = src;
+	action.src_pitch = src_pitch;
+	action.dst = dst;
+	action.width = size.x;
+	action.swap = swap;
+	action.min_height = min_height;
+	action.scale = (static_cast<double>(max_height) - min_height) / max_value;
+
+	ThreadPool::get_singleton()->parallel_for(size.y, action, IMPORT_MIN_ROWS_PER_TASK);
+}
+
+} // namespace
+
+HeightMapRawImporter::FileSource::FileSource(FileAccess *file, const Settings &settings) {
+	_file = file;
+	_settings = settings;
+}
+
+HeightMapRawImporter::FileSource::~FileSource() {
+	_file->close();
+	memdelete(_file);
+}
+
+Point2i HeightMapRawImporter::FileSource::get_size() const {
+	return Point2i(_settings.width, _settings.height);
+}
+
+bool HeightMapRawImporter::FileSource::read_rows(int y0, int count, float *out) {
+
+	int src_pitch = _settings.width * get_sample_size(_settings.format);
+	_buffer.resize(count * src_pitch);
+
+	_file->seek((uint64_t)y0 * src_pitch);
+
+	PoolByteArray::Write w = _buffer.write();
+	int len = _file->get_buffer(w.ptr(), count * src_pitch);
+	ERR_FAIL_COND_V(len != count * src_pitch, false);
+
+#ifdef BIG_ENDIAN_ENABLED
+	bool swap = !_settings.big_endian;
+#else
+	bool swap = _settings.big_endian;
+#endif
+
+	Point2i size(_settings.width, count);
+	float min_h = _settings.min_height;
+	float max_h = _settings.max_height;
+
+	switch (_settings.format) {
+		case SAMPLE_UINT8:
+			convert_rows<uint8_t>(w.ptr(), src_pitch, out, size, swap, min_h, max_h, 255.0);
+			break;
+		case SAMPLE_UINT16:
+			convert_rows<uint16_t>(w.ptr(), src_pitch, out, size, swap, min_h, max_h, 65535.0);
+			break;
+		case SAMPLE_UINT32:
+			convert_rows<uint32_t>(w.ptr(), src_pitch, out, size, swap, min_h, max_h, 4294967295.0);
+			break;
+		case SAMPLE_FLOAT32:
+			convert_rows<float>(w.ptr(), src_pitch, out, size, swap, min_h, max_h, 1.0);
+			break;
+		default:
+			ERR_FAIL_V(false);
+	}
+
+	return true;
+}
+
+HeightMapRawImporter::HeightMapRawImporter() {
+	_source = NULL;
+	_destination = NULL;
+	_block_count = 0;
+	_downscaled = false;
+}
+
+HeightMapRawImporter::~HeightMapRawImporter() {
+	close();
+}
+
+int HeightMapRawImporter::get_sample_size(SampleFormat format) {
+	switch (format) {
+		case SAMPLE_UINT8:
+			return 1;
+		case SAMPLE_UINT16:
+			return 2;
+		case SAMPLE_UINT32:
+		case SAMPLE_FLOAT32:
+			return 4;
+		default:
+			ERR_PRINT("Unknown sample format");
+			return 0;
+	}
+}
+
+Error HeightMapRawImporter::begin(const String &path, const Settings &settings, Ref<HeightMapData> data) {
+
+	close();
+	_downscaled = false;
+
+	ERR_FAIL_COND_V(data.is_null(), ERR_INVALID_PARAMETER);
+	ERR_FAIL_COND_V(settings.format < 0 || settings.format >= SAMPLE_FORMAT_COUNT, ERR_INVALID_PARAMETER);
+	ERR_FAIL_COND_V(settings.filter < 0 || settings.filter >= RESAMPLE_FILTER_COUNT, ERR_INVALID_PARAMETER);
+	ERR_FAIL_COND_V(settings.width <= 0 || settings.height <= 0, ERR_INVALID_PARAMETER);
+
+	Error err = OK;
+	FileAccess *f = FileAccess::open(path, FileAccess::READ, &err);
+	ERR_FAIL_COND_V(f == NULL, err);
+
+	uint64_t expected_len = (uint64_t)settings.width * settings.height * get_sample_size(settings.format);
+	if (f->get_len() < expected_len) {
+		f->close();
+		memdelete(f);
+		ERR_EXPLAIN("RAW file is smaller than the given size");
+		ERR_FAIL_V(ERR_FILE_CORRUPT);
+	}
+
+	_data = data;
+	_source = memnew(FileSource(f, settings));
+
+	// Note: resolution will be brought up to power of two + 1
+	int target_res = MAX(settings.width, settings.height);
+	if (target_res > HeightMapData::MAX_RESOLUTION) {
+		// Too big for a map, so it gets scaled down to the biggest one
+		print_line(String("RAW file is bigger than the maximum resolution {0}, scaling it down").format(varray(HeightMapData::MAX_RESOLUTION)));
+		target_res = HeightMapData::MAX_RESOLUTION;
+		_downscaled = true;
+	}
+	// Heights are all going to be replaced, resampling the old ones would be wasted
+	_data->set_resolution(target_res, false);
+	int res = _data->get_resolution();
+
+	Ref<Image> heights_ref = _data->get_image(HeightMapData::CHANNEL_HEIGHT);
+	ERR_FAIL_COND_V(heights_ref.is_null(), ERR_BUG);
+
+	// Both axes get the same scale so the file keeps its proportions.
+	// Its longest side spans the map, the rest gets filled with values at its edges.
+	int max_side = MAX(settings.width, settings.height);
+	float scale = max_side > 1 ? static_cast<float>(res - 1) / (max_side - 1) : 0;
+	Point2i covered_size(
+			CLAMP(Math::fast_ftoi((settings.width - 1) * scale) + 1, 1, res),
+			CLAMP(Math::fast_ftoi((settings.height - 1) * scale) + 1, 1, res));
+
+	_destination = memnew(ImageResampleDestination(**heights_ref, covered_size));
+
+	// Sizes that already match are just copied
+	ResampleFilter filter = settings.filter;
+	if (covered_size == Point2i(settings.width, settings.height))
+		filter = RESAMPLE_NEAREST;
+
+	_resampler.begin(*_source, *_destination, filter);
+	_block_count = _resampler.get_band_count();
+
+	return OK;
+}
+
+Error HeightMapRawImporter::import_block(int index) {
+
+	ERR_FAIL_COND_V(_source == NULL, ERR_UNCONFIGURED);
+	ERR_FAIL_INDEX_V(index, _block_count, ERR_INVALID_PARAMETER);
+
+	if (!_resampler.process_band(index))
+		return ERR_FILE_CORRUPT;
+
+	return OK;
+}
+
+void HeightMapRawImporter::end() {
+
+	ERR_FAIL_COND(_data.is_null());
+	close();
+
+	_data->update_all_normals();
+
+	int res = _data->get_resolution();
+	_data->notify_region_change(Point2i(0, 0), Point2i(res, res), HeightMapData::CHANNEL_HEIGHT);
+
+	_data.unref();
+}
+
+void HeightMapRawImporter::close() {
+
+	if (_source) {
+		memdelete(_source);
+		_source = NULL;
+	}
+
+	if (_destination) {
+		memdelete(_destination);
+		_destination = NULL;
+	}
+
+	_block_count = 0;
+}
@@ -0,0 +1,77 @@
+#ifndef HEIGHT_MAP_IMPORTER_H
+#define HEIGHT_MAP_IMPORTER_H
+
+#include <core/os/file_access.h>
+
+#include "height_map_data.h"
+#include "resampler.h"
+
+// Imports raw heightfields into the height channel of a map.
+// The file is read in blocks of rows, so any size can be imported without loading it all in memory,
+// and each block gets converted and resampled to the resolution of the map on all threads, keeping its proportions.
+// Blocks are imported one by one so the caller can report progress in between.
+class HeightMapRawImporter {
+public:
+	enum SampleFormat {
+		SAMPLE_UINT8 = 0,
+		SAMPLE_UINT16,
+		SAMPLE_UINT32,
+		SAMPLE_FLOAT32,
+		SAMPLE_FORMAT_COUNT
+	};
+
+	struct Settings {
+		SampleFormat format;
+		bool big_endian;
+		int width;
+		int height;
+		// Integer samples are mapped to this range, float samples are used as they are
+		float min_height;
+		float max_height;
+		// Used if the file doesn't exactly match the resolution of the map
+		ResampleFilter filter;
+
+		Settings();
+	};
+
+	HeightMapRawImporter();
+	~HeightMapRawImporter();
+
+	static int get_sample_size(SampleFormat format);
+
+	// Opens the file and resizes the map to fit it
+	Error begin(const String &path, const Settings &settings, Ref<HeightMapData> data);
+	int get_block_count() const { return _block_count; }
+	// True if the file was bigger than the maximum resolution of maps, so it gets scaled down to fit
+	bool is_downscaled() const { return _downscaled; }
+	Error import_block(int index);
+	// Updates the map once all blocks are imported
+	void end();
+
+private:
+	void close();
+
+private:
+	class FileSource : public ResampleSource {
+	public:
+		FileSource(FileAccess *file, const Settings &settings);
+		~FileSource();
+		Point2i get_size() const;
+		int get_channel_count() const { return 1; }
+		bool read_rows(int y0, int count, float *out);
+
+	private:
+		FileAccess *_file;
+		Settings _settings;
+		PoolByteArray _buffer;
+	};
+
+	Ref<HeightMapData> _data;
+	FileSource *_source;
+	ResampleDestination *_destination;
+	Resampler _resampler;
+	int _block_count;
+	bool _downscaled;
+};
+
+#endif // HEIGHT_MAP_IMPORTER_H
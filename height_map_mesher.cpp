@@ -53,33 +53,40 @@ Ref<Mesh> HeightMapMesher::make_flat_chunk(Point2i chunk_size, int stride, int s
 	return mesh_ref;
 }
 
-// size: chunk size in quads (there are N+1 vertices)
+// CHUNK_SIZE: chunk size in quads (there are N+1 vertices).
+// It is a template parameter so loops and index offsets get resolved at compile time.
 // seams: Bitfield for which seams are present
-PoolVector<int> HeightMapMesher::make_indices(Point2i chunk_size, unsigned int seams) {
-
-	Vector<int> output_indices;
+template <int CHUNK_SIZE>
+static void make_indices(Vector<int> &output_indices, unsigned int seams) {
 
 	// LOD seams can't be made properly on uneven chunk sizes
-	ERR_FAIL_COND_V(chunk_size.x % 2 != 0 || chunk_size.y % 2 != 0, PoolVector<int>());
+	ERR_FAIL_COND(CHUNK_SIZE % 2 != 0);
+
+	const Point2i chunk_size(CHUNK_SIZE, CHUNK_SIZE);
+
+	// Regular triangles plus seams can't be more than two triangles per quad
+	output_indices.clear();
+	output_indices.resize(CHUNK_SIZE * CHUNK_SIZE * 6);
+	int ii = 0;
 
 	Point2i reg_origin;
 	Point2i reg_size = chunk_size;
 	int reg_hstride = 1;
 
-	if(seams & SEAM_LEFT) {
+	if(seams & HeightMapMesher::SEAM_LEFT) {
 		reg_origin.x += 1;
 		reg_size.x -= 1;
 		++reg_hstride;
 	}
-	if(seams & SEAM_BOTTOM) {
+	if(seams & HeightMapMesher::SEAM_BOTTOM) {
 		reg_origin.y += 1;
 		reg_size.y -= 1;
 	}
-	if(seams & SEAM_RIGHT) {
+	if(seams & HeightMapMesher::SEAM_RIGHT) {
 		reg_size.x -= 1;
 		++reg_hstride;
 	}
-	if(seams & SEAM_TOP) {
+	if(seams & HeightMapMesher::SEAM_TOP) {
 		reg_size.y -= 1;
 	}
 
@@ -102,26 +109,26 @@ PoolVector<int> HeightMapMesher::make_indices(Point2i chunk_size, unsigned int s
 
 			// This flips the pattern to make the geometry orientation-free.
 			// Not sure if it helps in any way though
-			bool flip = ((pos.x + reg_origin.x) + (pos.y + reg_origin.y) % 2) % 2 != 0;
+			bool flip = is_cell_flipped(pos.x + reg_origin.x, pos.y + reg_origin.y);
 
 			if(flip) {
 
-				output_indices.push_back( i00 );
-				output_indices.push_back( i10 );
-				output_indices.push_back( i01 );
+				output_indices[ii++] = i00;
+				output_indices[ii++] = i10;
+				output_indices[ii++] = i01;
 
-				output_indices.push_back( i10 );
-				output_indices.push_back( i11 );
-				output_indices.push_back( i01 );
+				output_indices[ii++] = i10;
+				output_indices[ii++] = i11;
+				output_indices[ii++] = i01;
 
 			} else {
-				output_indices.push_back( i00 );
-				output_indices.push_back( i11 );
-				output_indices.push_back( i01 );
+				output_indices[ii++] = i00;
+				output_indices[ii++] = i11;
+				output_indices[ii++] = i01;
 
-				output_indices.push_back( i00 );
-				output_indices.push_back( i10 );
-				output_indices.push_back( i11 );
+				output_indices[ii++] = i00;
+				output_indices[ii++] = i10;
+				output_indices[ii++] = i11;
 			}
 
 			++i;
@@ -130,7 +137,7 @@ PoolVector<int> HeightMapMesher::make_indices(Point2i chunk_size, unsigned int s
 	}
 
 	// Left seam
-	if(seams & SEAM_LEFT) {
+	if(seams & HeightMapMesher::SEAM_LEFT) {
 
 		//     4 . 5
 		//     |\  .
@@ -153,27 +160,27 @@ PoolVector<int> HeightMapMesher::make_indices(Point2i chunk_size, unsigned int s
 			int i4 = i + 2 * (chunk_size.x + 1);
 			int i5 = i4 + 1;
 
-			output_indices.push_back( i0 );
-			output_indices.push_back( i3 );
-			output_indices.push_back( i4 );
+			output_indices[ii++] = i0;
+			output_indices[ii++] = i3;
+			output_indices[ii++] = i4;
 
-			if(j != 0 || (seams & SEAM_BOTTOM) == 0) {
-				output_indices.push_back( i0 );
-				output_indices.push_back( i1 );
-				output_indices.push_back( i3 );
+			if(j != 0 || (seams & HeightMapMesher::SEAM_BOTTOM) == 0) {
+				output_indices[ii++] = i0;
+				output_indices[ii++] = i1;
+				output_indices[ii++] = i3;
 			}
 
-			if(j != n-1 || (seams & SEAM_TOP) == 0) {
-				output_indices.push_back( i3 );
-				output_indices.push_back( i5 );
-				output_indices.push_back( i4 );
+			if(j != n-1 || (seams & HeightMapMesher::SEAM_TOP) == 0) {
+				output_indices[ii++] = i3;
+				output_indices[ii++] = i5;
+				output_indices[ii++] = i4;
 			}
 
 			i = i4;
 		}
 	}
 
-	if(seams & SEAM_RIGHT) {
+	if(seams & HeightMapMesher::SEAM_RIGHT) {
 
 		//     4 . 5
 		//     .  /|
@@ -196,27 +203,27 @@ PoolVector<int> HeightMapMesher::make_indices(Point2i chunk_size, unsigned int s
 			int i4 = i + 2 * (chunk_size.x + 1);
 			int i5 = i4 + 1;
 
-			output_indices.push_back( i1 );
-			output_indices.push_back( i5 );
-			output_indices.push_back( i2 );
+			output_indices[ii++] = i1;
+			output_indices[ii++] = i5;
+			output_indices[ii++] = i2;
 
-			if(j != 0 || (seams & SEAM_BOTTOM) == 0) {
-				output_indices.push_back( i0 );
-				output_indices.push_back( i1 );
-				output_indices.push_back( i2 );
+			if(j != 0 || (seams & HeightMapMesher::SEAM_BOTTOM) == 0) {
+				output_indices[ii++] = i0;
+				output_indices[ii++] = i1;
+				output_indices[ii++] = i2;
 			}
 
-			if(j != n-1 || (seams & SEAM_TOP) == 0) {
-				output_indices.push_back( i2 );
-				output_indices.push_back( i5 );
-				output_indices.push_back( i4 );
+			if(j != n-1 || (seams & HeightMapMesher::SEAM_TOP) == 0) {
+				output_indices[ii++] = i2;
+				output_indices[ii++] = i5;
+				output_indices[ii++] = i4;
 			}
 
 			i = i4;
 		}
 	}
 
-	if(seams & SEAM_BOTTOM) {
+	if(seams & HeightMapMesher::SEAM_BOTTOM) {
 
 		//  3 . 4 . 5
 		//  .  / \  .
@@ -236,27 +243,27 @@ PoolVector<int> HeightMapMesher::make_indices(Point2i chunk_size, unsigned int s
 			int i4 = i3 + 1;
 			int i5 = i4 + 1;
 
-			output_indices.push_back( i0 );
-			output_indices.push_back( i2 );
-			output_indices.push_back( i4 );
+			output_indices[ii++] = i0;
+			output_indices[ii++] = i2;
+			output_indices[ii++] = i4;
 
-			if(j != 0 || (seams & SEAM_LEFT) == 0) {
-				output_indices.push_back( i0 );
-				output_indices.push_back( i4 );
-				output_indices.push_back( i3 );
+			if(j != 0 || (seams & HeightMapMesher::SEAM_LEFT) == 0) {
+				output_indices[ii++] = i0;
+				output_indices[ii++] = i4;
+				output_indices[ii++] = i3;
 			}
 
-			if(j != n-1 || (seams & SEAM_RIGHT) == 0) {
-				output_indices.push_back( i2 );
-				output_indices.push_back( i5 );
-				output_indices.push_back( i4 );
+			if(j != n-1 || (seams & HeightMapMesher::SEAM_RIGHT) == 0) {
+				output_indices[ii++] = i2;
+				output_indices[ii++] = i5;
+				output_indices[ii++] = i4;
 			}
 
 			i = i2;
 		}
 	}
 
-	if(seams & SEAM_TOP) {
+	if(seams & HeightMapMesher::SEAM_TOP) {
 
 		//     (4)
 		//  3-------5
@@ -276,28 +283,53 @@ PoolVector<int> HeightMapMesher::make_indices(Point2i chunk_size, unsigned int s
 			int i3 = i + chunk_size.x + 1;
 			int i5 = i3 + 2;
 
-			output_indices.push_back( i3 );
-			output_indices.push_back( i1 );
-			output_indices.push_back( i5 );
+			output_indices[ii++] = i3;
+			output_indices[ii++] = i1;
+			output_indices[ii++] = i5;
 
-			if(j != 0 || (seams & SEAM_LEFT) == 0) {
-				output_indices.push_back( i0 );
-				output_indices.push_back( i1 );
-				output_indices.push_back( i3 );
+			if(j != 0 || (seams & HeightMapMesher::SEAM_LEFT) == 0) {
+				output_indices[ii++] = i0;
+				output_indices[ii++] = i1;
+				output_indices[ii++] = i3;
 			}
 
-			if(j != n-1 || (seams & SEAM_RIGHT) == 0) {
-				output_indices.push_back( i1 );
-				output_indices.push_back( i2 );
-				output_indices.push_back( i5 );
+			if(j != n-1 || (seams & HeightMapMesher::SEAM_RIGHT) == 0) {
+				output_indices[ii++] = i1;
+				output_indices[ii++] = i2;
+				output_indices[ii++] = i5;
 			}
 
 			i = i2;
 		}
 	}
 
+	output_indices.resize(ii);
+}
+
+struct MakeIndicesAction {
+	unsigned int seams;
+	Vector<int> output;
+
+	MakeIndicesAction(unsigned int p_seams) : seams(p_seams) {}
+
+	template <int CHUNK_SIZE>
+	void process() {
+		make_indices<CHUNK_SIZE>(output, seams);
+	}
+};
+
+PoolVector<int> HeightMapMesher::make_indices(Point2i chunk_size, unsigned int seams) {
+
+	ERR_FAIL_COND_V(chunk_size.x != chunk_size.y, PoolVector<int>());
+
+	MakeIndicesAction action(seams);
+	if (!dispatch_chunk_size(chunk_size.x, action)) {
+		ERR_PRINT("Unsupported chunk size");
+		return PoolVector<int>();
+	}
+
 	PoolVector<int> indices;
-	copy_to(indices, output_indices);
+	copy_to(indices, action.output);
 	return indices;
 }
 
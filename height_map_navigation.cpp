@@ -0,0 +1,276 @@
+#include "height_map_navigation.h"
+#include "utility.h"
+
+#define DEFAULT_MAX_SLOPE (Math_PI / 4.0)
+
+HeightMapNavigation::HeightMapNavigation() {
+	_navigation = NULL;
+	_owner = NULL;
+	_max_slope = DEFAULT_MAX_SLOPE;
+}
+
+HeightMapNavigation::~HeightMapNavigation() {
+	clear();
+}
+
+void HeightMapNavigation::set_navigation(Navigation *navigation, const Transform &transform) {
+
+	if (navigation == _navigation) {
+		set_transform(transform);
+		return;
+	}
+
+	for (int i = 0; i < _tiles.area(); ++i) {
+		unregister_tile(_tiles[i]);
+	}
+
+	_navigation = navigation;
+	_transform = transform;
+
+	for (int i = 0; i < _tiles.area(); ++i) {
+		register_tile(_tiles[i]);
+	}
+}
+
+void HeightMapNavigation::set_transform(const Transform &transform) {
+
+	// Slopes depend on scale
+	if (transform.basis.get_scale() != _transform.basis.get_scale())
+		set_all_dirty();
+
+	_transform = transform;
+
+	if (_navigation == NULL)
+		return;
+
+	for (int i = 0; i < _tiles.area(); ++i) {
+		const Tile &tile = _tiles[i];
+		if (tile.navmesh_id != -1)
+			_navigation->navmesh_set_transform(tile.navmesh_id, _transform);
+	}
+}
+
+void HeightMapNavigation::set_owner(Object *owner) {
+	_owner = owner;
+}
+
+void HeightMapNavigation::set_max_slope(float radians) {
+
+	radians = CLAMP(radians, 0, Math_PI / 2.0);
+	if (radians == _max_slope)
+		return;
+
+	_max_slope = radians;
+	set_all_dirty();
+}
+
+void HeightMapNavigation::set_area_dirty(Point2i origin_in_cells, Point2i size_in_cells) {
+
+	if (_tiles.area() == 0)
+		return;
+
+	// Tiles share their edges
+	Point2i tmin((origin_in_cells.x - 1) / TILE_SIZE, (origin_in_cells.y - 1) / TILE_SIZE);
+	Point2i tmax((origin_in_cells.x + size_in_cells.x - 1) / TILE_SIZE + 1, (origin_in_cells.y + size_in_cells.y - 1) / TILE_SIZE + 1);
+	clamp_min_max_excluded(tmin, tmax, Point2i(0, 0), _tiles.size());
+
+	for (int ty = tmin.y; ty < tmax.y; ++ty) {
+		for (int tx = tmin.x; tx < tmax.x; ++tx) {
+			_tiles[_tiles.index(tx, ty)].dirty = true;
+		}
+	}
+}
+
+void HeightMapNavigation::set_all_dirty() {
+	for (int i = 0; i < _tiles.area(); ++i) {
+		_tiles[i].dirty = true;
+	}
+}
+
+void HeightMapNavigation::clear() {
+
+	for (int i = 0; i < _tiles.area(); ++i) {
+
+		Tile &tile = _tiles[i];
+
+		if (tile.task) {
+			ThreadPool::get_singleton()->dequeue_or_wait(tile.task);
+			memdelete(tile.task);
+			tile.task = NULL;
+		}
+
+		unregister_tile(tile);
+	}
+
+	_tiles.resize(Point2i(0, 0), false);
+}
+
+void HeightMapNavigation::update(const HeightMapData &data) {
+
+	int res = data.get_resolution();
+	if (res == 0)
+		return;
+
+	Point2i tiles_size((res - 1) / TILE_SIZE, (res - 1) / TILE_SIZE);
+	if (_tiles.size() != tiles_size) {
+		clear();
+		_tiles.resize(tiles_size, false);
+	}
+
+	ThreadPool &pool = *ThreadPool::get_singleton();
+
+	for (int ty = 0; ty < tiles_size.y; ++ty) {
+		for (int tx = 0; tx < tiles_size.x; ++tx) {
+
+			Tile &tile = _tiles[_tiles.index(tx, ty)];
+
+			if (tile.task && pool.is_done(tile.task)) {
+				finish_task(tile);
+			}
+
+			// If the tile changes again while building, it will start over once that's done
+			if (tile.dirty && tile.task == NULL) {
+				start_task(tile, Point2i(tx, ty), data);
+			}
+		}
+	}
+}
+
+void HeightMapNavigation::start_task(Tile &tile, Point2i tpos, const HeightMapData &data) {
+
+	// Heights are read from a snapshot so the map can keep being edited meanwhile.
+	// The mask has none, but the part under one tile is small enough to be copied.
+	Ref<HeightMapSnapshot> snapshot = data.get_height_snapshot();
+	ERR_FAIL_COND(snapshot.is_null());
+
+	Ref<Image> mask_ref = data.get_image(HeightMapData::CHANNEL_MASK);
+	ERR_FAIL_COND(mask_ref.is_null());
+
+	BuildTask *task = memnew(BuildTask);
+	task->snapshot = snapshot;
+	task->origin = tpos * TILE_SIZE;
+	// Slopes are measured in the space of the navigation, which may stretch terrain
+	task->scale = _transform.basis.get_scale();
+	task->min_normal_y = Math::cos(_max_slope);
+
+	{
+		ImageRawView<uint8_t> mask(**mask_ref);
+		task->mask.resize(TILE_SIZE * TILE_SIZE);
+		PoolByteArray::Write w = task->mask.write();
+
+		for (int y = 0; y < TILE_SIZE; ++y) {
+			copymem(w.ptr() + y * TILE_SIZE, mask.row(task->origin.y + y) + task->origin.x, TILE_SIZE);
+		}
+	}
+
+	tile.task = task;
+	tile.dirty = false;
+
+	ThreadPool::get_singleton()->enqueue(task);
+}
+
+void HeightMapNavigation::BuildTask::run() {
+
+	const int vs = TILE_SIZE + 1;
+	const HeightMapSnapshot &s = **snapshot;
+
+	// All vertices of the tile are output, even if some don't end up in a triangle.
+	// That's cheaper than remapping indices, and Navigation only looks at polygons.
+	vertices.resize(vs * vs);
+	{
+		PoolVector3Array::Write w = vertices.write();
+		int i = 0;
+		for (int y = 0; y < vs; ++y) {
+			for (int x = 0; x < vs; ++x) {
+				w[i++] = Vector3(origin.x + x, s.get_height(origin.x + x, origin.y + y), origin.y + y);
+			}
+		}
+	}
+
+	PoolVector3Array::Read vr = vertices.read();
+	PoolByteArray::Read mr = mask.read();
+
+	Vector<int> triangles;
+
+	for (int y = 0; y < TILE_SIZE; ++y) {
+		for (int x = 0; x < TILE_SIZE; ++x) {
+
+			// Same threshold as the default shader
+			if (mr[y * TILE_SIZE + x] > 127)
+				continue;
+
+			int i00 = x + y * vs;
+			int i10 = i00 + 1;
+			int i01 = i00 + vs;
+			int i11 = i01 + 1;
+
+			// Same triangles as the mesh
+			const int corners[4] = { i00, i10, i01, i11 };
+			const int *cell_triangles = get_cell_triangles(origin.x + x, origin.y + y);
+
+			for (int t = 0; t < 6; t += 3) {
+
+				int tri[3] = { corners[cell_triangles[t]], corners[cell_triangles[t + 1]], corners[cell_triangles[t + 2]] };
+				Vector3 a = vr[tri[0]] * scale;
+				Vector3 b = vr[tri[1]] * scale;
+				Vector3 c = vr[tri[2]] * scale;
+
+				Vector3 n = (b - a).cross(c - a).normalized();
+				if (Math::abs(n.y) < min_normal_y)
+					continue;
+
+				triangles.push_back(tri[0]);
+				triangles.push_back(tri[1]);
+				triangles.push_back(tri[2]);
+			}
+		}
+	}
+
+	copy_to(indices, triangles);
+}
+
+void HeightMapNavigation::finish_task(Tile &tile) {
+
+	ERR_FAIL_COND(tile.task == NULL);
+	BuildTask *task = tile.task;
+
+	unregister_tile(tile);
+	tile.navmesh.unref();
+
+	if (task->indices.size() != 0) {
+
+		Ref<NavigationMesh> navmesh;
+		navmesh.instance();
+		navmesh->set_vertices(task->vertices);
+
+		PoolIntArray::Read r = task->indices.read();
+		Vector<int> polygon;
+		polygon.resize(3);
+
+		for (int i = 0; i < task->indices.size(); i += 3) {
+			polygon[0] = r[i];
+			polygon[1] = r[i + 1];
+			polygon[2] = r[i + 2];
+			navmesh->add_polygon(polygon);
+		}
+
+		tile.navmesh = navmesh;
+		register_tile(tile);
+	}
+
+	memdelete(task);
+	tile.task = NULL;
+}
+
+void HeightMapNavigation::register_tile(Tile &tile) {
+	if (_navigation && tile.navmesh.is_valid() && tile.navmesh_id == -1)
+		tile.navmesh_id = _navigation->navmesh_create(tile.navmesh, _transform, _owner);
+}
+
+void HeightMapNavigation::unregister_tile(Tile &tile) {
+	if (tile.navmesh_id != -1) {
+		if (_navigation)
+			_navigation->navmesh_remove(tile.navmesh_id);
+		tile.navmesh_id = -1;
+	}
+}
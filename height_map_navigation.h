@@ -0,0 +1,83 @@
+#ifndef HEIGHT_MAP_NAVIGATION_H
+#define HEIGHT_MAP_NAVIGATION_H
+
+#include <scene/3d/navigation.h>
+
+#include "height_map_data.h"
+#include "thread_pool.h"
+
+// Navigation meshes made of walkable terrain triangles, split in tiles registered separately in a Navigation node.
+// Triangles too steep or over holes are left out.
+// When terrain changes, only tiles under the changed area are rebuilt, in background threads.
+class HeightMapNavigation {
+public:
+	// Size of a tile in cells
+	enum { TILE_SIZE = 64 };
+
+	HeightMapNavigation();
+	~HeightMapNavigation();
+
+	// Tiles get registered in this navigation, with the transform of the terrain relative to it.
+	// Setting it to NULL unregisters them.
+	void set_navigation(Navigation *navigation, const Transform &transform);
+	Navigation *get_navigation() const { return _navigation; }
+	void set_transform(const Transform &transform);
+
+	// Object reported as owner of the navigation meshes
+	void set_owner(Object *owner);
+
+	// Steepest walkable slope, in radians
+	void set_max_slope(float radians);
+	float get_max_slope() const { return _max_slope; }
+
+	void set_area_dirty(Point2i origin_in_cells, Point2i size_in_cells);
+
+	// Call this every frame, it starts building dirty tiles and registers those that are done
+	void update(const HeightMapData &data);
+
+	// Removes all tiles, needed when the map is resized
+	void clear();
+
+private:
+	class BuildTask : public ThreadPool::Task {
+	public:
+		// Input
+		Ref<HeightMapSnapshot> snapshot;
+		PoolByteArray mask;
+		Point2i origin;
+		Vector3 scale;
+		float min_normal_y;
+
+		// Output
+		PoolVector3Array vertices;
+		PoolIntArray indices;
+
+		BuildTask() : min_normal_y(0) {}
+		void run();
+	};
+
+	struct Tile {
+		Ref<NavigationMesh> navmesh;
+		int navmesh_id;
+		BuildTask *task;
+		bool dirty;
+
+		Tile() : navmesh_id(-1), task(NULL), dirty(true) {}
+	};
+
+	void start_task(Tile &tile, Point2i tpos, const HeightMapData &data);
+	void finish_task(Tile &tile);
+	void register_tile(Tile &tile);
+	void unregister_tile(Tile &tile);
+	void set_all_dirty();
+
+private:
+	Navigation *_navigation;
+	Transform _transform;
+	Object *_owner;
+	float _max_slope;
+
+	Grid2D<Tile> _tiles;
+};
+
+#endif // HEIGHT_MAP_NAVIGATION_H
@@ -0,0 +1,275 @@
+#include "height_map_occlusion_culler.h"
+#include "utility.h"
+
+#define DEFAULT_OCCLUDER_SIZE 32
+#define DEFAULT_HORIZON_RESOLUTION 512
+
+// How it works:
+//
+// Seen from above, the viewer is surrounded by a horizon, divided in angular sections.
+// Each section stores the highest slope (height over distance) at which terrain is known to be in the way.
+//
+//            ^ slope
+//            |       ____
+//     eye -> o    __/    \     ?    <- everything under the horizon line is hidden
+//            |___/        \___/ \__
+//            +------------------------> distance
+//
+// Terrain blocks are processed from near to far. A block's lowest height is a guarantee that
+// terrain is at least that high over the whole block, so it can raise the horizon.
+// A region is hidden if its highest point is under the horizon in all the sections it spans,
+// considering only blocks that are entirely closer than it.
+
+HeightMapOcclusionCuller::HeightMapOcclusionCuller() {
+	_occluder_size = DEFAULT_OCCLUDER_SIZE;
+	_resolution = 0;
+	_horizon.resize(DEFAULT_HORIZON_RESOLUTION);
+	clear();
+}
+
+void HeightMapOcclusionCuller::set_occluder_size(int size) {
+	ERR_FAIL_COND(size < HeightMapData::VERTICAL_BOUNDS_CHUNK_SIZE);
+	if (size != _occluder_size) {
+		_occluder_size = size;
+		clear();
+	}
+}
+
+void HeightMapOcclusionCuller::set_horizon_resolution(int resolution) {
+	ERR_FAIL_COND(resolution < 4);
+	_horizon.resize(resolution);
+}
+
+void HeightMapOcclusionCuller::clear() {
+	_occluders.resize(Point2i(0, 0), false);
+	_resolution = 0;
+	_dirty_min = Point2i(0, 0);
+	_dirty_max = Point2i(0, 0);
+}
+
+void HeightMapOcclusionCuller::set_area_dirty(Point2i origin_in_cells, Point2i size_in_cells) {
+
+	Point2i max = origin_in_cells + size_in_cells;
+
+	if (_dirty_min.x >= _dirty_max.x || _dirty_min.y >= _dirty_max.y) {
+		_dirty_min = origin_in_cells;
+		_dirty_max = max;
+		return;
+	}
+
+	_dirty_min.x = MIN(_dirty_min.x, origin_in_cells.x);
+	_dirty_min.y = MIN(_dirty_min.y, origin_in_cells.y);
+	_dirty_max.x = MAX(_dirty_max.x, max.x);
+	_dirty_max.y = MAX(_dirty_max.y, max.y);
+}
+
+void HeightMapOcclusionCuller::update_occluders(const HeightMapData &data) {
+
+	int res = data.get_resolution();
+
+	if (res != _resolution) {
+		_resolution = res;
+		_occluders.resize(Point2i(res, res) / _occluder_size, false);
+		_dirty_min = Point2i(0, 0);
+		_dirty_max = Point2i(res, res);
+	}
+
+	if (_dirty_min.x >= _dirty_max.x || _dirty_min.y >= _dirty_max.y)
+		return;
+
+	Point2i cmin = _dirty_min / _occluder_size;
+	Point2i cmax = (_dirty_max - Point2i(1, 1)) / _occluder_size + Point2i(1, 1);
+	_occluders.clamp_min_max_excluded(cmin, cmax);
+
+	const Point2i size(_occluder_size, _occluder_size);
+
+	for (int y = cmin.y; y < cmax.y; ++y) {
+		for (int x = cmin.x; x < cmax.x; ++x) {
+
+			Occluder o;
+			o.origin = Point2i(x, y) * _occluder_size;
+			o.size = size;
+			o.min_height = data.get_region_aabb(o.origin, size).position.y;
+			// Holes let the view through
+			o.solid = data.get_region_mask_state(o.origin, size) == HeightMapData::MASK_SOLID;
+
+			_occluders.set(x, y, o);
+		}
+	}
+
+	_dirty_min = Point2i(0, 0);
+	_dirty_max = Point2i(0, 0);
+}
+
+static inline float wrap_angle(float a) {
+	while (a > Math_PI)
+		a -= Math_PI * 2.0;
+	while (a < -Math_PI)
+		a += Math_PI * 2.0;
+	return a;
+}
+
+// Returns false if the viewer is above the region, in which case it can neither occlude nor be occluded
+bool HeightMapOcclusionCuller::get_arc_and_distances(Point2i origin, Point2i size, Vector2 viewer_pos, Arc &out_arc, float &out_dmin, float &out_dmax) {
+
+	Vector2 min(origin.x, origin.y);
+	Vector2 max(origin.x + size.x, origin.y + size.y);
+
+	Vector2 closest(
+			CLAMP(viewer_pos.x, min.x, max.x),
+			CLAMP(viewer_pos.y, min.y, max.y));
+
+	out_dmin = closest.distance_to(viewer_pos);
+	if (out_dmin < CMP_EPSILON)
+		return false;
+
+	Vector2 corners[4] = {
+		min,
+		Vector2(max.x, min.y),
+		Vector2(min.x, max.y),
+		max
+	};
+
+	Vector2 center = (min + max) * 0.5 - viewer_pos;
+	float center_angle = Math::atan2(center.y, center.x);
+
+	// The viewer is outside of the rectangle, so the arc is less than a half-turn
+	float dmin_angle = 0;
+	float dmax_angle = 0;
+	out_dmax = 0;
+
+	for (int i = 0; i < 4; ++i) {
+		Vector2 rc = corners[i] - viewer_pos;
+		float d = wrap_angle(Math::atan2(rc.y, rc.x) - center_angle);
+		dmin_angle = MIN(dmin_angle, d);
+		dmax_angle = MAX(dmax_angle, d);
+		out_dmax = MAX(out_dmax, rc.length());
+	}
+
+	out_arc.min_angle = center_angle + dmin_angle;
+	out_arc.max_angle = center_angle + dmax_angle;
+	return true;
+}
+
+void HeightMapOcclusionCuller::add_occluder(const Arc &arc, float slope) {
+
+	const int n = _horizon.size();
+	const float section_angle = Math_PI * 2.0 / n;
+
+	// Only sections entirely covered by the occluder, because the horizon must hold for the whole section
+	int begin = static_cast<int>(Math::ceil((arc.min_angle + Math_PI) / section_angle));
+	int end = static_cast<int>(Math::floor((arc.max_angle + Math_PI) / section_angle));
+
+	for (int i = begin; i < end; ++i) {
+		int si = ((i % n) + n) % n;
+		if (slope > _horizon[si])
+			_horizon[si] = slope;
+	}
+}
+
+bool HeightMapOcclusionCuller::is_below_horizon(const Arc &arc, float slope) const {
+
+	const int n = _horizon.size();
+	const float section_angle = Math_PI * 2.0 / n;
+
+	// All sections touched by the occludee
+	int begin = static_cast<int>(Math::floor((arc.min_angle + Math_PI) / section_angle));
+	int end = static_cast<int>(Math::floor((arc.max_angle + Math_PI) / section_angle)) + 1;
+
+	for (int i = begin; i < end; ++i) {
+		int si = ((i % n) + n) % n;
+		if (_horizon[si] <= slope)
+			return false;
+	}
+
+	return true;
+}
+
+void HeightMapOcclusionCuller::cull(const HeightMapData &data, Vector3 viewer_pos, Vector<Occludee> &occludees) {
+
+	if (data.get_resolution() == 0)
+		return;
+
+	update_occluders(data);
+
+	const Vector2 viewer_pos_2d(viewer_pos.x, viewer_pos.z);
+	const float eye = viewer_pos.y;
+
+	// Sort occludees from near to far.
+	// Their highest slope is either at their nearest or farthest point.
+
+	_sorted_occludees.clear();
+	float max_occludee_distance = 0;
+
+	for (int i = 0; i < occludees.size(); ++i) {
+
+		Occludee &o = occludees[i];
+		o.occluded = false;
+
+		Candidate c;
+		float dmax;
+		if (!get_arc_and_distances(o.origin, o.size, viewer_pos_2d, c.arc, c.distance, dmax)) {
+			// Never occluded
+			continue;
+		}
+
+		float h = o.max_height - eye;
+		c.slope = h >= 0 ? h / c.distance : h / dmax;
+		c.index = i;
+
+		_sorted_occludees.push_back(c);
+		max_occludee_distance = MAX(max_occludee_distance, c.distance);
+	}
+
+	_sorted_occludees.sort();
+
+	// Sort occluders from near to far, by their farthest point.
+	// Terrain is at least at min_height everywhere in a block,
+	// so its lowest slope is either at its nearest or farthest point.
+	// Occluders farther than every occludee are useless.
+
+	_sorted_occluders.clear();
+
+	for (int i = 0; i < _occluders.area(); ++i) {
+
+		const Occluder &o = _occluders[i];
+		if (!o.solid)
+			continue;
+
+		Candidate c;
+		float dmin;
+		if (!get_arc_and_distances(o.origin, o.size, viewer_pos_2d, c.arc, dmin, c.distance))
+			continue;
+		if (c.distance > max_occludee_distance)
+			continue;
+
+		float h = o.min_height - eye;
+		c.slope = h >= 0 ? h / c.distance : h / dmin;
+		c.index = i;
+
+		_sorted_occluders.push_back(c);
+	}
+
+	_sorted_occluders.sort();
+
+	// Rasterize the horizon progressively, so each occludee is only tested against blocks entirely in front of it
+
+	for (int i = 0; i < _horizon.size(); ++i) {
+		_horizon[i] = -1e20;
+	}
+
+	int next_occluder = 0;
+
+	for (int i = 0; i < _sorted_occludees.size(); ++i) {
+
+		const Candidate &occludee = _sorted_occludees[i];
+
+		while (next_occluder < _sorted_occluders.size() && _sorted_occluders[next_occluder].distance <= occludee.distance) {
+			const Candidate &occluder = _sorted_occluders[next_occluder];
+			add_occluder(occluder.arc, occluder.slope);
+			++next_occluder;
+		}
+
+		occludees[occludee.index].occluded = is_below_horizon(occludee.arc, occludee.slope);
+	}
+}
@@ -0,0 +1,91 @@
+#ifndef HEIGHT_MAP_OCCLUSION_CULLER_H
+#define HEIGHT_MAP_OCCLUSION_CULLER_H
+
+#include <core/math/vector3.h>
+#include <core/vector.h>
+
+#include "height_map_data.h"
+
+// Hides terrain regions that are behind ridges, from the point of view of a viewer.
+// It rasterizes a coarse horizon around the viewer using cached vertical bounds,
+// and doesn't depend on the scene or the renderer, so it gives the same results for the same data and viewer positions.
+// All coordinates are in terrain space, where one unit is one cell.
+class HeightMapOcclusionCuller {
+public:
+	struct Occludee {
+		Point2i origin;
+		Point2i size;
+		float max_height;
+		bool occluded;
+
+		Occludee() : max_height(0), occluded(false) {}
+	};
+
+	HeightMapOcclusionCuller();
+
+	// Size of the blocks used as occluders, in cells.
+	// Smaller blocks occlude better but cost more to process.
+	void set_occluder_size(int size);
+	int get_occluder_size() const { return _occluder_size; }
+
+	// How many angular sections the horizon has around the viewer
+	void set_horizon_resolution(int resolution);
+	int get_horizon_resolution() const { return _horizon.size(); }
+
+	void clear();
+
+	// Must be called when heights or mask changed in this area
+	void set_area_dirty(Point2i origin_in_cells, Point2i size_in_cells);
+
+	// Sets the `occluded` flag of each occludee
+	void cull(const HeightMapData &data, Vector3 viewer_pos, Vector<Occludee> &occludees);
+
+private:
+	struct Occluder {
+		Point2i origin;
+		Point2i size;
+		float min_height;
+		bool solid;
+
+		Occluder() : min_height(0), solid(false) {}
+	};
+
+	struct Arc {
+		float min_angle;
+		float max_angle;
+	};
+
+	// Occluder or occludee, as seen from the viewer
+	struct Candidate {
+		Arc arc;
+		float distance;
+		float slope;
+		int index;
+
+		inline bool operator<(const Candidate &other) const {
+			return distance < other.distance;
+		}
+	};
+
+	void update_occluders(const HeightMapData &data);
+
+	static bool get_arc_and_distances(Point2i origin, Point2i size, Vector2 viewer_pos, Arc &out_arc, float &out_dmin, float &out_dmax);
+	void add_occluder(const Arc &arc, float slope);
+	bool is_below_horizon(const Arc &arc, float slope) const;
+
+private:
+	int _occluder_size;
+
+	Grid2D<Occluder> _occluders;
+	Point2i _dirty_min;
+	Point2i _dirty_max;
+	int _resolution;
+
+	// Highest slope of terrain seen so far in each direction
+	Vector<float> _horizon;
+
+	Vector<Candidate> _sorted_occluders;
+	Vector<Candidate> _sorted_occludees;
+};
+
+#endif // HEIGHT_MAP_OCCLUSION_CULLER_H
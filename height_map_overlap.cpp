@@ -0,0 +1,288 @@
+#include <core/math/face3.h>
+#include <core/math/geometry.h>
+
+#include "height_map_overlap.h"
+
+namespace {
+
+const real_t AXIS_EPSILON = 0.00001;
+
+// Same triangles as the mesh, so depths are measured from what is rendered.
+// Returns the highest corner of the cell.
+inline real_t get_cell_faces(const HeightMapSnapshot &heights, int x, int y, Face3 out_faces[2]) {
+
+	const Vector3 corners[4] = {
+		Vector3(x, heights.get_height(x, y), y),
+		Vector3(x + 1, heights.get_height(x + 1, y), y),
+		Vector3(x, heights.get_height(x, y + 1), y + 1),
+		Vector3(x + 1, heights.get_height(x + 1, y + 1), y + 1)
+	};
+
+	const int *triangles = get_cell_triangles(x, y);
+	out_faces[0] = Face3(corners[triangles[0]], corners[triangles[1]], corners[triangles[2]]);
+	out_faces[1] = Face3(corners[triangles[3]], corners[triangles[4]], corners[triangles[5]]);
+
+	return MAX(MAX(corners[0].y, corners[1].y), MAX(corners[2].y, corners[3].y));
+}
+
+inline bool is_inside_map(const HeightMapSnapshot &heights, Vector3 p) {
+	return p.x >= 0 && p.z >= 0 && p.x <= heights.get_resolution() - 1 && p.z <= heights.get_resolution() - 1;
+}
+
+// Height of the triangulated surface, split the same way as the mesh
+real_t get_surface_height(const HeightMapSnapshot &heights, real_t x, real_t z) {
+
+	int x0 = CLAMP(static_cast<int>(Math::floor(x)), 0, heights.get_resolution() - 2);
+	int z0 = CLAMP(static_cast<int>(Math::floor(z)), 0, heights.get_resolution() - 2);
+
+	real_t xf = CLAMP(x - x0, 0, 1);
+	real_t zf = CLAMP(z - z0, 0, 1);
+
+	return get_cell_surface_height(
+			heights.get_height(x0, z0), heights.get_height(x0 + 1, z0),
+			heights.get_height(x0, z0 + 1), heights.get_height(x0 + 1, z0 + 1),
+			xf, zf, is_cell_flipped(x0, z0));
+}
+
+// Gets cells under an area, and the vertical range of terrain there.
+// Returns false if the area is outside the map.
+bool get_footprint(
+		const HeightMapSnapshot &heights,
+		Vector3 min, Vector3 max,
+		Point2i &out_cmin, Point2i &out_cmax, real_t &out_hmin, real_t &out_hmax) {
+
+	out_cmin = Point2i(Math::floor(min.x), Math::floor(min.z));
+	out_cmax = Point2i(Math::floor(max.x) + 1, Math::floor(max.z) + 1);
+	int res = heights.get_resolution();
+	clamp_min_max_excluded(out_cmin, out_cmax, Point2i(0, 0), Point2i(res - 1, res - 1));
+
+	if (out_cmin.x >= out_cmax.x || out_cmin.y >= out_cmax.y)
+		return false;
+
+	const int bs = HeightMapSnapshot::BOUNDS_BLOCK_SIZE;
+	Point2i bmin = out_cmin / bs;
+	Point2i bmax = (out_cmax - Point2i(1, 1)) / bs + Point2i(1, 1);
+	clamp_min_max_excluded(bmin, bmax, Point2i(0, 0), heights.get_bounds_size());
+
+	out_hmin = heights.get_bounds(bmin).min;
+	out_hmax = heights.get_bounds(bmin).max;
+
+	for (int y = bmin.y; y < bmax.y; ++y) {
+		for (int x = bmin.x; x < bmax.x; ++x) {
+			HeightMapSnapshot::Bounds b = heights.get_bounds(x, y);
+			out_hmin = MIN(out_hmin, b.min);
+			out_hmax = MAX(out_hmax, b.max);
+		}
+	}
+
+	return true;
+}
+
+real_t get_segment_triangle_distance(Vector3 a, Vector3 b, const Face3 &f) {
+
+	if (a == b)
+		return a.distance_to(f.get_closest_point_to(a));
+
+	if (Geometry::segment_intersects_triangle(a, b, f.vertex[0], f.vertex[1], f.vertex[2]))
+		return 0;
+
+	real_t d = MIN(a.distance_to(f.get_closest_point_to(a)), b.distance_to(f.get_closest_point_to(b)));
+
+	for (int i = 0; i < 3; ++i) {
+		Vector3 c1, c2;
+		Geometry::get_closest_points_between_segments(a, b, f.vertex[i], f.vertex[(i + 1) % 3], c1, c2);
+		d = MIN(d, c1.distance_to(c2));
+	}
+
+	return d;
+}
+
+// Separating axis test for a box centered at the origin of its own space.
+// Returns false if the axis separates it from the triangle, otherwise keeps track of the smallest overlap.
+bool test_box_triangle_axis(Vector3 axis, Vector3 extents, const Vector3 t[3], real_t &min_overlap) {
+
+	real_t len = axis.length();
+	if (len < AXIS_EPSILON)
+		// Parallel edges, covered by other axes
+		return true;
+
+	real_t p0 = t[0].dot(axis);
+	real_t p1 = t[1].dot(axis);
+	real_t p2 = t[2].dot(axis);
+	real_t tmin = MIN(p0, MIN(p1, p2));
+	real_t tmax = MAX(p0, MAX(p1, p2));
+
+	real_t r = extents.x * Math::abs(axis.x) + extents.y * Math::abs(axis.y) + extents.z * Math::abs(axis.z);
+
+	real_t overlap = MIN(tmax, r) - MAX(tmin, -r);
+	if (overlap < 0)
+		return false;
+
+	min_overlap = MIN(min_overlap, overlap / len);
+	return true;
+}
+
+// Returns by how much a box and a triangle overlap along the axis where they overlap the least, or zero
+real_t get_box_triangle_overlap(const Vector3 &center, const Vector3 axes[3], Vector3 extents, const Face3 &f) {
+
+	// Triangle in the space of the box
+	Vector3 t[3];
+	for (int i = 0; i < 3; ++i) {
+		Vector3 d = f.vertex[i] - center;
+		t[i] = Vector3(d.dot(axes[0]), d.dot(axes[1]), d.dot(axes[2]));
+	}
+
+	Vector3 edges[3] = { t[1] - t[0], t[2] - t[1], t[0] - t[2] };
+	real_t min_overlap = 1e20;
+
+	for (int i = 0; i < 3; ++i) {
+		Vector3 box_axis;
+		box_axis[i] = 1;
+
+		if (!test_box_triangle_axis(box_axis, extents, t, min_overlap))
+			return 0;
+
+		for (int j = 0; j < 3; ++j) {
+			if (!test_box_triangle_axis(box_axis.cross(edges[j]), extents, t, min_overlap))
+				return 0;
+		}
+	}
+
+	if (!test_box_triangle_axis(edges[0].cross(edges[1]), extents, t, min_overlap))
+		return 0;
+
+	return min_overlap;
+}
+
+} // namespace
+
+real_t overlap_capsule_heightmap(
+		const HeightMapSnapshot &heights,
+		Vector3 a, Vector3 b, real_t radius) {
+
+	if (heights.get_resolution() < 2 || heights.get_bounds_size().x == 0)
+		return 0;
+
+	Vector3 lo(MIN(a.x, b.x) - radius, MIN(a.y, b.y) - radius, MIN(a.z, b.z) - radius);
+	Vector3 hi(MAX(a.x, b.x) + radius, MAX(a.y, b.y) + radius, MAX(a.z, b.z) + radius);
+
+	Point2i cmin, cmax;
+	real_t hmin, hmax;
+	if (!get_footprint(heights, lo, hi, cmin, cmax, hmin, hmax))
+		return 0;
+
+	if (lo.y > hmax)
+		return 0;
+
+	// Ends of the capsule below the surface
+	real_t below = 0;
+	if (is_inside_map(heights, a))
+		below = MAX(below, get_surface_height(heights, a.x, a.z) - a.y);
+	if (is_inside_map(heights, b))
+		below = MAX(below, get_surface_height(heights, b.x, b.z) - b.y);
+
+	if (below > 0)
+		return radius + below;
+
+	// Otherwise it depends on the closest triangle, which only matters within the radius
+	real_t min_distance = radius;
+
+	for (int y = cmin.y; y < cmax.y; ++y) {
+		for (int x = cmin.x; x < cmax.x; ++x) {
+
+			Face3 faces[2];
+
+			// Too far below
+			if (get_cell_faces(heights, x, y, faces) < lo.y)
+				continue;
+
+			min_distance = MIN(min_distance, get_segment_triangle_distance(a, b, faces[0]));
+			min_distance = MIN(min_distance, get_segment_triangle_distance(a, b, faces[1]));
+		}
+	}
+
+	return radius - min_distance;
+}
+
+real_t overlap_box_heightmap(
+		const HeightMapSnapshot &heights,
+		const Transform &box) {
+
+	if (heights.get_resolution() < 2 || heights.get_bounds_size().x == 0)
+		return 0;
+
+	AABB aabb = box.xform(AABB(Vector3(-1, -1, -1), Vector3(2, 2, 2)));
+
+	Point2i cmin, cmax;
+	real_t hmin, hmax;
+	if (!get_footprint(heights, aabb.position, aabb.position + aabb.size, cmin, cmax, hmin, hmax))
+		return 0;
+
+	if (aabb.position.y > hmax)
+		return 0;
+
+	real_t depth = 0;
+
+	// Corners below the surface
+	for (int i = 0; i < 8; ++i) {
+		Vector3 corner = box.xform(Vector3(i & 1 ? 1 : -1, i & 2 ? 1 : -1, i & 4 ? 1 : -1));
+		if (is_inside_map(heights, corner))
+			depth = MAX(depth, get_surface_height(heights, corner.x, corner.z) - corner.y);
+	}
+
+	// Terrain points inside the box, which it has to clear by moving up.
+	// In the unit space of the box, that means exiting the cube going along `dir`.
+	Transform inv = box.affine_inverse();
+	Vector3 dir = inv.basis.xform(Vector3(0, -1, 0));
+
+	for (int y = cmin.y; y <= cmax.y; ++y) {
+		for (int x = cmin.x; x <= cmax.x; ++x) {
+
+			Vector3 p(x, heights.get_height(x, y), y);
+			if (p.y < aabb.position.y)
+				continue;
+
+			Vector3 lp = inv.xform(p);
+			if (Math::abs(lp.x) > 1 || Math::abs(lp.y) > 1 || Math::abs(lp.z) > 1)
+				continue;
+
+			real_t t = 1e20;
+			for (int i = 0; i < 3; ++i) {
+				if (dir[i] > 0)
+					t = MIN(t, (1 - lp[i]) / dir[i]);
+				else if (dir[i] < 0)
+					t = MIN(t, (-1 - lp[i]) / dir[i]);
+			}
+
+			depth = MAX(depth, t);
+		}
+	}
+
+	if (depth > 0)
+		return depth;
+
+	// Exact test for what's left, like a ridge going through a side of the box without any point inside
+	Vector3 axes[3];
+	Vector3 extents;
+	for (int i = 0; i < 3; ++i) {
+		axes[i] = box.basis.get_axis(i);
+		extents[i] = axes[i].length();
+		if (extents[i] > 0)
+			axes[i] /= extents[i];
+	}
+
+	for (int y = cmin.y; y < cmax.y; ++y) {
+		for (int x = cmin.x; x < cmax.x; ++x) {
+
+			Face3 faces[2];
+
+			if (get_cell_faces(heights, x, y, faces) < aabb.position.y)
+				continue;
+
+			depth = MAX(depth, get_box_triangle_overlap(box.origin, axes, extents, faces[0]));
+			depth = MAX(depth, get_box_triangle_overlap(box.origin, axes, extents, faces[1]));
+		}
+	}
+
+	return depth;
+}
@@ -0,0 +1,26 @@
+#ifndef HEIGHT_MAP_OVERLAP_H
+#define HEIGHT_MAP_OVERLAP_H
+
+#include <core/math/transform.h>
+
+#include "height_map_snapshot.h"
+
+// Overlap tests between simple volumes and the triangles of a heightmap, in terrain space.
+// Terrain is considered solid below its surface.
+// They return how deep the volume goes into terrain, or zero if they don't touch.
+// Vertical bounds are used to reject volumes quickly, then only cells under the volume are tested.
+// Like raycasts, they read from a snapshot, so they can run on any thread.
+
+// Sphere is a capsule with both points at the same place.
+// Depth is measured from the closest point of the surface, or vertically for parts below it.
+real_t overlap_capsule_heightmap(
+		const HeightMapSnapshot &heights,
+		Vector3 a, Vector3 b, real_t radius);
+
+// Box is the [-1, 1] cube transformed by `box`, so its basis axes are half extents.
+// Depth is how far up the box has to move to clear the surface.
+real_t overlap_box_heightmap(
+		const HeightMapSnapshot &heights,
+		const Transform &box);
+
+#endif // HEIGHT_MAP_OVERLAP_H
@@ -0,0 +1,162 @@
+#include "height_map_proxy.h"
+#include "utility.h"
+
+#define DEFAULT_PROXY_RESOLUTION 128
+
+HeightMapProxy::HeightMapProxy() {
+	_resolution = DEFAULT_PROXY_RESOLUTION;
+	_dirty = true;
+	_task = NULL;
+}
+
+HeightMapProxy::~HeightMapProxy() {
+	cancel_task();
+}
+
+void HeightMapProxy::set_resolution(int resolution) {
+	ERR_FAIL_COND(resolution < 2);
+	ERR_FAIL_COND(next_power_of_2(resolution) != resolution);
+	if (resolution != _resolution) {
+		_resolution = resolution;
+		_dirty = true;
+	}
+}
+
+void HeightMapProxy::cancel_task() {
+	if (_task) {
+		ThreadPool::get_singleton()->dequeue_or_wait(_task);
+		memdelete(_task);
+		_task = NULL;
+	}
+}
+
+void HeightMapProxy::clear() {
+	cancel_task();
+	_mesh.unref();
+	_aabb = AABB();
+	_dirty = true;
+}
+
+bool HeightMapProxy::update(const HeightMapData &data) {
+
+	ThreadPool &pool = *ThreadPool::get_singleton();
+	bool new_mesh = false;
+
+	if (_task) {
+
+		if (!pool.is_done(_task))
+			return false;
+
+		// Meshes can't be created from other threads, so it's done here
+		Array arrays;
+		arrays.resize(Mesh::ARRAY_MAX);
+		arrays[Mesh::ARRAY_VERTEX] = _task->positions;
+		arrays[Mesh::ARRAY_NORMAL] = _task->normals;
+		arrays[Mesh::ARRAY_TEX_UV] = _task->uvs;
+		arrays[Mesh::ARRAY_INDEX] = _task->indices;
+
+		_mesh.instance();
+		_mesh->add_surface_from_arrays(Mesh::PRIMITIVE_TRIANGLES, arrays);
+		_aabb = _mesh->get_aabb();
+
+		memdelete(_task);
+		_task = NULL;
+		new_mesh = true;
+	}
+
+	if (_dirty && data.get_resolution() > 0) {
+
+		Ref<Image> heights_ref = data.get_image(HeightMapData::CHANNEL_HEIGHT);
+		ERR_FAIL_COND_V(heights_ref.is_null(), new_mesh);
+
+		// Take a snapshot of the heights the mesh needs, so the map can keep being edited meanwhile.
+		// Resolution of the map is a power of two plus one, so the stride falls exactly on its edges.
+		int quads = MIN(_resolution, data.get_resolution() - 1);
+		int stride = (data.get_resolution() - 1) / quads;
+
+		_task = memnew(BuildTask);
+		_task->stride = stride;
+		_task->heights.resize(Point2i(quads + 1, quads + 1), false);
+
+		ImageRawView<uint16_t> heights(**heights_ref);
+
+		for (int y = 0; y <= quads; ++y) {
+			const uint16_t *row = heights.row(y * stride);
+			for (int x = 0; x <= quads; ++x) {
+				_task->heights.set(x, y, decode_height(row[x * stride]));
+			}
+		}
+
+		pool.enqueue(_task);
+		_dirty = false;
+	}
+
+	return new_mesh;
+}
+
+void HeightMapProxy::BuildTask::run() {
+
+	const Point2i size = heights.size();
+	const int vertex_count = size.x * size.y;
+	const float inv_res = 1.f / ((size.x - 1) * stride + 1);
+
+	positions.resize(vertex_count);
+	normals.resize(vertex_count);
+	uvs.resize(vertex_count);
+
+	{
+		PoolVector3Array::Write pw = positions.write();
+		PoolVector3Array::Write nw = normals.write();
+		PoolVector2Array::Write uw = uvs.write();
+
+		int i = 0;
+		for (int y = 0; y < size.y; ++y) {
+			for (int x = 0; x < size.x; ++x) {
+
+				float h = heights.get(x, y);
+				pw[i] = Vector3(x * stride, h, y * stride);
+
+				// Same as HeightMapData::update_normals, with a larger step
+				float left = heights.get_clamped(x - 1, y);
+				float right = heights.get_clamped(x + 1, y);
+				float fore = heights.get_clamped(x, y + 1);
+				float back = heights.get_clamped(x, y - 1);
+				nw[i] = Vector3(left - right, 2.0 * stride, back - fore).normalized();
+
+				// Same mapping as the default shader
+				uw[i] = Vector2(x * stride, y * stride) * inv_res;
+
+				++i;
+			}
+		}
+	}
+
+	const Point2i quads = size - Point2i(1, 1);
+	indices.resize(quads.x * quads.y * 6);
+
+	{
+		PoolIntArray::Write iw = indices.write();
+
+		int i = 0;
+		for (int y = 0; y < quads.y; ++y) {
+			for (int x = 0; x < quads.x; ++x) {
+
+				int i00 = x + y * size.x;
+				int i10 = i00 + 1;
+				int i01 = i00 + size.x;
+				int i11 = i01 + 1;
+
+				iw[i++] = i00;
+				iw[i++] = i11;
+				iw[i++] = i01;
+
+				iw[i++] = i00;
+				iw[i++] = i10;
+				iw[i++] = i11;
+			}
+		}
+	}
+
+	// Release the snapshot
+	heights.resize(Point2i(0, 0), false);
+}
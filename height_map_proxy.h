@@ -0,0 +1,57 @@
+#ifndef HEIGHT_MAP_PROXY_H
+#define HEIGHT_MAP_PROXY_H
+
+#include <scene/resources/mesh.h>
+
+#include "height_map_data.h"
+#include "thread_pool.h"
+
+// Builds a single simplified mesh of the whole terrain, used to render it beyond the range of LOD chunks.
+// The mesh is in terrain space, with heights and normals baked in.
+// It is rebuilt in the background when heights change.
+class HeightMapProxy {
+public:
+	HeightMapProxy();
+	~HeightMapProxy();
+
+	// Amount of quads along each side of the mesh
+	void set_resolution(int resolution);
+	int get_resolution() const { return _resolution; }
+
+	void set_dirty() { _dirty = true; }
+
+	// Call this every frame. Returns true when a new mesh is available.
+	bool update(const HeightMapData &data);
+
+	Ref<Mesh> get_mesh() const { return _mesh; }
+	AABB get_aabb() const { return _aabb; }
+
+	void clear();
+
+private:
+	class BuildTask : public ThreadPool::Task {
+	public:
+		// Input
+		Grid2D<float> heights;
+		int stride;
+
+		// Output
+		PoolVector3Array positions;
+		PoolVector3Array normals;
+		PoolVector2Array uvs;
+		PoolIntArray indices;
+
+		void run();
+	};
+
+	void cancel_task();
+
+private:
+	int _resolution;
+	bool _dirty;
+	BuildTask *_task;
+	Ref<ArrayMesh> _mesh;
+	AABB _aabb;
+};
+
+#endif // HEIGHT_MAP_PROXY_H
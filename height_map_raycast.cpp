@@ -0,0 +1,233 @@
+#include <core/math/geometry.h>
+
+#include "height_map_raycast.h"
+
+namespace {
+
+const real_t FAR_DISTANCE = 1e20;
+const real_t DISTANCE_EPSILON = 0.0001;
+// Hits that close to the target of a visibility test are ignored, so it doesn't hide itself
+const real_t VISIBILITY_MARGIN = 0.01;
+
+// Walks cells of a grid crossed by a ray, projected on the XZ plane, in order.
+// Stops when the ray goes beyond t_end or leaves the [min, max[ range of cells.
+struct GridRayWalker {
+	Point2i cell;
+	Point2i step;
+	Vector2 t_max;
+	Vector2 t_delta;
+	real_t t;
+	real_t t_end;
+	Point2i min;
+	Point2i max;
+
+	GridRayWalker(Vector3 origin, Vector3 dir, real_t cell_size, real_t t_begin, real_t p_t_end, Point2i p_min, Point2i p_max) {
+
+		t = t_begin;
+		t_end = p_t_end;
+		min = p_min;
+		max = p_max;
+
+		Vector3 p = origin + dir * t_begin;
+		cell = Point2i(Math::floor(p.x / cell_size), Math::floor(p.z / cell_size));
+
+		// Precision can make the first cell slightly out of range
+		cell.x = CLAMP(cell.x, min.x, max.x - 1);
+		cell.y = CLAMP(cell.y, min.y, max.y - 1);
+
+		init_axis(origin.x, dir.x, cell_size, cell.x, step.x, t_max.x, t_delta.x);
+		init_axis(origin.z, dir.z, cell_size, cell.y, step.y, t_max.y, t_delta.y);
+	}
+
+	static void init_axis(real_t o, real_t d, real_t cell_size, int c, int &out_step, real_t &out_t_max, real_t &out_t_delta) {
+		if (d > 0) {
+			out_step = 1;
+			out_t_max = ((c + 1) * cell_size - o) / d;
+			out_t_delta = cell_size / d;
+		} else if (d < 0) {
+			out_step = -1;
+			out_t_max = (c * cell_size - o) / d;
+			out_t_delta = -cell_size / d;
+		} else {
+			out_step = 0;
+			out_t_max = FAR_DISTANCE;
+			out_t_delta = FAR_DISTANCE;
+		}
+	}
+
+	bool next(Point2i &out_cell, real_t &out_t0, real_t &out_t1) {
+
+		if (t >= t_end || cell.x < min.x || cell.y < min.y || cell.x >= max.x || cell.y >= max.y)
+			return false;
+
+		out_cell = cell;
+		out_t0 = t;
+
+		if (t_max.x < t_max.y) {
+			out_t1 = t_max.x;
+			cell.x += step.x;
+			t_max.x += t_delta.x;
+		} else {
+			out_t1 = t_max.y;
+			cell.y += step.y;
+			t_max.y += t_delta.y;
+		}
+
+		out_t1 = CLAMP(out_t1, out_t0, t_end);
+		t = out_t1;
+		return true;
+	}
+};
+
+// Restricts [t0, t1] to the part of the ray above a rectangle starting at the origin
+bool clip_ray_to_rect(Vector3 origin, Vector3 dir, Vector2 size, real_t &t0, real_t &t1) {
+
+	for (int axis = 0; axis < 2; ++axis) {
+
+		real_t o = axis == 0 ? origin.x : origin.z;
+		real_t d = axis == 0 ? dir.x : dir.z;
+		real_t s = axis == 0 ? size.x : size.y;
+
+		if (d == 0) {
+			if (o < 0 || o > s)
+				return false;
+			continue;
+		}
+
+		real_t ta = -o / d;
+		real_t tb = (s - o) / d;
+		if (ta > tb)
+			SWAP(ta, tb);
+
+		t0 = MAX(t0, ta);
+		t1 = MIN(t1, tb);
+		if (t0 > t1)
+			return false;
+	}
+
+	return true;
+}
+
+inline void get_ray_height_range(Vector3 origin, Vector3 dir, real_t t0, real_t t1, real_t &out_min, real_t &out_max) {
+	real_t y0 = origin.y + dir.y * t0;
+	real_t y1 = origin.y + dir.y * t1;
+	out_min = MIN(y0, y1);
+	out_max = MAX(y0, y1);
+}
+
+bool raycast_triangle(Vector3 origin, Vector3 dir, Vector3 a, Vector3 b, Vector3 c, real_t t_min, real_t t_max, real_t &out_t) {
+	Vector3 hit;
+	if (!Geometry::ray_intersects_triangle(origin, dir, a, b, c, &hit))
+		return false;
+	real_t t = (hit - origin).dot(dir) / dir.length_squared();
+	if (t < t_min - DISTANCE_EPSILON || t > t_max + DISTANCE_EPSILON)
+		return false;
+	out_t = t;
+	return true;
+}
+
+bool raycast_cell(const HeightMapSnapshot &heights, Point2i cpos, Vector3 origin, Vector3 dir, real_t t0, real_t t1, HeightMapRaycastHit &out_hit) {
+
+	Vector3 p00(cpos.x, heights.get_height(cpos.x, cpos.y), cpos.y);
+	Vector3 p10(cpos.x + 1, heights.get_height(cpos.x + 1, cpos.y), cpos.y);
+	Vector3 p01(cpos.x, heights.get_height(cpos.x, cpos.y + 1), cpos.y + 1);
+	Vector3 p11(cpos.x + 1, heights.get_height(cpos.x + 1, cpos.y + 1), cpos.y + 1);
+
+	real_t ray_min, ray_max;
+	get_ray_height_range(origin, dir, t0, t1, ray_min, ray_max);
+
+	if (ray_min > MAX(MAX(p00.y, p10.y), MAX(p01.y, p11.y)) || ray_max < MIN(MIN(p00.y, p10.y), MIN(p01.y, p11.y)))
+		return false;
+
+	// Same triangles as the mesh, so hits are on what is rendered
+	const Vector3 corners[4] = { p00, p10, p01, p11 };
+	const int *triangles = get_cell_triangles(cpos.x, cpos.y);
+
+	real_t t;
+	bool found = false;
+	real_t best_t = t1;
+
+	for (int i = 0; i < 6; i += 3) {
+
+		const Vector3 &a = corners[triangles[i]];
+		const Vector3 &b = corners[triangles[i + 1]];
+		const Vector3 &c = corners[triangles[i + 2]];
+
+		if (raycast_triangle(origin, dir, a, b, c, t0, best_t, t)) {
+			best_t = t;
+			out_hit.normal = (c - a).cross(b - a);
+			found = true;
+		}
+	}
+
+	if (found) {
+		out_hit.distance = best_t;
+		out_hit.position = origin + dir * best_t;
+		out_hit.normal.normalize();
+	}
+
+	return found;
+}
+
+} // namespace
+
+bool raycast_heightmap(
+		const HeightMapSnapshot &heights,
+		Vector3 origin, Vector3 dir, real_t max_distance,
+		HeightMapRaycastHit &out_hit) {
+
+	const int res = heights.get_resolution();
+	const Point2i bounds_size = heights.get_bounds_size();
+	if (res < 2 || bounds_size.x == 0 || dir == Vector3())
+		return false;
+
+	real_t t_begin = 0;
+	real_t t_end = max_distance;
+	if (!clip_ray_to_rect(origin, dir, Vector2(res - 1, res - 1), t_begin, t_end))
+		return false;
+
+	const int bs = HeightMapSnapshot::BOUNDS_BLOCK_SIZE;
+	const Point2i last_cell(res - 1, res - 1);
+
+	GridRayWalker blocks(origin, dir, bs, t_begin, t_end, Point2i(0, 0), bounds_size);
+	Point2i bpos;
+	real_t bt0, bt1;
+
+	while (blocks.next(bpos, bt0, bt1)) {
+
+		// A ray entirely above or below a block can't cross its surface
+		HeightMapSnapshot::Bounds b = heights.get_bounds(bpos);
+		real_t ray_min, ray_max;
+		get_ray_height_range(origin, dir, bt0, bt1, ray_min, ray_max);
+		if (ray_min > b.max || ray_max < b.min)
+			continue;
+
+		Point2i cmin = bpos * bs;
+		Point2i cmax(MIN(cmin.x + bs, last_cell.x), MIN(cmin.y + bs, last_cell.y));
+
+		GridRayWalker cells(origin, dir, 1, bt0, bt1, cmin, cmax);
+		Point2i cpos;
+		real_t ct0, ct1;
+
+		while (cells.next(cpos, ct0, ct1)) {
+			if (raycast_cell(heights, cpos, origin, dir, ct0, ct1, out_hit))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+bool is_visible_heightmap(
+		const HeightMapSnapshot &heights,
+		Vector3 from, Vector3 to) {
+
+	Vector3 d = to - from;
+	real_t len = d.length();
+	if (len <= VISIBILITY_MARGIN)
+		return true;
+
+	// With the segment as direction, distances go from 0 to 1
+	HeightMapRaycastHit hit;
+	return !raycast_heightmap(heights, from, d, 1.0 - VISIBILITY_MARGIN / len, hit);
+}
@@ -0,0 +1,30 @@
+#ifndef HEIGHT_MAP_RAYCAST_H
+#define HEIGHT_MAP_RAYCAST_H
+
+#include "height_map_snapshot.h"
+
+struct HeightMapRaycastHit {
+	Vector3 position;
+	Vector3 normal;
+	real_t distance;
+
+	HeightMapRaycastHit() : distance(0) {}
+};
+
+// Exact intersection of a ray with the triangles of a heightmap, in terrain space.
+// Distances are in units of `dir`, which doesn't need to be normalized.
+// Cells are walked with a 2D DDA, first by blocks of vertical bounds so those the ray passes over are skipped,
+// then cell by cell within blocks where it could hit.
+// It reads from a snapshot, so it can run on any thread while the map is being edited.
+bool raycast_heightmap(
+		const HeightMapSnapshot &heights,
+		Vector3 origin, Vector3 dir, real_t max_distance,
+		HeightMapRaycastHit &out_hit);
+
+// Tells if no terrain stands between two points, in terrain space.
+// A point lying on the surface is still considered visible.
+bool is_visible_heightmap(
+		const HeightMapSnapshot &heights,
+		Vector3 from, Vector3 to);
+
+#endif // HEIGHT_MAP_RAYCAST_H
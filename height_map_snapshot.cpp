@@ -0,0 +1,135 @@
+#include "height_map_snapshot.h"
+
+HeightMapSnapshot::HeightMapSnapshot() {
+	_version = 0;
+	_resolution = 0;
+}
+
+real_t HeightMapSnapshot::get_height_at(int x, int y) const {
+	ERR_FAIL_COND_V(_resolution == 0, 0);
+	return get_height(x, y);
+}
+
+real_t HeightMapSnapshot::get_interpolated_height_at(Vector3 pos) const {
+	ERR_FAIL_COND_V(_resolution == 0, 0);
+	return get_interpolated_height(pos.x, pos.z);
+}
+
+void HeightMapSnapshot::init(int resolution) {
+
+	_resolution = resolution;
+
+	int tiles_per_side = (_resolution + TILE_SIZE - 1) / TILE_SIZE;
+	_tiles_size = Point2i(tiles_per_side, tiles_per_side);
+	_tiles.resize(tiles_per_side * tiles_per_side);
+
+	// Same as HeightMapData, resolution being a power of two plus one the last block ends on the edge
+	int blocks_per_side = _resolution / BOUNDS_BLOCK_SIZE;
+	_bounds_size = Point2i(blocks_per_side, blocks_per_side);
+}
+
+void HeightMapSnapshot::copy_tile(const ImageRawView<uint16_t> &heights, int tile_index) {
+
+	Point2i tpos(tile_index % _tiles_size.x, tile_index / _tiles_size.x);
+	Point2i origin = tpos * TILE_SIZE;
+
+	// Tiles on the last row and column are only partially used
+	int w = MIN(TILE_SIZE, _resolution - origin.x);
+	int h = MIN(TILE_SIZE, _resolution - origin.y);
+
+	// Assigning new vectors leaves the previous ones to older snapshots still using them
+	Tile tile;
+	tile.heights.resize(TILE_SIZE * TILE_SIZE);
+	uint16_t *dst = &tile.heights[0];
+
+	for (int y = 0; y < h; ++y) {
+		copymem(dst + y * TILE_SIZE, heights.row(origin.y + y) + origin.x, w * sizeof(uint16_t));
+	}
+
+	// Blocks read one cell into the next tile, so bounds are computed from the map
+	tile.bounds.resize(BOUNDS_PER_TILE * BOUNDS_PER_TILE);
+	Bounds *bounds = &tile.bounds[0];
+
+	Point2i bmin = tpos * BOUNDS_PER_TILE;
+	Point2i bmax(MIN(bmin.x + BOUNDS_PER_TILE, _bounds_size.x), MIN(bmin.y + BOUNDS_PER_TILE, _bounds_size.y));
+
+	for (int by = bmin.y; by < bmax.y; ++by) {
+		for (int bx = bmin.x; bx < bmax.x; ++bx) {
+
+			Point2i cmin(bx * BOUNDS_BLOCK_SIZE, by * BOUNDS_BLOCK_SIZE);
+			Point2i cmax(MIN(cmin.x + BOUNDS_BLOCK_SIZE + 1, _resolution), MIN(cmin.y + BOUNDS_BLOCK_SIZE + 1, _resolution));
+
+			Bounds &b = bounds[(by - bmin.y) * BOUNDS_PER_TILE + (bx - bmin.x)];
+			b.min = b.max = decode_height(heights.row(cmin.y)[cmin.x]);
+
+			for (int y = cmin.y; y < cmax.y; ++y) {
+				const uint16_t *row = heights.row(y);
+				for (int x = cmin.x; x < cmax.x; ++x) {
+					float v = decode_height(row[x]);
+					b.min = MIN(b.min, v);
+					b.max = MAX(b.max, v);
+				}
+			}
+		}
+	}
+
+	_tiles[tile_index] = tile;
+}
+
+Ref<HeightMapSnapshot> HeightMapSnapshot::create(const Image &heights, uint32_t version) {
+
+	ERR_FAIL_COND_V(heights.get_format() != Image::FORMAT_RH, Ref<HeightMapSnapshot>());
+
+	Ref<HeightMapSnapshot> snapshot;
+	snapshot.instance();
+
+	snapshot->_version = version;
+	snapshot->init(heights.get_width());
+
+	ImageRawView<uint16_t> view(heights);
+
+	for (int i = 0; i < snapshot->_tiles.size(); ++i) {
+		snapshot->copy_tile(view, i);
+	}
+
+	return snapshot;
+}
+
+Ref<HeightMapSnapshot> HeightMapSnapshot::create_next(const Image &heights, Point2i min, Point2i max) const {
+
+	if (heights.get_width() != _resolution)
+		return create(heights, _version + 1);
+
+	Ref<HeightMapSnapshot> snapshot;
+	snapshot.instance();
+
+	// Only references get copied here
+	snapshot->_version = _version + 1;
+	snapshot->_resolution = _resolution;
+	snapshot->_tiles_size = _tiles_size;
+	snapshot->_bounds_size = _bounds_size;
+	snapshot->_tiles = _tiles;
+
+	// Bounds of the last blocks of a tile include the first row and column of the next one
+	Point2i tmin = (min - Point2i(1, 1)) / TILE_SIZE;
+	Point2i tmax = (max - Point2i(1, 1)) / TILE_SIZE + Point2i(1, 1);
+	clamp_min_max_excluded(tmin, tmax, Point2i(0, 0), _tiles_size);
+
+	ImageRawView<uint16_t> view(heights);
+
+	for (int ty = tmin.y; ty < tmax.y; ++ty) {
+		for (int tx = tmin.x; tx < tmax.x; ++tx) {
+			snapshot->copy_tile(view, tx + ty * _tiles_size.x);
+		}
+	}
+
+	return snapshot;
+}
+
+void HeightMapSnapshot::_bind_methods() {
+
+	ClassDB::bind_method(D_METHOD("get_version"), &HeightMapSnapshot::get_version);
+	ClassDB::bind_method(D_METHOD("get_resolution"), &HeightMapSnapshot::get_resolution);
+	ClassDB::bind_method(D_METHOD("get_height_at", "x", "y"), &HeightMapSnapshot::get_height_at);
+	ClassDB::bind_method(D_METHOD("get_interpolated_height_at", "pos"), &HeightMapSnapshot::get_interpolated_height_at);
+}
@@ -0,0 +1,105 @@
+#ifndef HEIGHT_MAP_SNAPSHOT_H
+#define HEIGHT_MAP_SNAPSHOT_H
+
+#include <core/reference.h>
+
+#include "utility.h"
+
+// Immutable copy of the heights of a map at a given version.
+// Any thread can keep one and read from it without locking, while the map keeps being edited.
+// Heights are split in tiles shared copy-on-write between versions,
+// so publishing a new version after an edit only copies tiles that changed.
+// Tiles also hold the vertical bounds of their blocks, so queries can skip areas without touching the map.
+class HeightMapSnapshot : public Reference {
+	GDCLASS(HeightMapSnapshot, Reference)
+public:
+	// Same block size as the vertical bounds of HeightMapData
+	enum {
+		TILE_SIZE = 64,
+		BOUNDS_BLOCK_SIZE = 8,
+		BOUNDS_PER_TILE = TILE_SIZE / BOUNDS_BLOCK_SIZE
+	};
+
+	// Blocks share their edge cells with the next ones, so they cover BOUNDS_BLOCK_SIZE + 1 cells
+	struct Bounds {
+		float min;
+		float max;
+		Bounds() : min(0), max(0) {}
+	};
+
+	HeightMapSnapshot();
+
+	// Increases each time a new snapshot gets published
+	inline uint32_t get_version() const { return _version; }
+	inline int get_resolution() const { return _resolution; }
+
+	inline float get_height(int x, int y) const {
+		x = CLAMP(x, 0, _resolution - 1);
+		y = CLAMP(y, 0, _resolution - 1);
+		const uint16_t *tile = _tiles[(y / TILE_SIZE) * _tiles_size.x + (x / TILE_SIZE)].heights.ptr();
+		return decode_height(tile[(y % TILE_SIZE) * TILE_SIZE + (x % TILE_SIZE)]);
+	}
+
+	// Bilinear height at a position in cells, clamped to the edges of the map.
+	// Optionally gives the slope along X and Y too, which is what normals are made of.
+	inline float get_interpolated_height(float x, float y, Vector2 *out_gradient = NULL) const {
+
+		int x0 = CLAMP(static_cast<int>(Math::floor(x)), 0, _resolution - 2);
+		int y0 = CLAMP(static_cast<int>(Math::floor(y)), 0, _resolution - 2);
+
+		float xf = CLAMP(x - x0, 0.f, 1.f);
+		float yf = CLAMP(y - y0, 0.f, 1.f);
+
+		float h00 = get_height(x0, y0);
+		float h10 = get_height(x0 + 1, y0);
+		float h01 = get_height(x0, y0 + 1);
+		float h11 = get_height(x0 + 1, y0 + 1);
+
+		if (out_gradient) {
+			out_gradient->x = Math::lerp(h10 - h00, h11 - h01, yf);
+			out_gradient->y = Math::lerp(h01 - h00, h11 - h10, xf);
+		}
+
+		return Math::lerp(Math::lerp(h00, h10, xf), Math::lerp(h01, h11, xf), yf);
+	}
+
+	// Amount of blocks of vertical bounds along each side
+	inline Point2i get_bounds_size() const { return _bounds_size; }
+
+	inline Bounds get_bounds(int bx, int by) const {
+		const Bounds *tile = _tiles[(by / BOUNDS_PER_TILE) * _tiles_size.x + (bx / BOUNDS_PER_TILE)].bounds.ptr();
+		return tile[(by % BOUNDS_PER_TILE) * BOUNDS_PER_TILE + (bx % BOUNDS_PER_TILE)];
+	}
+
+	inline Bounds get_bounds(Point2i bpos) const {
+		return get_bounds(bpos.x, bpos.y);
+	}
+
+	real_t get_height_at(int x, int y) const;
+	real_t get_interpolated_height_at(Vector3 pos) const;
+
+	static Ref<HeightMapSnapshot> create(const Image &heights, uint32_t version);
+
+	// Makes the next version, sharing all tiles except those overlapping the changed area
+	Ref<HeightMapSnapshot> create_next(const Image &heights, Point2i min, Point2i max) const;
+
+private:
+	static void _bind_methods();
+
+	void init(int resolution);
+	void copy_tile(const ImageRawView<uint16_t> &heights, int tile_index);
+
+private:
+	struct Tile {
+		Vector<uint16_t> heights;
+		Vector<Bounds> bounds;
+	};
+
+	uint32_t _version;
+	int _resolution;
+	Point2i _tiles_size;
+	Point2i _bounds_size;
+	Vector<Tile> _tiles;
+};
+
+#endif // HEIGHT_MAP_SNAPSHOT_H
@@ -0,0 +1,512 @@
+#include <core/io/compression.h>
+#include <core/os/dir_access.h>
+
+#include "height_map_undo.h"
+#include "utility.h"
+
+#define DEFAULT_MEMORY_BUDGET ((uint64_t)256 * 1024 * 1024)
+// Free buffers kept for each size, beyond that they are just freed
+#define MAX_FREE_TILES 256
+
+static void xor_buffer(uint8_t *dst, const uint8_t *src, int size) {
+	for (int i = 0; i < size; ++i) {
+		dst[i] ^= src[i];
+	}
+}
+
+// FastLZ is fast enough to not be noticed when a stroke ends
+static PoolByteArray compress_buffer(const PoolByteArray &src) {
+
+	PoolByteArray dst;
+	dst.resize(Compression::get_max_compressed_buffer_size(src.size(), Compression::MODE_FASTLZ));
+
+	int len;
+	{
+		PoolByteArray::Read r = src.read();
+		PoolByteArray::Write w = dst.write();
+		len = Compression::compress(w.ptr(), r.ptr(), src.size(), Compression::MODE_FASTLZ);
+	}
+
+	dst.resize(len);
+	return dst;
+}
+
+static bool decompress_buffer(const PoolByteArray &src, PoolByteArray &dst, int size) {
+
+	dst.resize(size);
+
+	PoolByteArray::Read r = src.read();
+	PoolByteArray::Write w = dst.write();
+	int len = Compression::decompress(w.ptr(), size, r.ptr(), src.size(), Compression::MODE_FASTLZ);
+
+	ERR_FAIL_COND_V(len != size, false);
+	return true;
+}
+
+//------------------------------------------
+// HeightMapUndoStep
+
+HeightMapUndoStep::HeightMapUndoStep() {
+	_channel = 0;
+	_chunk_size = 0;
+	_format = Image::FORMAT_L8;
+	_tile_bytes = 0;
+	_compressed = false;
+	_spilled = false;
+	_in_store = false;
+	_memory_usage = 0;
+}
+
+HeightMapUndoStep::~HeightMapUndoStep() {
+
+	HeightMapUndoStore *store = HeightMapUndoStore::get_singleton();
+
+	if (store && !_compressed) {
+		for (int i = 0; i < _tiles.size(); ++i) {
+			store->release_tile(_tiles[i].redo);
+			store->release_tile(_tiles[i].undo_xor);
+		}
+	}
+
+	if (store && _in_store)
+		store->remove_step(this);
+
+	if (store && _spilled) {
+		for (int i = 0; i < _tiles.size(); ++i) {
+			store->free_spill_range(_tiles[i].spill_offset, _tiles[i].redo_size + _tiles[i].undo_xor_size);
+		}
+		--store->_spilled_count;
+		if (store->_spilled_count == 0)
+			store->close_spill_file();
+	}
+}
+
+void HeightMapUndoStep::update_memory_usage() {
+
+	int usage = 0;
+	for (int i = 0; i < _tiles.size(); ++i) {
+		usage += _tiles[i].redo.size() + _tiles[i].undo_xor.size();
+	}
+
+	if (_in_store)
+		HeightMapUndoStore::get_singleton()->add_memory_usage(usage - _memory_usage);
+	_memory_usage = usage;
+}
+
+void HeightMapUndoStep::compress() {
+
+	if (_compressed)
+		return;
+
+	HeightMapUndoStore *store = HeightMapUndoStore::get_singleton();
+
+	for (int i = 0; i < _tiles.size(); ++i) {
+		Tile &tile = _tiles[i];
+
+		PoolByteArray redo = compress_buffer(tile.redo);
+		PoolByteArray undo_xor = compress_buffer(tile.undo_xor);
+
+		store->release_tile(tile.redo);
+		store->release_tile(tile.undo_xor);
+
+		tile.redo = redo;
+		tile.undo_xor = undo_xor;
+	}
+
+	_compressed = true;
+	update_memory_usage();
+}
+
+// Moves compressed data to the file, keeping only where it is
+bool HeightMapUndoStep::spill(FileAccess &f) {
+
+	if (_spilled)
+		return false;
+
+	compress();
+
+	HeightMapUndoStore *store = HeightMapUndoStore::get_singleton();
+
+	for (int i = 0; i < _tiles.size(); ++i) {
+		Tile &tile = _tiles[i];
+
+		tile.redo_size = tile.redo.size();
+		tile.undo_xor_size = tile.undo_xor.size();
+		tile.spill_offset = store->allocate_spill_range(tile.redo_size + tile.undo_xor_size);
+		f.seek(tile.spill_offset);
+
+		PoolByteArray::Read redo = tile.redo.read();
+		PoolByteArray::Read undo_xor = tile.undo_xor.read();
+		f.store_buffer(redo.ptr(), tile.redo_size);
+		f.store_buffer(undo_xor.ptr(), tile.undo_xor_size);
+	}
+
+	if (f.get_error() != OK) {
+		// Data is still in memory at this point, so it can be kept there
+		for (int i = 0; i < _tiles.size(); ++i) {
+			store->free_spill_range(_tiles[i].spill_offset, _tiles[i].redo_size + _tiles[i].undo_xor_size);
+		}
+		ERR_FAIL_V(false);
+	}
+
+	for (int i = 0; i < _tiles.size(); ++i) {
+		_tiles[i].redo = PoolByteArray();
+		_tiles[i].undo_xor = PoolByteArray();
+	}
+
+	_spilled = true;
+	++HeightMapUndoStore::get_singleton()->_spilled_count;
+	update_memory_usage();
+	return true;
+}
+
+bool HeightMapUndoStep::decode_tile(const Tile &tile, bool redo, PoolByteArray &out_data) const {
+
+	PoolByteArray redo_data;
+	PoolByteArray undo_xor;
+
+	if (_spilled) {
+		// Read back from disk only for the time of applying it
+		HeightMapUndoStore *store = HeightMapUndoStore::get_singleton();
+		ERR_FAIL_COND_V(store == NULL, false);
+
+		PoolByteArray compressed;
+		if (!store->read_spilled(tile.spill_offset, tile.redo_size, compressed))
+			return false;
+		if (!decompress_buffer(compressed, redo_data, _tile_bytes))
+			return false;
+
+		if (!redo) {
+			if (!store->read_spilled(tile.spill_offset + tile.redo_size, tile.undo_xor_size, compressed))
+				return false;
+			if (!decompress_buffer(compressed, undo_xor, _tile_bytes))
+				return false;
+		}
+
+	} else if (_compressed) {
+		if (!decompress_buffer(tile.redo, redo_data, _tile_bytes))
+			return false;
+		if (!redo && !decompress_buffer(tile.undo_xor, undo_xor, _tile_bytes))
+			return false;
+	} else {
+		redo_data = tile.redo;
+		undo_xor = tile.undo_xor;
+	}
+
+	if (redo) {
+		out_data = redo_data;
+		return true;
+	}
+
+	// Writing makes a copy if the data is still shared with the tile
+	ERR_FAIL_COND_V(undo_xor.size() != _tile_bytes, false);
+	out_data = redo_data;
+	{
+		PoolByteArray::Write w = out_data.write();
+		PoolByteArray::Read r = undo_xor.read();
+		xor_buffer(w.ptr(), r.ptr(), _tile_bytes);
+	}
+	return true;
+}
+
+bool HeightMapUndoStep::get_chunk_images(bool redo, Vector<Ref<Image> > &out_images) const {
+
+	out_images.resize(_tiles.size());
+
+	for (int i = 0; i < _tiles.size(); ++i) {
+
+		PoolByteArray data;
+		if (!decode_tile(_tiles[i], redo, data))
+			return false;
+
+		Ref<Image> im;
+		im.instance();
+		im->create(_chunk_size, _chunk_size, false, _format, data);
+		out_images[i] = im;
+	}
+
+	return true;
+}
+
+//------------------------------------------
+// HeightMapUndoStore
+
+HeightMapUndoStore *HeightMapUndoStore::s_singleton = NULL;
+
+void HeightMapUndoStore::create_singleton() {
+	ERR_FAIL_COND(s_singleton != NULL);
+	s_singleton = memnew(HeightMapUndoStore);
+}
+
+void HeightMapUndoStore::free_singleton() {
+	ERR_FAIL_COND(s_singleton == NULL);
+	memdelete(s_singleton);
+	s_singleton = NULL;
+}
+
+HeightMapUndoStore::HeightMapUndoStore() {
+	_memory_budget = DEFAULT_MEMORY_BUDGET;
+	_memory_usage = 0;
+	_spill_file = NULL;
+	_spilled_count = 0;
+	_spill_file_end = 0;
+	_over_budget_warned = false;
+}
+
+HeightMapUndoStore::~HeightMapUndoStore() {
+	// Steps still referenced somewhere keep their data, they just aren't tracked anymore
+	for (List<HeightMapUndoStep *>::Element *E = _steps.front(); E; E = E->next()) {
+		E->get()->_in_store = false;
+	}
+	close_spill_file();
+}
+
+void HeightMapUndoStore::set_spill_path(String path) {
+
+	if (path == _spill_path)
+		return;
+
+	// Spilled steps keep using the current file until they are gone
+	if (_spilled_count == 0)
+		close_spill_file();
+
+	_spill_path = path;
+}
+
+FileAccess *HeightMapUndoStore::get_spill_file() {
+
+	if (_spill_file)
+		return _spill_file;
+
+	if (_spill_path.empty())
+		return NULL;
+
+	Error err = OK;
+	_spill_file = FileAccess::open(_spill_path, FileAccess::WRITE_READ, &err);
+	if (_spill_file == NULL) {
+		ERR_PRINTS("Could not open undo spill file " + _spill_path);
+		return NULL;
+	}
+
+	_spill_file_path = _spill_path;
+	return _spill_file;
+}
+
+bool HeightMapUndoStore::read_spilled(uint64_t offset, int size, PoolByteArray &out_data) {
+
+	ERR_FAIL_COND_V(_spill_file == NULL, false);
+
+	out_data.resize(size);
+	PoolByteArray::Write w = out_data.write();
+
+	_spill_file->seek(offset);
+	int len = _spill_file->get_buffer(w.ptr(), size);
+
+	ERR_FAIL_COND_V(len != size, false);
+	return true;
+}
+
+// First fit in freed space, otherwise at the end of the file
+uint64_t HeightMapUndoStore::allocate_spill_range(uint64_t size) {
+
+	for (int i = 0; i < _spill_free_ranges.size(); ++i) {
+		SpillRange &r = _spill_free_ranges[i];
+		if (r.size < size)
+			continue;
+
+		uint64_t offset = r.offset;
+		if (r.size == size) {
+			_spill_free_ranges.remove(i);
+		} else {
+			r.offset += size;
+			r.size -= size;
+		}
+		return offset;
+	}
+
+	uint64_t offset = _spill_file_end;
+	_spill_file_end += size;
+	return offset;
+}
+
+void HeightMapUndoStore::free_spill_range(uint64_t offset, uint64_t size) {
+
+	if (size == 0)
+		return;
+
+	ERR_FAIL_COND(offset + size > _spill_file_end);
+
+	int i = 0;
+	while (i < _spill_free_ranges.size() && _spill_free_ranges[i].offset < offset) {
+		++i;
+	}
+
+	SpillRange r;
+	r.offset = offset;
+	r.size = size;
+
+	// Merge with neighbors so big steps can fit again
+	if (i < _spill_free_ranges.size() && offset + size == _spill_free_ranges[i].offset) {
+		r.size += _spill_free_ranges[i].size;
+		_spill_free_ranges.remove(i);
+	}
+	if (i > 0) {
+		const SpillRange &prev = _spill_free_ranges[i - 1];
+		if (prev.offset + prev.size == offset) {
+			r.offset = prev.offset;
+			r.size += prev.size;
+			_spill_free_ranges.remove(i - 1);
+			--i;
+		}
+	}
+
+	if (r.offset + r.size == _spill_file_end) {
+		// Nothing after it, so the file can grow from there again
+		_spill_file_end = r.offset;
+	} else {
+		_spill_free_ranges.insert(i, r);
+	}
+}
+
+void HeightMapUndoStore::close_spill_file() {
+
+	_spill_free_ranges.clear();
+	_spill_file_end = 0;
+
+	if (_spill_file == NULL)
+		return;
+
+	_spill_file->close();
+	memdelete(_spill_file);
+	_spill_file = NULL;
+
+	DirAccess *da = DirAccess::create(DirAccess::ACCESS_FILESYSTEM);
+	if (da) {
+		da->remove(_spill_file_path);
+		memdelete(da);
+	}
+}
+
+void HeightMapUndoStore::set_memory_budget(uint64_t bytes) {
+	_memory_budget = bytes;
+	enforce_budget();
+}
+
+PoolByteArray HeightMapUndoStore::acquire_tile(int size) {
+
+	Vector<PoolByteArray> *free_tiles = _free_tiles.getptr(size);
+
+	if (free_tiles && free_tiles->size() != 0) {
+		PoolByteArray tile = (*free_tiles)[free_tiles->size() - 1];
+		free_tiles->resize(free_tiles->size() - 1);
+		return tile;
+	}
+
+	PoolByteArray tile;
+	tile.resize(size);
+	return tile;
+}
+
+void HeightMapUndoStore::release_tile(PoolByteArray tile) {
+
+	if (tile.size() == 0)
+		return;
+
+	Vector<PoolByteArray> &free_tiles = _free_tiles[tile.size()];
+	if (free_tiles.size() < MAX_FREE_TILES)
+		free_tiles.push_back(tile);
+}
+
+Ref<HeightMapUndoStep> HeightMapUndoStore::create_step(const Image &im, int channel, int chunk_size, HashMap<Point2i, PoolByteArray> &undo_chunks) {
+
+	Ref<HeightMapUndoStep> step_ref;
+	step_ref.instance();
+	HeightMapUndoStep &step = **step_ref;
+
+	int pixel_size = Image::get_format_pixel_size(im.get_format());
+
+	step._channel = channel;
+	step._chunk_size = chunk_size;
+	step._format = im.get_format();
+	step._tile_bytes = chunk_size * chunk_size * pixel_size;
+
+	ImageRawView<uint8_t> pixels(im);
+	int row_bytes = chunk_size * pixel_size;
+
+	const Point2i *key = NULL;
+	while ((key = undo_chunks.next(key))) {
+
+		Point2i cpos = *key;
+		PoolByteArray undo_tile = undo_chunks[cpos];
+		ERR_CONTINUE(undo_tile.size() != step._tile_bytes);
+
+		HeightMapUndoStep::Tile tile;
+		tile.redo = acquire_tile(step._tile_bytes);
+		tile.undo_xor = undo_tile;
+
+		{
+			PoolByteArray::Write w = tile.redo.write();
+			Point2i min = cpos * chunk_size;
+			for (int y = 0; y < chunk_size; ++y) {
+				copymem(w.ptr() + y * row_bytes, pixels.row(min.y + y) + min.x * pixel_size, row_bytes);
+			}
+		}
+
+		{
+			PoolByteArray::Write w = tile.undo_xor.write();
+			PoolByteArray::Read r = tile.redo.read();
+			xor_buffer(w.ptr(), r.ptr(), step._tile_bytes);
+		}
+
+		step._chunk_positions.push_back(cpos);
+		step._tiles.push_back(tile);
+	}
+
+	undo_chunks.clear();
+
+	// Only the latest step stays uncompressed
+	if (_steps.size() != 0)
+		_steps.back()->get()->compress();
+
+	step._in_store = true;
+	_steps.push_back(&step);
+	step.update_memory_usage();
+
+	enforce_budget();
+
+	return step_ref;
+}
+
+void HeightMapUndoStore::remove_step(HeightMapUndoStep *step) {
+	add_memory_usage(-step->_memory_usage);
+	step->_in_store = false;
+	_steps.erase(step);
+}
+
+void HeightMapUndoStore::add_memory_usage(int delta) {
+	ERR_FAIL_COND(delta < 0 && (uint64_t)(-delta) > _memory_usage);
+	_memory_usage += delta;
+}
+
+void HeightMapUndoStore::enforce_budget() {
+
+	// The latest step is always kept in memory, even if it's bigger than the budget
+	while (_memory_usage > _memory_budget && _steps.size() > 1) {
+
+		HeightMapUndoStep *step = _steps.front()->get();
+
+		FileAccess *f = get_spill_file();
+		if (f == NULL || !step->spill(*f)) {
+			// Dropping it would leave UndoRedo with a step it can't apply anymore,
+			// so it stays in memory, over budget
+			if (!_over_budget_warned) {
+				WARN_PRINT("Terrain undo is over its memory budget and couldn't be spilled to disk, keeping it in memory");
+				_over_budget_warned = true;
+			}
+			return;
+		}
+
+		remove_step(step);
+		_over_budget_warned = false;
+	}
+}
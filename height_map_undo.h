@@ -0,0 +1,137 @@
+#ifndef HEIGHT_MAP_UNDO_H
+#define HEIGHT_MAP_UNDO_H
+
+#include <core/hash_map.h>
+#include <core/image.h>
+#include <core/list.h>
+#include <core/os/file_access.h>
+#include <core/reference.h>
+
+// Terrain data of one undo step: chunks of one channel, before and after an edit.
+// Each chunk is stored as its state after the edit, plus its state before XORed against it.
+// Most of that XOR is zeros, so it compresses very well.
+// Steps are created and freed by the editor, from the main thread only.
+class HeightMapUndoStep : public Reference {
+	GDCLASS(HeightMapUndoStep, Reference)
+public:
+	HeightMapUndoStep();
+	~HeightMapUndoStep();
+
+	inline int get_channel() const { return _channel; }
+	inline int get_chunk_size() const { return _chunk_size; }
+	inline const Vector<Point2i> &get_chunk_positions() const { return _chunk_positions; }
+
+	// Decodes chunks as they were before the edit, or after it if `redo` is true, in the same order as positions.
+	// Returns false if spilled data couldn't be read back.
+	bool get_chunk_images(bool redo, Vector<Ref<Image> > &out_images) const;
+
+	inline int get_memory_usage() const { return _memory_usage; }
+	inline bool is_compressed() const { return _compressed; }
+	inline bool is_spilled() const { return _spilled; }
+
+private:
+	friend class HeightMapUndoStore;
+
+	struct Tile {
+		PoolByteArray redo;
+		PoolByteArray undo_xor;
+		// Where compressed data is once spilled to disk, with undo following redo
+		uint64_t spill_offset;
+		int redo_size;
+		int undo_xor_size;
+		Tile() : spill_offset(0), redo_size(0), undo_xor_size(0) {}
+	};
+
+	static void _bind_methods() {}
+
+	void compress();
+	bool spill(FileAccess &f);
+	void update_memory_usage();
+
+	bool decode_tile(const Tile &tile, bool redo, PoolByteArray &out_data) const;
+
+private:
+	int _channel;
+	int _chunk_size;
+	Image::Format _format;
+	int _tile_bytes;
+	Vector<Point2i> _chunk_positions;
+	Vector<Tile> _tiles;
+	bool _compressed;
+	bool _spilled;
+	bool _in_store;
+	int _memory_usage;
+};
+
+// Owns the memory budget of terrain undo, and recycles the buffers used to back up chunks while painting.
+// The most recent step is kept uncompressed so undoing right after painting is fast, older ones get compressed.
+// Those that don't fit in the budget are moved to a temporary file, and read back from it when they get applied.
+// Steps are never dropped, if they can't be moved they just stay in memory over budget.
+class HeightMapUndoStore {
+public:
+	static void create_singleton();
+	static void free_singleton();
+	static HeightMapUndoStore *get_singleton() { return s_singleton; }
+
+	HeightMapUndoStore();
+	~HeightMapUndoStore();
+
+	// Maximum amount of memory used by undo steps, in bytes
+	void set_memory_budget(uint64_t bytes);
+	uint64_t get_memory_budget() const { return _memory_budget; }
+	uint64_t get_memory_usage() const { return _memory_usage; }
+
+	// File where steps go when over budget. If empty, they stay in memory instead.
+	void set_spill_path(String path);
+	String get_spill_path() const { return _spill_path; }
+
+	// Buffers of a fixed size, to be given back once not needed anymore
+	PoolByteArray acquire_tile(int size);
+	void release_tile(PoolByteArray tile);
+
+	// Makes a step from chunks backed up before an edit and the image after it.
+	// Takes ownership of the backed up chunks.
+	Ref<HeightMapUndoStep> create_step(const Image &im, int channel, int chunk_size, HashMap<Point2i, PoolByteArray> &undo_chunks);
+
+private:
+	friend class HeightMapUndoStep;
+
+	void remove_step(HeightMapUndoStep *step);
+	FileAccess *get_spill_file();
+	bool read_spilled(uint64_t offset, int size, PoolByteArray &out_data);
+	uint64_t allocate_spill_range(uint64_t size);
+	void free_spill_range(uint64_t offset, uint64_t size);
+	void close_spill_file();
+	void add_memory_usage(int delta);
+	void enforce_budget();
+
+private:
+	static HeightMapUndoStore *s_singleton;
+
+	// Oldest first
+	List<HeightMapUndoStep *> _steps;
+	HashMap<int, Vector<PoolByteArray> > _free_tiles;
+	uint64_t _memory_budget;
+	uint64_t _memory_usage;
+
+	String _spill_path;
+	FileAccess *_spill_file;
+	// Path the file was opened with, the other one may have changed since
+	String _spill_file_path;
+	// Spilled steps still alive. Once there are none left, the file can start over.
+	int _spilled_count;
+
+	struct SpillRange {
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	// Space left by freed steps, reused before the file grows. Sorted by offset, never touching each other.
+	Vector<SpillRange> _spill_free_ranges;
+	// End of the last range in use
+	uint64_t _spill_file_end;
+	// So the warning isn't printed on every stroke
+	bool _over_budget_warned;
+};
+
+#endif // HEIGHT_MAP_UNDO_H
@@ -62,6 +62,7 @@ public:
 		_max_depth = 0;
 		_base_size = 0;
 		_split_scale = 2;
+		_max_distance = 0;
 
 		_callbacks_context = NULL;
 		_make_func = NULL;
@@ -123,9 +124,19 @@ public:
 		return _split_scale;
 	}
 
+	// Chunks farther than this distance won't be created, so something else can render them.
+	// Zero means no limit.
+	void set_max_distance(float max_distance) {
+		_max_distance = max_distance > 0 ? max_distance : 0;
+	}
+
+	inline float get_max_distance() const {
+		return _max_distance;
+	}
+
 	void update(Vector3 viewer_pos) {
 		update_nodes_recursive(_tree, _max_depth, viewer_pos);
-		make_chunks_recursively(_tree, _max_depth);
+		make_chunks_recursively(_tree, _max_depth, viewer_pos);
 	}
 
 	// TODO Should be renamed get_lod_factor
@@ -155,6 +166,18 @@ private:
 			_recycle_func(_callbacks_context, chunk, origin, lod);
 	}
 
+	bool is_beyond_max_distance(const Node &node, int lod, Vector3 viewer_pos) const {
+		if (_max_distance == 0)
+			return false;
+		// Horizontal distance to the closest point of the node
+		real_t size = _base_size * get_lod_size(lod);
+		Vector2 min = size * Vector2(node.origin.x, node.origin.y);
+		Vector2 closest(
+				CLAMP(viewer_pos.x, min.x, min.x + size),
+				CLAMP(viewer_pos.z, min.y, min.y + size));
+		return closest.distance_to(Vector2(viewer_pos.x, viewer_pos.z)) > _max_distance;
+	}
+
 	void join_recursively(Node &node, int lod) {
 		if (node.has_children()) {
 			for (int i = 0; i < 4; ++i) {
@@ -202,6 +225,11 @@ private:
 			}
 		}
 
+		if (!node.has_children() && node.chunk && is_beyond_max_distance(node, lod, viewer_pos)) {
+			recycle_chunk(node.chunk, node.origin, lod);
+			node.chunk = T();
+		}
+
 		// TODO This will check all chunks every frame,
 		// we could find a way to recursively update chunks as they get joined/split,
 		// but in C++ that would be not even needed.
@@ -212,15 +240,15 @@ private:
 		}
 	}
 
-	void make_chunks_recursively(Node &node, int lod) {
+	void make_chunks_recursively(Node &node, int lod, Vector3 viewer_pos) {
 		ERR_FAIL_COND(lod < 0);
 		if (node.has_children()) {
 			for (int i = 0; i < 4; ++i) {
 				Node *child = node.children[i];
-				make_chunks_recursively(*child, lod - 1);
+				make_chunks_recursively(*child, lod - 1, viewer_pos);
 			}
 		} else {
-			if (!node.chunk) {
+			if (!node.chunk && !is_beyond_max_distance(node, lod, viewer_pos)) {
 				node.chunk = make_chunk(lod, node.origin);
 				// Note: if you don't return anything here,
 				// make_chunk will continue being called
@@ -247,6 +275,7 @@ private:
 	int _max_depth;
 	int _base_size;
 	float _split_scale;
+	float _max_distance;
 
 	MakeFunc _make_func;
 	RecycleFunc _recycle_func;
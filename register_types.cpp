@@ -4,6 +4,8 @@
 
 #include "height_map.h"
 #include "height_map_editor_plugin.h"
+#include "height_map_undo.h"
+#include "thread_pool.h"
 
 HeightMapDataSaver *s_heightmap_data_saver = NULL;
 HeightMapDataLoader *s_heightmap_data_loader = NULL;
@@ -16,7 +18,11 @@ void register_hterrain_types() {
 #ifndef _3D_DISABLED
 	ClassDB::register_class<HeightMap>();
 	ClassDB::register_class<HeightMapData>();
+	ClassDB::register_class<HeightMapSnapshot>();
+	ClassDB::register_class<HeightMapUndoStep>();
 
+	ThreadPool::create_singleton();
+	HeightMapUndoStore::create_singleton();
 	HeightMap::init_default_resources();
 
 	s_heightmap_data_saver = memnew(HeightMapDataSaver());
@@ -36,6 +42,8 @@ void unregister_hterrain_types() {
 #ifndef _3D_DISABLED
 
 	HeightMap::free_default_resources();
+	HeightMapUndoStore::free_singleton();
+	ThreadPool::free_singleton();
 
 	if(s_heightmap_data_saver) {
 		memdelete(s_heightmap_data_saver);
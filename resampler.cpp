@@ -0,0 +1,443 @@
+#include "resampler.h"
+#include "thread_pool.h"
+#include "utility.h"
+
+// Amount of destination samples done in one band
+#define RESAMPLE_BAND_SIZE (1024 * 1024)
+#define RESAMPLE_MIN_ROWS_PER_TASK 8
+
+namespace {
+
+// First pass, along X, for each source row of the band
+struct ResampleHorizontalAction {
+	const float *src;
+	float *dst;
+	int src_width;
+	int dst_width;
+	int channels;
+	int tap_count;
+	const int *indices;
+	const float *weights;
+
+	void operator()(int begin, int end) {
+		for (int y = begin; y < end; ++y) {
+			const float *src_row = src + y * src_width * channels;
+			float *dst_row = dst + y * dst_width * channels;
+
+			for (int x = 0; x < dst_width; ++x) {
+				const int *xi = indices + x * tap_count;
+				const float *xw = weights + x * tap_count;
+
+				for (int c = 0; c < channels; ++c) {
+					float sum = 0;
+					for (int t = 0; t < tap_count; ++t) {
+						sum += src_row[xi[t] * channels + c] * xw[t];
+					}
+					dst_row[x * channels + c] = sum;
+				}
+			}
+		}
+	}
+};
+
+// Second pass, along Y, for each destination row of the band
+struct ResampleVerticalAction {
+	const float *src;
+	float *dst;
+	int row_size;
+	int tap_count;
+	// Relative to the first source row of the band
+	const int *indices;
+	const float *weights;
+
+	void operator()(int begin, int end) {
+		for (int y = begin; y < end; ++y) {
+			const int *yi = indices + y * tap_count;
+			const float *yw = weights + y * tap_count;
+			float *dst_row = dst + y * row_size;
+
+			for (int i = 0; i < row_size; ++i) {
+				float sum = 0;
+				for (int t = 0; t < tap_count; ++t) {
+					sum += src[yi[t] * row_size + i] * yw[t];
+				}
+				dst_row[i] = sum;
+			}
+		}
+	}
+};
+
+inline float decode_sample(uint16_t v) {
+	return decode_height(v);
+}
+
+inline float decode_sample(uint8_t v) {
+	return v;
+}
+
+inline void encode_sample(float v, uint16_t &out) {
+	out = encode_height(v);
+}
+
+inline void encode_sample(float v, uint8_t &out) {
+	out = CLAMP(Math::fast_ftoi(v), 0, 255);
+}
+
+template <typename T>
+struct DecodeRowsAction {
+	const ImageRawView<T> *pixels;
+	int y0;
+	float *out;
+
+	void operator()(int begin, int end) {
+		int pitch = pixels->get_pitch();
+		for (int y = begin; y < end; ++y) {
+			const T *row = pixels->row(y0 + y);
+			float *out_row = out + y * pitch;
+			for (int x = 0; x < pitch; ++x) {
+				out_row[x] = decode_sample(row[x]);
+			}
+		}
+	}
+};
+
+template <typename T>
+struct EncodeRowsAction {
+	const ImageRawWrite<T> *pixels;
+	int y0;
+	const float *in;
+	// Rows of `in` can be narrower than the image, the rest repeats their last pixel
+	int width;
+	int channels;
+
+	void operator()(int begin, int end) {
+		int pitch = pixels->get_pitch();
+		int in_pitch = width * channels;
+		for (int y = begin; y < end; ++y) {
+			T *row = pixels->row(y0 + y);
+			const float *in_row = in + y * in_pitch;
+			for (int x = 0; x < in_pitch; ++x) {
+				encode_sample(in_row[x], row[x]);
+			}
+			for (int x = in_pitch; x < pitch; ++x) {
+				row[x] = row[x - channels];
+			}
+		}
+	}
+};
+
+template <typename T>
+void decode_rows(const Image &im, int y0, int count, float *out) {
+	ImageRawView<T> pixels(im);
+	DecodeRowsAction<T> action;
+	action.pixels = &pixels;
+	action.y0 = y0;
+	action.out = out;
+	ThreadPool::get_singleton()->parallel_for(count, action, RESAMPLE_MIN_ROWS_PER_TASK);
+}
+
+template <typename T>
+void encode_rows(Image &im, int y0, int count, int width, int channels, const float *in) {
+	ImageRawWrite<T> pixels(im);
+	EncodeRowsAction<T> action;
+	action.pixels = &pixels;
+	action.y0 = y0;
+	action.in = in;
+	action.width = width;
+	action.channels = channels;
+	ThreadPool::get_singleton()->parallel_for(count, action, RESAMPLE_MIN_ROWS_PER_TASK);
+}
+
+// Repeats a row down to the bottom of the image
+void fill_rows_below(Image &im, int y) {
+	ImageRawWrite<uint8_t> pixels(im);
+	const uint8_t *src = pixels.row(y);
+	for (int i = y + 1; i < pixels.get_height(); ++i) {
+		copymem(pixels.row(i), src, pixels.get_pitch());
+	}
+}
+
+inline int get_format_channel_count(Image::Format format) {
+	if (format == Image::FORMAT_RH)
+		return 1;
+	return Image::get_format_pixel_size(format);
+}
+
+// Both are 1 at 0, and 0 at every other integer
+float filter_weight(ResampleFilter filter, float d) {
+	d = Math::abs(d);
+	if (filter == RESAMPLE_BILINEAR)
+		return MAX(1.f - d, 0.f);
+	// Catmull-Rom
+	if (d < 1.f)
+		return (1.5f * d - 2.5f) * d * d + 1.f;
+	if (d < 2.f)
+		return ((-0.5f * d + 2.5f) * d - 4.f) * d + 2.f;
+	return 0;
+}
+
+// Channels of 8-bit formats are simply their bytes
+bool is_supported_format(Image::Format format) {
+	switch (format) {
+		case Image::FORMAT_RH:
+		case Image::FORMAT_L8:
+		case Image::FORMAT_R8:
+		case Image::FORMAT_RG8:
+		case Image::FORMAT_RGB8:
+		case Image::FORMAT_RGBA8:
+			return true;
+		default:
+			return false;
+	}
+}
+
+} // namespace
+
+Resampler::Resampler() {
+	_src = NULL;
+	_dst = NULL;
+	_filter = RESAMPLE_BILINEAR;
+	_channels = 0;
+	_band_rows = 0;
+	_band_count = 0;
+	_x_tap_count = 0;
+	_y_tap_count = 0;
+}
+
+float Resampler::get_filter_radius() const {
+	switch (_filter) {
+		case RESAMPLE_NEAREST:
+			return 0.5f;
+		case RESAMPLE_BILINEAR:
+			return 1;
+		default:
+			return 2;
+	}
+}
+
+int Resampler::get_tap_count(float scale) const {
+	// Nearest is for data that can't be blended, so it can't be widened either
+	if (_filter == RESAMPLE_NEAREST)
+		return 1;
+	return Math::ceil(2.f * get_filter_radius() * MAX(scale, 1.f));
+}
+
+void Resampler::compute_taps(int dst_pos, int src_size, float scale, int tap_count, int *indices, float *weights) const {
+
+	float s = dst_pos * scale;
+
+	if (_filter == RESAMPLE_NEAREST) {
+		indices[0] = CLAMP(Math::fast_ftoi(s), 0, src_size - 1);
+		weights[0] = 1;
+		return;
+	}
+
+	// Scaling down stretches the filter over as many source samples as there are per destination sample
+	float stretch = MAX(scale, 1.f);
+	int first = Math::floor(s - get_filter_radius() * stretch) + 1;
+
+	float sum = 0;
+	for (int t = 0; t < tap_count; ++t) {
+		int i = first + t;
+		indices[t] = CLAMP(i, 0, src_size - 1);
+		weights[t] = filter_weight(_filter, (i - s) / stretch);
+		sum += weights[t];
+	}
+
+	// Stretched weights don't add up to 1
+	if (sum != 0) {
+		for (int t = 0; t < tap_count; ++t) {
+			weights[t] /= sum;
+		}
+	}
+}
+
+void Resampler::begin(ResampleSource &src, ResampleDestination &dst, ResampleFilter filter) {
+
+	_src = &src;
+	_dst = &dst;
+	_filter = filter;
+	_src_size = src.get_size();
+	_dst_size = dst.get_size();
+	_channels = src.get_channel_count();
+	_band_count = 0;
+
+	ERR_FAIL_COND(filter < 0 || filter >= RESAMPLE_FILTER_COUNT);
+	ERR_FAIL_COND(_src_size.x <= 0 || _src_size.y <= 0 || _dst_size.x <= 0 || _dst_size.y <= 0);
+	ERR_FAIL_COND(_channels <= 0);
+
+	// Corners map to corners
+	_scale.x = _dst_size.x > 1 ? static_cast<float>(_src_size.x - 1) / (_dst_size.x - 1) : 0;
+	_scale.y = _dst_size.y > 1 ? static_cast<float>(_src_size.y - 1) / (_dst_size.y - 1) : 0;
+
+	_x_tap_count = get_tap_count(_scale.x);
+	_y_tap_count = get_tap_count(_scale.y);
+
+	int tap_count = _x_tap_count;
+	_x_indices.resize(_dst_size.x * tap_count);
+	_x_weights.resize(_dst_size.x * tap_count);
+
+	for (int x = 0; x < _dst_size.x; ++x) {
+		compute_taps(x, _src_size.x, _scale.x, tap_count, &_x_indices[x * tap_count], &_x_weights[x * tap_count]);
+	}
+
+	_band_rows = MAX(RESAMPLE_BAND_SIZE / (_dst_size.x * _channels), 1);
+	_band_count = (_dst_size.y + _band_rows - 1) / _band_rows;
+}
+
+bool Resampler::process_band(int index) {
+
+	ERR_FAIL_INDEX_V(index, _band_count, false);
+
+	int tap_count = _y_tap_count;
+	int dy0 = index * _band_rows;
+	int dy1 = MIN(dy0 + _band_rows, _dst_size.y);
+	int dst_rows = dy1 - dy0;
+
+	Vector<int> y_indices;
+	Vector<float> y_weights;
+	y_indices.resize(dst_rows * tap_count);
+	y_weights.resize(dst_rows * tap_count);
+
+	int sy0 = _src_size.y;
+	int sy1 = 0;
+
+	for (int y = 0; y < dst_rows; ++y) {
+		int *yi = &y_indices[y * tap_count];
+		compute_taps(dy0 + y, _src_size.y, _scale.y, tap_count, yi, &y_weights[y * tap_count]);
+		for (int t = 0; t < tap_count; ++t) {
+			sy0 = MIN(sy0, yi[t]);
+			sy1 = MAX(sy1, yi[t] + 1);
+		}
+	}
+
+	for (int i = 0; i < y_indices.size(); ++i) {
+		y_indices[i] -= sy0;
+	}
+
+	int src_rows = sy1 - sy0;
+	int src_row_size = _src_size.x * _channels;
+	int dst_row_size = _dst_size.x * _channels;
+
+	if (_src_buffer.size() < src_rows * src_row_size)
+		_src_buffer.resize(src_rows * src_row_size);
+	if (_h_buffer.size() < src_rows * dst_row_size)
+		_h_buffer.resize(src_rows * dst_row_size);
+	if (_dst_buffer.size() < dst_rows * dst_row_size)
+		_dst_buffer.resize(dst_rows * dst_row_size);
+
+	float *src_buffer = &_src_buffer[0];
+	float *h_buffer = &_h_buffer[0];
+	float *dst_buffer = &_dst_buffer[0];
+
+	if (!_src->read_rows(sy0, src_rows, src_buffer))
+		return false;
+
+	ThreadPool &pool = *ThreadPool::get_singleton();
+
+	ResampleHorizontalAction h_action;
+	h_action.src = src_buffer;
+	h_action.dst = h_buffer;
+	h_action.src_width = _src_size.x;
+	h_action.dst_width = _dst_size.x;
+	h_action.channels = _channels;
+	h_action.tap_count = _x_tap_count;
+	h_action.indices = _x_indices.ptr();
+	h_action.weights = _x_weights.ptr();
+	pool.parallel_for(src_rows, h_action, RESAMPLE_MIN_ROWS_PER_TASK);
+
+	ResampleVerticalAction v_action;
+	v_action.src = h_buffer;
+	v_action.dst = dst_buffer;
+	v_action.row_size = dst_row_size;
+	v_action.tap_count = tap_count;
+	v_action.indices = y_indices.ptr();
+	v_action.weights = y_weights.ptr();
+	pool.parallel_for(dst_rows, v_action, RESAMPLE_MIN_ROWS_PER_TASK);
+
+	_dst->write_rows(dy0, dst_rows, dst_buffer);
+	return true;
+}
+
+bool Resampler::resample(ResampleSource &src, ResampleDestination &dst, ResampleFilter filter) {
+	Resampler resampler;
+	resampler.begin(src, dst, filter);
+	for (int i = 0; i < resampler.get_band_count(); ++i) {
+		if (!resampler.process_band(i))
+			return false;
+	}
+	return true;
+}
+
+ImageResampleSource::ImageResampleSource(const Image &im) :
+		_image(im) {
+	ERR_FAIL_COND(!is_supported_format(im.get_format()));
+}
+
+Point2i ImageResampleSource::get_size() const {
+	return Point2i(_image.get_width(), _image.get_height());
+}
+
+int ImageResampleSource::get_channel_count() const {
+	return get_format_channel_count(_image.get_format());
+}
+
+bool ImageResampleSource::read_rows(int y0, int count, float *out) {
+	ERR_FAIL_COND_V(y0 < 0 || y0 + count > _image.get_height(), false);
+	if (_image.get_format() == Image::FORMAT_RH)
+		decode_rows<uint16_t>(_image, y0, count, out);
+	else
+		decode_rows<uint8_t>(_image, y0, count, out);
+	return true;
+}
+
+ImageResampleDestination::ImageResampleDestination(Image &im) :
+		_image(im),
+		_size(im.get_width(), im.get_height()) {
+	ERR_FAIL_COND(!is_supported_format(im.get_format()));
+}
+
+ImageResampleDestination::ImageResampleDestination(Image &im, Point2i size) :
+		_image(im),
+		_size(size) {
+	ERR_FAIL_COND(!is_supported_format(im.get_format()));
+	ERR_FAIL_COND(size.x <= 0 || size.y <= 0 || size.x > im.get_width() || size.y > im.get_height());
+}
+
+Point2i ImageResampleDestination::get_size() const {
+	return _size;
+}
+
+void ImageResampleDestination::write_rows(int y0, int count, const float *in) {
+	ERR_FAIL_COND(y0 < 0 || y0 + count > _size.y);
+
+	int channels = get_format_channel_count(_image.get_format());
+	if (_image.get_format() == Image::FORMAT_RH)
+		encode_rows<uint16_t>(_image, y0, count, _size.x, channels, in);
+	else
+		encode_rows<uint8_t>(_image, y0, count, _size.x, channels, in);
+
+	if (y0 + count == _size.y && _size.y < _image.get_height())
+		fill_rows_below(_image, _size.y - 1);
+}
+
+void resample_image(Image &im, Point2i size, ResampleFilter filter) {
+
+	ERR_FAIL_COND(!is_supported_format(im.get_format()));
+
+	if (size == Point2i(im.get_width(), im.get_height()))
+		return;
+
+	Ref<Image> dst;
+	dst.instance();
+	dst->create(size.x, size.y, false, im.get_format());
+
+	{
+		ImageResampleSource source(im);
+		ImageResampleDestination destination(**dst);
+		if (!Resampler::resample(source, destination, filter))
+			return;
+	}
+
+	im.create(size.x, size.y, false, im.get_format(), dst->get_data());
+}
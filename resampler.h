@@ -0,0 +1,102 @@
+#ifndef HEIGHTMAP_RESAMPLER_H
+#define HEIGHTMAP_RESAMPLER_H
+
+#include <core/image.h>
+#include <core/vector.h>
+
+enum ResampleFilter {
+	RESAMPLE_NEAREST = 0,
+	RESAMPLE_BILINEAR,
+	// Catmull-Rom
+	RESAMPLE_BICUBIC,
+	RESAMPLE_FILTER_COUNT
+};
+
+// Gives rows of samples as floats, with channels interleaved
+class ResampleSource {
+public:
+	virtual ~ResampleSource() {}
+	virtual Point2i get_size() const = 0;
+	virtual int get_channel_count() const = 0;
+	virtual bool read_rows(int y0, int count, float *out) = 0;
+};
+
+class ResampleDestination {
+public:
+	virtual ~ResampleDestination() {}
+	virtual Point2i get_size() const = 0;
+	virtual void write_rows(int y0, int count, const float *in) = 0;
+};
+
+// Scales a grid of samples to another size, keeping corners aligned since our grids are made of vertices.
+// When scaling down, the filter gets wider by the same ratio so every source sample contributes, instead of aliasing.
+// The destination is done in bands of rows, so only the source rows needed by one band are read at a time.
+// That allows to stream big sources, and to report progress between bands.
+// Within a band, the work is split across threads.
+class Resampler {
+public:
+	Resampler();
+
+	void begin(ResampleSource &src, ResampleDestination &dst, ResampleFilter filter);
+	int get_band_count() const { return _band_count; }
+	bool process_band(int index);
+
+	// Does all bands at once
+	static bool resample(ResampleSource &src, ResampleDestination &dst, ResampleFilter filter);
+
+private:
+	float get_filter_radius() const;
+	int get_tap_count(float scale) const;
+	void compute_taps(int dst_pos, int src_size, float scale, int tap_count, int *indices, float *weights) const;
+
+private:
+	ResampleSource *_src;
+	ResampleDestination *_dst;
+	ResampleFilter _filter;
+	Point2i _src_size;
+	Point2i _dst_size;
+	int _channels;
+	Vector2 _scale;
+	int _band_rows;
+	int _band_count;
+	int _x_tap_count;
+	int _y_tap_count;
+
+	// Taps along X are the same for every row
+	Vector<int> _x_indices;
+	Vector<float> _x_weights;
+
+	Vector<float> _src_buffer;
+	Vector<float> _h_buffer;
+	Vector<float> _dst_buffer;
+};
+
+// Reads or writes images of heights (half floats) or 8-bit channels
+class ImageResampleSource : public ResampleSource {
+public:
+	ImageResampleSource(const Image &im);
+	Point2i get_size() const;
+	int get_channel_count() const;
+	bool read_rows(int y0, int count, float *out);
+
+private:
+	const Image &_image;
+};
+
+class ImageResampleDestination : public ResampleDestination {
+public:
+	ImageResampleDestination(Image &im);
+	// Only fills the top-left area of the given size, the rest of the image gets the values at its edges
+	ImageResampleDestination(Image &im, Point2i size);
+	Point2i get_size() const;
+	void write_rows(int y0, int count, const float *in);
+
+private:
+	Image &_image;
+	Point2i _size;
+};
+
+// Resamples an image in place, keeping its format
+void resample_image(Image &im, Point2i size, ResampleFilter filter);
+
+#endif // HEIGHTMAP_RESAMPLER_H
@@ -11,6 +11,12 @@ const char *s_default_shader_code =
 	"uniform sampler2D mask_texture;\n"
 	"uniform vec2 heightmap_resolution;\n"
 	"uniform mat4 heightmap_inverse_transform;\n"
+	"// Chunks are drawn up to the max distance from the viewer and the proxy from the min distance, zero if there is none\n"
+	"uniform vec3 heightmap_viewer_position;\n"
+	"uniform float heightmap_max_distance;\n"
+	"uniform float heightmap_min_distance;\n"
+	"\n"
+	"varying vec2 terrain_pos;\n"
 	"\n"
 	"vec3 unpack_normal(vec3 rgb) {\n"
 	"\treturn rgb * 2.0 - vec3(1.0);\n"
@@ -19,6 +25,7 @@ const char *s_default_shader_code =
 	"void vertex() {\n"
 	"\tvec4 tv = heightmap_inverse_transform * WORLD_MATRIX * vec4(VERTEX, 1);\n"
 	"\tvec2 uv = vec2(tv.x,tv.z) / heightmap_resolution;\n"
+	"\tterrain_pos = tv.xz;\n"
 	"\tfloat h = texture(height_texture, uv).r;\n"
 	"\tVERTEX.y = h;\n"
 	"\tUV = uv;\n"
@@ -27,6 +34,13 @@ const char *s_default_shader_code =
 	"\n"
 	"void fragment() {\n"
 	"\n"
+	"\t// Chunks reach past that distance, this keeps them from drawing over the proxy\n"
+	"\tfloat viewer_distance = distance(terrain_pos, heightmap_viewer_position.xz);\n"
+	"\tif(heightmap_max_distance > 0.0 && viewer_distance > heightmap_max_distance)\n"
+	"\t\tdiscard;\n"
+	"\tif(viewer_distance < heightmap_min_distance)\n"
+	"\t\tdiscard;\n"
+	"\n"
 	"\tfloat mask = texture(mask_texture, UV).r;\n"
 	"\tif(mask > 0.5)\n"
 	"\t\tdiscard;\n"
@@ -39,3 +53,33 @@ const char *s_default_shader_code =
 	"\tALBEDO = texture(color_texture, UV).rgb;\n"
 	"}\n"
 	"\n";
+
+const char *s_proxy_shader_code =
+	"shader_type spatial;\n"
+	"\n"
+	"uniform sampler2D color_texture;\n"
+	"uniform sampler2D mask_texture;\n"
+	"uniform vec3 heightmap_viewer_position;\n"
+	"uniform float heightmap_min_distance;\n"
+	"\n"
+	"varying vec2 terrain_pos;\n"
+	"\n"
+	"// The proxy mesh is in terrain space with heights and normals baked in,\n"
+	"// so no displacement is needed here.\n"
+	"\n"
+	"void vertex() {\n"
+	"\tterrain_pos = VERTEX.xz;\n"
+	"}\n"
+	"\n"
+	"void fragment() {\n"
+	"\n"
+	"\t// Closer terrain is rendered by LOD chunks\n"
+	"\tif(distance(terrain_pos, heightmap_viewer_position.xz) < heightmap_min_distance)\n"
+	"\t\tdiscard;\n"
+	"\n"
+	"\tfloat mask = texture(mask_texture, UV).r;\n"
+	"\tif(mask > 0.5)\n"
+	"\t\tdiscard;\n"
+	"\n"
+	"\tALBEDO = texture(color_texture, UV).rgb;\n"
+	"}\n";
@@ -0,0 +1,198 @@
+#include <core/os/os.h>
+
+#include "thread_pool.h"
+
+ThreadPool *ThreadPool::s_singleton = NULL;
+
+void ThreadPool::create_singleton() {
+	ERR_FAIL_COND(s_singleton != NULL);
+	// Keep one core for the main thread
+	int thread_count = MAX(OS::get_singleton()->get_processor_count() - 1, 1);
+	s_singleton = memnew(ThreadPool(thread_count));
+}
+
+void ThreadPool::free_singleton() {
+	ERR_FAIL_COND(s_singleton == NULL);
+	memdelete(s_singleton);
+	s_singleton = NULL;
+}
+
+ThreadPool::ThreadPool(int thread_count) {
+
+	_stop = false;
+	_mutex = Mutex::create();
+	_semaphore = Semaphore::create();
+
+	for (int i = 0; i < thread_count; ++i) {
+		Thread *thread = Thread::create(thread_func, this);
+		ERR_CONTINUE(thread == NULL);
+		_threads.push_back(thread);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+
+	_mutex->lock();
+	_stop = true;
+	if (_queue.size() != 0) {
+		WARN_PRINT("ThreadPool destroyed while tasks are still queued");
+	}
+	_mutex->unlock();
+
+	for (int i = 0; i < _threads.size(); ++i) {
+		_semaphore->post();
+	}
+
+	for (int i = 0; i < _threads.size(); ++i) {
+		Thread::wait_to_finish(_threads[i]);
+		memdelete(_threads[i]);
+	}
+
+	for (int i = 0; i < _free_semaphores.size(); ++i) {
+		memdelete(_free_semaphores[i]);
+	}
+
+	memdelete(_semaphore);
+	memdelete(_mutex);
+}
+
+void ThreadPool::enqueue(Task *task) {
+	ERR_FAIL_COND(task == NULL);
+
+	_mutex->lock();
+	task->_done = false;
+	_queue.push_back(task);
+	_mutex->unlock();
+
+	_semaphore->post();
+}
+
+void ThreadPool::enqueue_urgent(Task *task) {
+	ERR_FAIL_COND(task == NULL);
+
+	// Someone is waiting for these, so they go before background tasks
+	_mutex->lock();
+	task->_done = false;
+	_queue.push_front(task);
+	_mutex->unlock();
+
+	_semaphore->post();
+}
+
+bool ThreadPool::is_done(const Task *task) const {
+	_mutex->lock();
+	bool done = task->_done;
+	_mutex->unlock();
+	return done;
+}
+
+bool ThreadPool::try_dequeue(Task *task) {
+	_mutex->lock();
+	bool removed = _queue.erase(task);
+	_mutex->unlock();
+	return removed;
+}
+
+void ThreadPool::dequeue_or_wait(Task *task) {
+
+	// Taken before locking because it needs the mutex too. It's recycled, so that's cheap if it ends up unused.
+	Semaphore *semaphore = acquire_semaphore();
+
+	_mutex->lock();
+
+	if (_queue.erase(task) || task->_done) {
+		_mutex->unlock();
+		release_semaphore(semaphore);
+		return;
+	}
+
+	// It's running, the worker will post this once done
+	if (task->_completion_semaphore != NULL) {
+		_mutex->unlock();
+		release_semaphore(semaphore);
+		ERR_PRINT("Task is already being waited for");
+		return;
+	}
+	task->_completion_semaphore = semaphore;
+
+	_mutex->unlock();
+
+	semaphore->wait();
+
+	_mutex->lock();
+	task->_completion_semaphore = NULL;
+	_mutex->unlock();
+
+	release_semaphore(semaphore);
+}
+
+Semaphore *ThreadPool::acquire_semaphore() {
+
+	_mutex->lock();
+	Semaphore *semaphore = NULL;
+	if (_free_semaphores.size() != 0) {
+		semaphore = _free_semaphores[_free_semaphores.size() - 1];
+		_free_semaphores.resize(_free_semaphores.size() - 1);
+	}
+	_mutex->unlock();
+
+	if (semaphore == NULL)
+		semaphore = Semaphore::create();
+
+	return semaphore;
+}
+
+void ThreadPool::release_semaphore(Semaphore *semaphore) {
+	_mutex->lock();
+	_free_semaphores.push_back(semaphore);
+	_mutex->unlock();
+}
+
+bool ThreadPool::is_worker_thread() const {
+	Thread::ID id = Thread::get_caller_id();
+	for (int i = 0; i < _threads.size(); ++i) {
+		if (_threads[i]->get_id() == id)
+			return true;
+	}
+	return false;
+}
+
+void ThreadPool::thread_func(void *p_self) {
+	ThreadPool *self = reinterpret_cast<ThreadPool *>(p_self);
+	self->thread_loop();
+}
+
+void ThreadPool::thread_loop() {
+
+	while (true) {
+
+		_semaphore->wait();
+
+		_mutex->lock();
+
+		if (_stop) {
+			_mutex->unlock();
+			break;
+		}
+
+		Task *task = NULL;
+		if (_queue.size() != 0) {
+			task = _queue.front()->get();
+			_queue.pop_front();
+		}
+
+		_mutex->unlock();
+
+		if (task) {
+			task->run();
+
+			_mutex->lock();
+			task->_done = true;
+			Semaphore *completion_semaphore = task->_completion_semaphore;
+			_mutex->unlock();
+
+			if (completion_semaphore)
+				completion_semaphore->post();
+		}
+	}
+}
@@ -0,0 +1,138 @@
+#ifndef HEIGHTMAP_THREAD_POOL_H
+#define HEIGHTMAP_THREAD_POOL_H
+
+#include <core/list.h>
+#include <core/os/mutex.h>
+#include <core/os/semaphore.h>
+#include <core/os/thread.h>
+#include <core/vector.h>
+
+// Fixed set of worker threads shared by terrains.
+// It can run tasks in the background, or split work across all threads and wait for it.
+class ThreadPool {
+public:
+	class Task {
+	public:
+		Task() : _done(false), _completion_semaphore(NULL) {}
+		virtual ~Task() {}
+		virtual void run() = 0;
+
+	private:
+		friend class ThreadPool;
+		bool _done;
+		// Posted once the task is done, after which the pool doesn't touch it anymore
+		Semaphore *_completion_semaphore;
+	};
+
+	static void create_singleton();
+	static void free_singleton();
+	static ThreadPool *get_singleton() { return s_singleton; }
+
+	ThreadPool(int thread_count);
+	~ThreadPool();
+
+	int get_thread_count() const { return _threads.size(); }
+
+	// The task is not owned by the pool, it must stay alive until it's done or dequeued
+	void enqueue(Task *task);
+	bool is_done(const Task *task) const;
+
+	// Removes the task from the queue if no thread started it yet
+	bool try_dequeue(Task *task);
+
+	// Makes sure the task won't run anymore, waiting for it if it's already running
+	void dequeue_or_wait(Task *task);
+
+	// Calls `action(begin, end)` over sub-ranges of [0, count[ in parallel, and waits for all of them.
+	// The calling thread takes part in the work, and takes back sub-ranges no worker started yet,
+	// so it only waits for those already running even if workers are busy with long background tasks.
+	template <typename Action_T>
+	void parallel_for(int count, Action_T &action, int min_batch_size = 1) {
+
+		if (count <= 0)
+			return;
+
+		int batch_count = MIN(get_thread_count() + 1, count / MAX(min_batch_size, 1));
+
+		if (batch_count <= 1 || is_worker_thread()) {
+			// Not worth it, or we would wait on ourselves
+			action(0, count);
+			return;
+		}
+
+		Semaphore *semaphore = acquire_semaphore();
+		ERR_FAIL_COND(semaphore == NULL);
+
+		Vector<RangeTask<Action_T> > tasks;
+		tasks.resize(batch_count);
+
+		int begin = 0;
+		for (int i = 0; i < batch_count; ++i) {
+			int end = (count * (i + 1)) / batch_count;
+			RangeTask<Action_T> &task = tasks[i];
+			task.action = &action;
+			task.begin = begin;
+			task.end = end;
+			task._completion_semaphore = semaphore;
+			begin = end;
+		}
+
+		for (int i = 1; i < batch_count; ++i) {
+			enqueue_urgent(&tasks[i]);
+		}
+
+		tasks[0].run();
+
+		// Workers take tasks from the front of the queue, the last enqueued first, so we start from the other end
+		int running_count = 0;
+		for (int i = 1; i < batch_count; ++i) {
+			if (try_dequeue(&tasks[i]))
+				tasks[i].run();
+			else
+				++running_count;
+		}
+
+		for (int i = 0; i < running_count; ++i) {
+			semaphore->wait();
+		}
+
+		release_semaphore(semaphore);
+	}
+
+private:
+	template <typename Action_T>
+	class RangeTask : public Task {
+	public:
+		Action_T *action;
+		int begin;
+		int end;
+
+		RangeTask() : action(NULL), begin(0), end(0) {}
+
+		void run() {
+			(*action)(begin, end);
+		}
+	};
+
+	void enqueue_urgent(Task *task);
+	bool is_worker_thread() const;
+
+	// Semaphores used to wait for tasks are recycled, they are back to zero once given back
+	Semaphore *acquire_semaphore();
+	void release_semaphore(Semaphore *semaphore);
+
+	static void thread_func(void *p_self);
+	void thread_loop();
+
+private:
+	static ThreadPool *s_singleton;
+
+	Vector<Thread *> _threads;
+	List<Task *> _queue;
+	Mutex *_mutex;
+	Semaphore *_semaphore;
+	Vector<Semaphore *> _free_semaphores;
+	bool _stop;
+};
+
+#endif // HEIGHTMAP_THREAD_POOL_H
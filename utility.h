@@ -19,6 +19,174 @@ void copy_to(PoolVector<T> &to, Vector<T> &from) {
 
 void clamp_min_max_excluded(Point2i &out_min, Point2i &out_max, Point2i min, Point2i max);
 
+// Gives direct read access to the pixels of an image, bypassing the Color conversion done by get_pixel.
+// Image doesn't expose the pointer it holds while locked, so we go through a shared reference of its PoolVector.
+// Reading doesn't copy anything, but it must not be used to write since other holders of the buffer would see it.
+template <typename T>
+class ImageRawView {
+public:
+	ImageRawView(const Image &im) :
+			_data(im.get_data()),
+			_read(_data.read()) {
+
+		_width = im.get_width();
+		_height = im.get_height();
+		_pitch = _width * Image::get_format_pixel_size(im.get_format()) / sizeof(T);
+		_ptr = (const T *)_read.ptr();
+	}
+
+	inline int get_width() const { return _width; }
+	inline int get_height() const { return _height; }
+	inline Point2i get_size() const { return Point2i(_width, _height); }
+
+	// Amount of T in one row
+	inline int get_pitch() const { return _pitch; }
+
+	inline const T *row(int y) const { return _ptr + y * _pitch; }
+	inline const T *ptr() const { return _ptr; }
+
+private:
+	PoolVector<uint8_t> _data;
+	PoolVector<uint8_t>::Read _read;
+	const T *_ptr;
+	int _width;
+	int _height;
+	int _pitch;
+};
+
+// Gives direct write access to the pixels of an image, like set_pixel does between lock() and unlock().
+// Locking makes the image take a Write on its buffer, which copies it first if anything else shares it
+// (a texture, a snapshot, a raw view), so they keep seeing the pixels as they were.
+// Image doesn't expose the pointer of that Write, so it's reached through a shared reference of the buffer.
+template <typename T>
+class ImageRawWrite {
+public:
+	ImageRawWrite(Image &im) :
+			_image(im) {
+
+		_width = im.get_width();
+		_height = im.get_height();
+		_pitch = _width * Image::get_format_pixel_size(im.get_format()) / sizeof(T);
+
+		_image.lock();
+		_data = im.get_data();
+		_read = _data.read();
+		// The image holds the write lock, so this is the buffer it writes to
+		_ptr = const_cast<T *>((const T *)_read.ptr());
+	}
+
+	~ImageRawWrite() {
+		_read = PoolVector<uint8_t>::Read();
+		_data = PoolVector<uint8_t>();
+		_image.unlock();
+	}
+
+	inline int get_width() const { return _width; }
+	inline int get_height() const { return _height; }
+	inline Point2i get_size() const { return Point2i(_width, _height); }
+	inline int get_pitch() const { return _pitch; }
+
+	inline T *row(int y) const { return _ptr + y * _pitch; }
+	inline T *ptr() const { return _ptr; }
+
+private:
+	Image &_image;
+	PoolVector<uint8_t> _data;
+	PoolVector<uint8_t>::Read _read;
+	T *_ptr;
+	int _width;
+	int _height;
+	int _pitch;
+};
+
+// Heights are stored as half-floats
+inline float decode_height(uint16_t h) {
+	return Math::halfptr_to_float(&h);
+}
+
+inline uint16_t encode_height(float h) {
+	return Math::make_half_float(h);
+}
+
+// Bilinear height at a position in cells, clamped to the edges of the map.
+// Optionally gives the slope along X and Y too, which is what normals are made of.
+inline float sample_height_bilinear(const ImageRawView<uint16_t> &heights, float x, float y, Vector2 *out_gradient = NULL) {
+
+	int x0 = CLAMP(static_cast<int>(Math::floor(x)), 0, heights.get_width() - 2);
+	int y0 = CLAMP(static_cast<int>(Math::floor(y)), 0, heights.get_height() - 2);
+
+	float xf = CLAMP(x - x0, 0.f, 1.f);
+	float yf = CLAMP(y - y0, 0.f, 1.f);
+
+	const uint16_t *row0 = heights.row(y0) + x0;
+	const uint16_t *row1 = row0 + heights.get_pitch();
+
+	float h00 = decode_height(row0[0]);
+	float h10 = decode_height(row0[1]);
+	float h01 = decode_height(row1[0]);
+	float h11 = decode_height(row1[1]);
+
+	if (out_gradient) {
+		out_gradient->x = Math::lerp(h10 - h00, h11 - h01, yf);
+		out_gradient->y = Math::lerp(h01 - h00, h11 - h10, xf);
+	}
+
+	return Math::lerp(Math::lerp(h00, h10, xf), Math::lerp(h01, h11, xf), yf);
+}
+
+// Cells are split in two triangles along a diagonal that alternates like a checkerboard, the same way chunk meshes are.
+// Chunk sizes are even, so that parity is the same in chunk and map coordinates.
+// True if the cell at (x, y) is split along its 10-01 diagonal, false if along 00-11.
+inline bool is_cell_flipped(int x, int y) {
+	return ((x + y) & 1) != 0;
+}
+
+// Corners of both triangles of a cell, with the same winding as the mesh.
+// Corners are numbered 0: 00, 1: 10, 2: 01, 3: 11.
+inline const int *get_cell_triangles(int x, int y) {
+	static const int triangles[2][6] = {
+		{ 0, 3, 2, 0, 1, 3 },
+		{ 0, 1, 2, 1, 3, 2 }
+	};
+	return triangles[is_cell_flipped(x, y) ? 1 : 0];
+}
+
+// Height of the triangulated surface at a position within a cell, from 0 to 1 along X and Y.
+inline float get_cell_surface_height(float h00, float h10, float h01, float h11, float xf, float yf, bool flipped) {
+	if (flipped) {
+		if (xf + yf <= 1.f)
+			return h00 + (h10 - h00) * xf + (h01 - h00) * yf;
+		return h11 + (h01 - h11) * (1.f - xf) + (h10 - h11) * (1.f - yf);
+	}
+	if (xf >= yf)
+		return h00 + (h10 - h00) * xf + (h11 - h10) * yf;
+	return h00 + (h11 - h01) * xf + (h01 - h00) * yf;
+}
+
+// Hot loops depending on chunk size are compiled for each supported size,
+// and this picks the right version at runtime by calling `action.process<CHUNK_SIZE>()`.
+// Returns false if the size is not supported.
+template <typename Action_T>
+bool dispatch_chunk_size(int chunk_size, Action_T &action) {
+	switch (chunk_size) {
+		case 8:
+			action.template process<8>();
+			break;
+		case 16:
+			action.template process<16>();
+			break;
+		case 32:
+			action.template process<32>();
+			break;
+		case 64:
+			action.template process<64>();
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
 struct LockImage {
 	LockImage(Ref<Image> im) {
 		_im = im;